@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
@@ -42,16 +43,24 @@
 #include <ctype.h>
 // Unix socket
 #include <sys/un.h>
+// writev(), poll(), epoll
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/epoll.h>
+// getrlimit()
+#include <sys/resource.h>
 // Interfaces
 #include <ifaddrs.h>
 #include <net/if.h>
+// opendir()
+#include <dirent.h>
+// INT_MAX
+#include <limits.h>
 
 // Define MIN and MAX macros, use them only when x and y are of the same type
 #define MAX(x,y) (((x) > (y)) ? (x) : (y))
 // MIN(x,y) is already defined in dnsmasq.h
 
-#include "routines.h"
-
 // Next we define the step size in which the struct arrays are reallocated if they
 // grow too large. This number should be large enough so that reallocation does not
 // have to run very often, but should be as small as possible to avoid wasting memory
@@ -64,6 +73,13 @@
 
 #define SOCKETBUFFERLEN 1024
 
+// Size of the per-connection output buffer. Responses are collected in it
+// and sent in chunks of this size instead of one write() per field
+#define SOCKETOUTBUFFERLEN 65536
+
+// For how long do we wait for a client to accept more data? [milliseconds]
+#define SOCKETWRITETIMEOUT 10000
+
 // How often do we garbage collect (to ensure we only have data fitting to the MAXLOGAGE defined above)? [seconds]
 // Default: 3600 (once per hour)
 #define GCinterval 3600
@@ -72,23 +88,71 @@
 // Default -60 (one minute before a full hour)
 #define GCdelay (-60)
 
+// How many queries are written to the database at most in one transaction?
+// Full batches are committed right away, smaller ones every DBINTERVAL
+#define DBBATCHSIZE 1000
+
+// Size of the database's write-ahead log (in pages) after which it is
+// checkpointed into the main database file. Large values save SD card writes
+#define DBCHECKPOINTPAGES 4096
+
+// For how long may deleting old queries from the database run at once? [milliseconds]
+#define DBDELETEBUDGET 50
+
+// How many free pages are returned to the file system per incremental vacuum step?
+#define DBVACUUMPAGES 256
+
+// How many domains (and blocked domains) are kept per hourly or daily rollup?
+#define ROLLUPTOPDOMAINS 100
+
+// How many queries are sent per page of the database query log (by default / at most)?
+#define DBQUERYPAGE 100
+#define DBQUERYPAGEMAX 10000
+
+// How many API responses are kept in the response cache?
+#define APICACHESIZE 16
+
+// Largest page of a paginated >getallqueries request
+#define QUERYPAGEMAX 10000
+
+// Renumber the per-domain and per-client query lists after this many
+// queries have been removed by the GC
+#define QUERYINDEXRENUMBER (1 << 30)
+
 // How many client connection do we accept at once?
 #define MAXCONNS 255
 
+// How many threads answer API requests?
+#define APIWORKERS 4
+
+// How many connections may subscribe to the live query stream at once?
+#define STREAMMAX 16
+
+// How many queries are queued per stream subscriber before they are dropped?
+#define STREAMQUEUELEN 4096
+
+// Upper limit for the size of the per-connection state if the number of
+// open files is not limited
+#define MAXFDS 65536
+
 // Over how many queries do we iterate at most when trying to find a match?
 #define MAXITER 1000
 
 // FTLDNS enums
-enum { DATABASE_WRITE_TIMER, EXIT_TIMER, GC_TIMER, LISTS_TIMER, REGEX_TIMER };
+enum { DATABASE_WRITE_TIMER, EXIT_TIMER, GC_TIMER, LISTS_TIMER, REGEX_TIMER, RELOAD_TIMER, DATABASE_DELETE_TIMER, SNAPSHOT_TIMER };
 enum { QUERIES, FORWARDED, CLIENTS, DOMAINS, OVERTIME, WILDCARD };
 enum { DNSSEC_UNSPECIFIED, DNSSEC_SECURE, DNSSEC_INSECURE, DNSSEC_BOGUS, DNSSEC_ABANDONED, DNSSEC_UNKNOWN };
-enum { QUERY_UNKNOWN, QUERY_GRAVITY, QUERY_FORWARDED, QUERY_CACHE, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED };
+enum { QUERY_UNKNOWN, QUERY_GRAVITY, QUERY_FORWARDED, QUERY_CACHE, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED, QUERY_STATUS_MAX };
 enum { TYPE_A = 1, TYPE_AAAA, TYPE_ANY, TYPE_SRV, TYPE_SOA, TYPE_PTR, TYPE_TXT, TYPE_MAX };
 enum { REPLY_UNKNOWN, REPLY_NODATA, REPLY_NXDOMAIN, REPLY_CNAME, REPLY_IP, REPLY_DOMAIN, REPLY_RRNAME };
 enum { PRIVACY_SHOW_ALL = 0, PRIVACY_HIDE_DOMAINS, PRIVACY_HIDE_DOMAINS_CLIENTS, PRIVACY_MAXIMUM, PRIVACY_NOSTATS };
 enum { MODE_IP, MODE_NX, MODE_NULL, MODE_IP_NODATA_AAAA };
 enum { REGEX_UNKNOWN, REGEX_BLOCKED, REGEX_NOTBLOCKED };
 enum { BLOCKING_DISABLED, BLOCKING_ENABLED, BLOCKING_UNKNOWN };
+enum { LIST_GRAVITY, LIST_BLACKLIST, LIST_MAX };
+enum { PARSE_OK, PARSE_HOSTS, PARSE_FAILED };
+enum { TOPLIST_DOMAINS, TOPLIST_ADS, TOPLIST_CLIENTS, TOPLIST_BLOCKED_CLIENTS, TOPLIST_MAX };
+enum { ROLLUP_STATUS, ROLLUP_TYPE, ROLLUP_REPLY, ROLLUP_CLIENT, ROLLUP_UPSTREAM, ROLLUP_DOMAIN, ROLLUP_BLOCKED_DOMAIN };
 
 // Privacy mode constants
 #define HIDDEN_DOMAIN "hidden"
@@ -103,6 +167,7 @@ typedef struct {
 	char* port;
 	char* db;
 	char* socketfile;
+	char* snapshot;
 } FTLFileNamesStruct;
 
 typedef struct {
@@ -154,6 +219,9 @@ typedef struct {
 	bool regex_debugmode;
 	bool analyze_only_A_AAAA;
 	bool DBimport;
+	int DBpartition;
+	int APIcachettl;
+	int snapshotinterval;
 } ConfigStruct;
 
 // Dynamic structs
@@ -183,6 +251,7 @@ typedef struct {
 	char *ip;
 	char *name;
 	bool new;
+	int dbid;
 } forwardedDataStruct;
 
 typedef struct {
@@ -192,6 +261,7 @@ typedef struct {
 	char *ip;
 	char *name;
 	bool new;
+	int dbid;
 } clientsDataStruct;
 
 typedef struct {
@@ -200,6 +270,7 @@ typedef struct {
 	int blockedcount;
 	char *domain;
 	unsigned char regexmatch;
+	int dbid;
 } domainsDataStruct;
 
 typedef struct {
@@ -219,8 +290,114 @@ typedef struct {
 	char **domains;
 } whitelistStruct;
 
+typedef struct {
+	unsigned long commits;
+	unsigned long checkpoints;
+	unsigned int lastbatch;
+	unsigned int maxbatch;
+	double lastlatency;
+	double maxlatency;
+	double totallatency;
+	int walpages;
+} dbstatsStruct;
+
+typedef struct {
+	int queries;
+	int status[QUERY_STATUS_MAX];
+	int oldest;
+	int newest;
+	int pages;
+	int freepages;
+	int pagesize;
+	long int walsize;
+} dbcontentStruct;
+
+// Tokenized API request (see request.c), e.g. ">top-clients withzero (15)"
+#define APIMAXARGS 16
+typedef struct {
+	char *command;
+	int argc;
+	char *argv[APIMAXARGS];
+	int count;
+	bool quit;
+} apirequestStruct;
+
+// Filters of a database query log page. Only queries older than the cursor
+// (timestamp, id) are returned, the default cursor is the end of the interval
+typedef struct {
+	int from;
+	int cursortimestamp;
+	int cursorid;
+	const char *client;
+	const char *domain;
+	int status;
+	int type;
+	int limit;
+} dbqueryfilterStruct;
+
+// Compiled block lists (see gravity.c)
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t buckets;
+	uint32_t strsize;
+	int64_t srcmtime;
+	int64_t srcsize;
+	uint32_t reserved;
+	uint32_t checksum;
+} gravityHeaderStruct;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t offset;
+} gravitySlotStruct;
+
+typedef struct {
+	void *image;
+	size_t size;
+	bool mapped;
+	const gravityHeaderStruct *header;
+	const gravitySlotStruct *index;
+	const char *strings;
+	uint64_t *bloom;
+	uint32_t bloomblocks;
+	double bloomfpr;
+} blocklistStruct;
+
+// Snapshots of the in-memory data (see snapshot.c)
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t querysize;
+	uint32_t overtimesize;
+	uint32_t countersize;
+	int64_t written;
+	int64_t dbqueries;
+	int64_t lastdbindex;
+	uint32_t queries;
+	uint32_t forwarded;
+	uint32_t clients;
+	uint32_t domains;
+	uint32_t overtime;
+	uint32_t clientdata;
+	uint32_t strsize;
+	uint32_t datasum;
+	countersStruct counters;
+	uint32_t checksum;
+} snapshotHeaderStruct;
+
+typedef struct {
+	int32_t count;
+	int32_t blockedcount;
+	uint32_t key;
+	uint32_t name;
+} snapshotEntryStruct;
+
+#include "routines.h"
+
 // Prepare timers, used mainly for debugging purposes
-#define NUMTIMERS 5
+#define NUMTIMERS 8
 
 // Used to check memory integrity in various structs
 #define MAGICBYTE 0x57
@@ -229,6 +406,7 @@ extern logFileNamesStruct files;
 extern FTLFileNamesStruct FTLfiles;
 extern countersStruct counters;
 extern ConfigStruct config;
+extern dbstatsStruct dbstats;
 
 extern queriesDataStruct *queries;
 extern forwardedDataStruct *forwarded;
@@ -257,10 +435,10 @@ extern bool database;
 extern long int lastdbindex;
 extern bool travis;
 extern bool DBdeleteoldqueries;
-extern bool rereadgravity;
+extern volatile sig_atomic_t rereadgravity;
 extern long int lastDBimportedtimestamp;
 extern bool ipv4telnet, ipv6telnet;
-extern bool istelnet[MAXCONNS];
+extern bool *istelnet;
 
 // Use out own memory handling functions that will detect possible errors
 // and report accordingly in the log. This will make debugging FTL crashs
@@ -276,8 +454,6 @@ extern bool istelnet[MAXCONNS];
 extern int argc_dnsmasq;
 extern char **argv_dnsmasq;
 
-extern pthread_t telnet_listenthreadv4;
-extern pthread_t telnet_listenthreadv6;
 extern pthread_t socket_listenthread;
 extern pthread_t DBthread;
 extern pthread_t GCthread;
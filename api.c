@@ -14,20 +14,6 @@
 
 #define min(a,b) ({ __typeof__ (a) _a = (a); __typeof__ (b) _b = (b); _a < _b ? _a : _b; })
 
-/* qsort comparision function (count field), sort ASC */
-int cmpasc(const void *a, const void *b)
-{
-	int *elem1 = (int*)a;
-	int *elem2 = (int*)b;
-
-	if (elem1[1] < elem2[1])
-		return -1;
-	else if (elem1[1] > elem2[1])
-		return 1;
-	else
-		return 0;
-}
-
 // qsort subroutine, sort DESC
 int cmpdesc(const void *a, const void *b)
 {
@@ -160,12 +146,12 @@ void getOverTime(int *sock)
 	}
 }
 
-void getTopDomains(char *client_message, int *sock)
+void getTopDomains(apirequestStruct *request, int *sock)
 {
-	int i, temparray[counters.domains][2], count=10, num;
+	int i, count=10;
 	bool blocked, audit = false, asc = false;
 
-	blocked = command(client_message, ">top-ads");
+	blocked = strcmp(request->command, ">top-ads") == 0;
 
 	// Exit before processing any data if requested via config setting
 	get_privacy_level(NULL);
@@ -179,39 +165,24 @@ void getTopDomains(char *client_message, int *sock)
 
 	// Match both top-domains and top-ads
 	// example: >top-domains (15)
-	if(sscanf(client_message, "%*[^(](%i)", &num) > 0) {
+	if(request->count >= 0) {
 		// User wants a different number of requests
-		count = num;
+		count = request->count;
 	}
+	// (0) asks for the complete list
+	if(count <= 0)
+		count = counters.domains;
 
 	// Apply Audit Log filtering?
 	// example: >top-domains for audit
-	if(command(client_message, " for audit"))
+	if(request_flag(request, "audit"))
 		audit = true;
 
 	// Sort in ascending order?
 	// example: >top-domains asc
-	if(command(client_message, " asc"))
+	if(request_flag(request, "asc"))
 		asc = true;
 
-	for(i=0; i < counters.domains; i++)
-	{
-		validate_access("domains", i, true, __LINE__, __FUNCTION__, __FILE__);
-		temparray[i][0] = i;
-		if(blocked)
-			temparray[i][1] = domains[i].blockedcount;
-		else
-			// Count only permitted queries
-			temparray[i][1] = (domains[i].count - domains[i].blockedcount);
-	}
-
-	// Sort temporary array
-	if(asc)
-		qsort(temparray, counters.domains, sizeof(int[2]), cmpasc);
-	else
-		qsort(temparray, counters.domains, sizeof(int[2]), cmpdesc);
-
-
 	// Get filter
 	char * filter = read_setupVarsconf("API_QUERY_LOG_SHOW");
 	bool showpermitted = true, showblocked = true;
@@ -249,11 +220,16 @@ void getTopDomains(char *client_message, int *sock)
 			pack_int32(*sock, counters.queries);
 	}
 
+	// Walk the top list from the top (or, for asc, from the bottom)
+	int list = blocked ? TOPLIST_ADS : TOPLIST_DOMAINS;
+	int size = 0;
+	if((blocked && showblocked) || (!blocked && showpermitted))
+		size = toplist_size(list, true);
+
 	int n = 0;
-	for(i=0; i < counters.domains; i++)
+	for(i=0; i < size && n < count; i++)
 	{
-		// Get sorted indices
-		int j = temparray[i][0];
+		int value, j = toplist_get(list, asc ? size - 1 - i : i, &value);
 		validate_access("domains", j, true, __LINE__, __FUNCTION__, __FILE__);
 
 		// Skip this domain if there is a filter on it
@@ -261,70 +237,51 @@ void getTopDomains(char *client_message, int *sock)
 			continue;
 
 		// Skip this domain if already included in audit
-		if(audit && countlineswith(domains[j].domain, files.auditlist) > 0)
+		if(audit && in_auditlist(domains[j].domain))
 			continue;
 
 		// Hidden domain, probably due to privacy level. Skip this in the top lists
 		if(strcmp(domains[j].domain, HIDDEN_DOMAIN) == 0)
 			continue;
 
-		if(blocked && showblocked && domains[j].blockedcount > 0)
+		if(audit && blocked && domains[j].regexmatch == REGEX_BLOCKED)
 		{
-			if(audit && domains[j].regexmatch == REGEX_BLOCKED)
-			{
-				if(istelnet[*sock])
-					ssend(*sock, "%i %i %s wildcard\n", n, domains[j].blockedcount, domains[j].domain);
-				else {
-					char *fancyWildcard = calloc(3 + strlen(domains[j].domain), sizeof(char));
-					if(fancyWildcard == NULL) return;
-					sprintf(fancyWildcard, "*.%s", domains[j].domain);
-
-					if(!pack_str32(*sock, fancyWildcard))
-						return;
-
-					pack_int32(*sock, domains[j].blockedcount);
-					free(fancyWildcard);
-				}
-			}
-			else
-			{
-				if(istelnet[*sock])
-					ssend(*sock, "%i %i %s\n", n, domains[j].blockedcount, domains[j].domain);
-				else {
-					if(!pack_str32(*sock, domains[j].domain))
-						return;
+			if(istelnet[*sock])
+				ssend(*sock, "%i %i %s wildcard\n", n, value, domains[j].domain);
+			else {
+				char *fancyWildcard = calloc(3 + strlen(domains[j].domain), sizeof(char));
+				if(fancyWildcard == NULL) break;
+				sprintf(fancyWildcard, "*.%s", domains[j].domain);
 
-					pack_int32(*sock, domains[j].blockedcount);
-				}
+				bool sent = pack_str32(*sock, fancyWildcard);
+				free(fancyWildcard);
+				if(!sent)
+					break;
+
+				pack_int32(*sock, value);
 			}
-			n++;
 		}
-		else if(!blocked && showpermitted && (domains[j].count - domains[j].blockedcount) > 0)
+		else
 		{
 			if(istelnet[*sock])
-				ssend(*sock,"%i %i %s\n",n,(domains[j].count - domains[j].blockedcount),domains[j].domain);
-			else
-			{
+				ssend(*sock, "%i %i %s\n", n, value, domains[j].domain);
+			else {
 				if(!pack_str32(*sock, domains[j].domain))
-					return;
+					break;
 
-				pack_int32(*sock, domains[j].count - domains[j].blockedcount);
+				pack_int32(*sock, value);
 			}
-			n++;
 		}
-
-		// Only count entries that are actually sent and return when we have send enough data
-		if(n == count)
-			break;
+		n++;
 	}
 
 	if(excludedomains != NULL)
 		clearSetupVarsArray();
 }
 
-void getTopClients(char *client_message, int *sock)
+void getTopClients(apirequestStruct *request, int *sock)
 {
-	int i, temparray[counters.clients][2], count=10, num;
+	int i, count=10;
 
 	// Exit before processing any data if requested via config setting
 	get_privacy_level(NULL);
@@ -338,45 +295,34 @@ void getTopClients(char *client_message, int *sock)
 
 	// Match both top-domains and top-ads
 	// example: >top-clients (15)
-	if(sscanf(client_message, "%*[^(](%i)", &num) > 0) {
+	if(request->count >= 0) {
 		// User wants a different number of requests
-		count = num;
+		count = request->count;
 	}
+	// (0) asks for the complete list
+	if(count <= 0)
+		count = counters.clients;
 
 	// Show also clients which have not been active recently?
 	// This option can be combined with existing options,
 	// i.e. both >top-clients withzero" and ">top-clients withzero (123)" are valid
 	bool includezeroclients = false;
-	if(command(client_message, " withzero"))
+	if(request_flag(request, "withzero"))
 		includezeroclients = true;
 
 	// Show number of blocked queries instead of total number?
 	// This option can be combined with existing options,
 	// i.e. ">top-clients withzero blocked (123)" would be valid
 	bool blockedonly = false;
-	if(command(client_message, " blocked"))
+	if(request_flag(request, "blocked"))
 		blockedonly = true;
 
-	for(i=0; i < counters.clients; i++)
-	{
-		validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
-		temparray[i][0] = i;
-		// Use either blocked or total count based on request string
-		temparray[i][1] = blockedonly ? clients[i].blockedcount : clients[i].count;
-	}
-
 	// Sort in ascending order?
 	// example: >top-clients asc
 	bool asc = false;
-	if(command(client_message, " asc"))
+	if(request_flag(request, "asc"))
 		asc = true;
 
-	// Sort temporary array
-	if(asc)
-		qsort(temparray, counters.clients, sizeof(int[2]), cmpasc);
-	else
-		qsort(temparray, counters.clients, sizeof(int[2]), cmpdesc);
-
 	// Get clients which the user doesn't want to see
 	char * excludeclients = read_setupVarsconf("API_EXCLUDE_CLIENTS");
 	if(excludeclients != NULL)
@@ -390,12 +336,15 @@ void getTopClients(char *client_message, int *sock)
 		pack_int32(*sock, counters.queries);
 	}
 
+	// Walk the top list from the top (or, for asc, from the bottom). Clients
+	// without any queries are at the bottom and only included for "withzero"
+	int list = blockedonly ? TOPLIST_BLOCKED_CLIENTS : TOPLIST_CLIENTS;
+	int size = toplist_size(list, !includezeroclients);
+
 	int n = 0;
-	for(i=0; i < counters.clients; i++)
+	for(i=0; i < size && n < count; i++)
 	{
-		// Get sorted indices and counter values (may be either total or blocked count)
-		int j = temparray[i][0];
-		int ccount = temparray[i][1];
+		int ccount, j = toplist_get(list, asc ? size - 1 - i : i, &ccount);
 		validate_access("clients", j, true, __LINE__, __FUNCTION__, __FILE__);
 
 		// Skip this client if there is a filter on it
@@ -414,25 +363,16 @@ void getTopClients(char *client_message, int *sock)
 		else
 			name = "";
 
-		// Return this client if either
-		// - "withzero" option is set, and/or
-		// - the client made at least one query within the most recent 24 hours
-		if(includezeroclients || ccount > 0)
+		if(istelnet[*sock])
+			ssend(*sock,"%i %i %s %s\n", n, ccount, clients[j].ip, name);
+		else
 		{
-			if(istelnet[*sock])
-				ssend(*sock,"%i %i %s %s\n", n, ccount, clients[j].ip, name);
-			else
-			{
-				if(!pack_str32(*sock, "") || !pack_str32(*sock, clients[j].ip))
-					return;
+			if(!pack_str32(*sock, "") || !pack_str32(*sock, clients[j].ip))
+				break;
 
-				pack_int32(*sock, ccount);
-			}
-			n++;
+			pack_int32(*sock, ccount);
 		}
-
-		if(n == count)
-			break;
+		n++;
 	}
 
 	if(excludeclients != NULL)
@@ -440,12 +380,13 @@ void getTopClients(char *client_message, int *sock)
 }
 
 
-void getForwardDestinations(char *client_message, int *sock)
+void getForwardDestinations(apirequestStruct *request, int *sock)
 {
 	bool sort = true;
 	int i, temparray[counters.forwarded][2], forwardedsum = 0, totalqueries = 0;
 
-	if(command(client_message, "unsorted"))
+	// >forward-names is the same as >forward-dest unsorted
+	if(request_flag(request, "unsorted") || strcmp(request->command, ">forward-names") == 0)
 		sort = false;
 
 	for(i=0; i < counters.forwarded; i++) {
@@ -590,7 +531,109 @@ void getQueryTypes(int *sock)
 
 char *querytypes[8] = {"A","AAAA","ANY","SRV","SOA","PTR","TXT","UNKN"};
 
-void getAllQueries(char *client_message, int *sock)
+// Filters of >getallqueries which are not covered by the query indexes
+typedef struct {
+	int from;
+	int until;
+	int querytype;
+	int forwarddestid;
+	bool filterforwarddest;
+	bool showpermitted;
+	bool showblocked;
+} queryfilterStruct;
+
+static bool queryMatches(int i, const queryfilterStruct *filter)
+{
+	validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
+	// Check if this query has been create while in maximum privacy mode
+	if(queries[i].privacylevel >= PRIVACY_MAXIMUM)
+		return false;
+
+	// 1 = gravity.list, 4 = wildcard, 5 = black.list
+	if((queries[i].status == QUERY_GRAVITY ||
+	    queries[i].status == QUERY_WILDCARD ||
+	    queries[i].status == QUERY_BLACKLIST) && !filter->showblocked)
+		return false;
+	// 2 = forwarded, 3 = cached
+	if((queries[i].status == QUERY_FORWARDED ||
+	    queries[i].status == QUERY_CACHE) && !filter->showpermitted)
+		return false;
+
+	// Skip those entries which so not meet the requested timeframe
+	if((filter->from > queries[i].timestamp && filter->from != 0) ||
+	   (queries[i].timestamp > filter->until && filter->until != 0))
+		return false;
+
+	// Skip if query type is not identical with what the user wants to see
+	if(filter->querytype != 0 && filter->querytype != queries[i].type)
+		return false;
+
+	if(filter->filterforwarddest)
+	{
+		// Does the user want to see queries answered from blocking lists?
+		if(filter->forwarddestid == -2 && queries[i].status != QUERY_GRAVITY
+		                               && queries[i].status != QUERY_WILDCARD
+		                               && queries[i].status != QUERY_BLACKLIST)
+			return false;
+		// Does the user want to see queries answered from local cache?
+		else if(filter->forwarddestid == -1 && queries[i].status != QUERY_CACHE)
+			return false;
+		// Does the user want to see queries answered by an upstream server?
+		else if(filter->forwarddestid >= 0 && filter->forwarddestid != queries[i].forwardID)
+			return false;
+	}
+
+	return true;
+}
+
+// Send one row of the query log, also used for the live query stream
+bool sendQuery(int i, int *sock)
+{
+	validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
+	validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
+
+	char *qtype = querytypes[queries[i].type - TYPE_A];
+
+	// Ask subroutine for domain. It may return "hidden" depending on
+	// the privacy settings at the time the query was made
+	char *domain = getDomainString(i);
+	// Similarly for the client
+	char *client;
+	if(clients[queries[i].clientID].name != NULL &&
+	   strlen(clients[queries[i].clientID].name) > 0 &&
+	   queries[i].privacylevel < PRIVACY_HIDE_DOMAINS_CLIENTS)
+		client = clients[queries[i].clientID].name;
+	else
+		client = getClientIPString(i);
+
+	unsigned long delay = queries[i].response;
+	// Check if received (delay should be smaller than 30min)
+	if(delay > 1.8e7)
+		delay = 0;
+
+	if(istelnet[*sock])
+	{
+		ssend(*sock,"%i %s %s %s %i %i %i %lu\n",queries[i].timestamp,qtype,domain,client,queries[i].status,queries[i].dnssec,queries[i].reply,delay);
+	}
+	else
+	{
+		pack_int32(*sock, queries[i].timestamp);
+
+		// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
+		if(!pack_fixstr(*sock, qtype))
+			return false;
+
+		// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
+		if(!pack_str32(*sock, domain) || !pack_str32(*sock, client))
+			return false;
+
+		pack_uint8(*sock, queries[i].status);
+		pack_uint8(*sock, queries[i].dnssec);
+	}
+	return true;
+}
+
+void getAllQueries(apirequestStruct *request, int *sock)
 {
 	// Exit before processing any data if requested via config setting
 	get_privacy_level(NULL);
@@ -615,14 +658,15 @@ void getAllQueries(char *client_message, int *sock)
 	int forwarddestid = 0;
 
 	// Time filtering?
-	if(command(client_message, ">getallqueries-time")) {
-		sscanf(client_message, ">getallqueries-time %i %i",&from, &until);
+	if(strcmp(request->command, ">getallqueries-time") == 0) {
+		request_int(request, 0, &from);
+		request_int(request, 1, &until);
 	}
 
 	// Query type filtering?
-	if(command(client_message, ">getallqueries-qtype")) {
+	if(strcmp(request->command, ">getallqueries-qtype") == 0) {
 		// Get query type we want to see only
-		sscanf(client_message, ">getallqueries-qtype %i", &querytype);
+		request_int(request, 0, &querytype);
 		if(querytype < 1 || querytype >= TYPE_MAX)
 		{
 			// Invalid query type requested
@@ -631,11 +675,12 @@ void getAllQueries(char *client_message, int *sock)
 	}
 
 	// Forward destination filtering?
-	if(command(client_message, ">getallqueries-forward")) {
+	if(strcmp(request->command, ">getallqueries-forward") == 0) {
 		// Get forward destination name we want to see only (limit length to 255 chars)
 		forwarddest = calloc(256, sizeof(char));
 		if(forwarddest == NULL) return;
-		sscanf(client_message, ">getallqueries-forward %255s", forwarddest);
+		if(request->argc > 0)
+			strncpy(forwarddest, request->argv[0], 255);
 		filterforwarddest = true;
 
 		if(strcmp(forwarddest, "cache") == 0)
@@ -671,24 +716,14 @@ void getAllQueries(char *client_message, int *sock)
 	}
 
 	// Domain filtering?
-	if(command(client_message, ">getallqueries-domain")) {
+	if(strcmp(request->command, ">getallqueries-domain") == 0) {
 		// Get domain name we want to see only (limit length to 255 chars)
 		domainname = calloc(256, sizeof(char));
 		if(domainname == NULL) return;
-		sscanf(client_message, ">getallqueries-domain %255s", domainname);
+		if(request->argc > 0)
+			strncpy(domainname, request->argv[0], 255);
 		filterdomainname = true;
-		// Iterate through all known domains
-		int i;
-		validate_access("domains", MAX(0,counters.domains-1), true, __LINE__, __FUNCTION__, __FILE__);
-		for(i = 0; i < counters.domains; i++)
-		{
-			// Try to match the requested string
-			if(strcmp(domains[i].domain, domainname) == 0)
-			{
-				domainid = i;
-				break;
-			}
-		}
+		domainid = lookupDomainID(domainname);
 		if(domainid < 0)
 		{
 			// Requested domain has not been found, we directly
@@ -699,25 +734,22 @@ void getAllQueries(char *client_message, int *sock)
 	}
 
 	// Client filtering?
-	if(command(client_message, ">getallqueries-client")) {
+	if(strcmp(request->command, ">getallqueries-client") == 0) {
 		// Get client name we want to see only (limit length to 255 chars)
 		clientname = calloc(256, sizeof(char));
 		if(clientname == NULL) return;
-		sscanf(client_message, ">getallqueries-client %255s", clientname);
+		if(request->argc > 0)
+			strncpy(clientname, request->argv[0], 255);
 		filterclientname = true;
-		// Iterate through all known clients
+		// Try to match the requested string against the IP addresses first,
+		// then against the host names
+		clientid = lookupClientID(clientname);
 		int i;
-		validate_access("clients", MAX(0,counters.clients-1), true, __LINE__, __FUNCTION__, __FILE__);
-		for(i = 0; i < counters.clients; i++)
+		for(i = 0; clientid < 0 && i < counters.clients; i++)
 		{
-			// Try to match the requested string
-			if(strcmp(clients[i].ip, clientname) == 0 ||
-			   (clients[i].name != NULL &&
-			    strcmp(clients[i].name, clientname) == 0))
-			{
+			validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
+			if(clients[i].name != NULL && strcmp(clients[i].name, clientname) == 0)
 				clientid = i;
-				break;
-			}
 		}
 		if(clientid < 0)
 		{
@@ -728,13 +760,13 @@ void getAllQueries(char *client_message, int *sock)
 		}
 	}
 
-	int ibeg = 0, num;
+	int ibeg = 0;
 	// Test for integer that specifies number of entries to be shown
-	if(sscanf(client_message, "%*[^(](%i)", &num) > 0)
+	if(request->count >= 0)
 	{
 		// User wants a different number of requests
 		// Don't allow a start index that is smaller than zero
-		ibeg = counters.queries-num;
+		ibeg = counters.queries-request->count;
 		if(ibeg < 0)
 			ibeg = 0;
 	}
@@ -756,94 +788,102 @@ void getAllQueries(char *client_message, int *sock)
 	}
 	clearSetupVarsArray();
 
-	int i;
-	for(i=ibeg; i < counters.queries; i++)
-	{
-		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
-		// Check if this query has been create while in maximum privacy mode
-		if(queries[i].privacylevel >= PRIVACY_MAXIMUM) continue;
-
-		validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
-		validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
-
-		char *qtype = querytypes[queries[i].type - TYPE_A];
+	queryfilterStruct queryfilter = { from, until, querytype, forwarddestid, filterforwarddest, showpermitted, showblocked };
 
-		// 1 = gravity.list, 4 = wildcard, 5 = black.list
-		if((queries[i].status == QUERY_GRAVITY ||
-		    queries[i].status == QUERY_WILDCARD ||
-		    queries[i].status == QUERY_BLACKLIST) && !showblocked)
-			continue;
-		// 2 = forwarded, 3 = cached
-		if((queries[i].status == QUERY_FORWARDED ||
-		    queries[i].status == QUERY_CACHE) && !showpermitted)
-			continue;
+	// Only look at queries within the requested time frame
+	int iend = counters.queries;
+	if(from != 0)
+		ibeg = MAX(ibeg, queryindex_time(from));
+	if(until != 0)
+		iend = queryindex_time(until + 1);
 
-		// Skip those entries which so not meet the requested timeframe
-		if((from > queries[i].timestamp && from != 0) || (queries[i].timestamp > until && until != 0))
-			continue;
+	// Domain and client filters only walk the queries of this domain or
+	// client. Candidates are the positions [cbeg, cend) in either queries[]
+	// or the list of the domain or client
+	int which = -1, ID = -1, cbeg = ibeg, cend = iend;
+	if(filterdomainname)
+		which = DOMAINS, ID = domainid;
+	else if(filterclientname)
+		which = CLIENTS, ID = clientid;
+	if(which >= 0)
+	{
+		cbeg = queryindex_seek(which, ID, ibeg);
+		cend = queryindex_seek(which, ID, iend);
+	}
 
-		// Skip if domain is not identical with what the user wants to see
-		if(filterdomainname && queries[i].domainID != domainid)
-			continue;
+	// Paginated request?
+	// example: >getallqueries-client 192.168.2.10 limit 100 after 123456 asc
+	int limit = -1;
+	bool asc = request_flag(request, "asc");
+	if(request_int(request, request_option(request, "limit"), &limit))
+		limit = limit < 1 ? 1 : (limit > QUERYPAGEMAX ? QUERYPAGEMAX : limit);
 
-		// Skip if client name and IP are not identical with what the user wants to see
-		if(filterclientname && queries[i].clientID != clientid)
-			continue;
+	if(limit < 0)
+	{
+		// Send all matching queries, oldest first
+		for(int p = cbeg; p < cend; p++)
+		{
+			int i = which >= 0 ? queryindex_at(which, ID, p) : p;
+			if(queryMatches(i, &queryfilter) && !sendQuery(i, sock))
+				break;
+		}
+	}
+	else
+	{
+		// Total number of matching queries. Only filters not covered by
+		// the indexes need to look at the queries themselves
+		int total = cend - cbeg;
+		if(querytype != 0 || filterforwarddest || !showpermitted || !showblocked)
+		{
+			total = 0;
+			for(int p = cbeg; p < cend; p++)
+				if(queryMatches(which >= 0 ? queryindex_at(which, ID, p) : p, &queryfilter))
+					total++;
+		}
 
-		// Skip if query type is not identical with what the user wants to see
-		if(querytype != 0 && querytype != queries[i].type)
-			continue;
+		// Continue after the last query of the previous page. The cursor is
+		// the sequence number of this query which is not changed by the GC
+		long long cursor;
+		int option = request_option(request, "after");
+		if(option >= 0 && sscanf(request->argv[option], "%lld", &cursor) == 1)
+		{
+			int i = queryindex_query(cursor);
+			if(asc)
+				cbeg = MAX(cbeg, which >= 0 ? queryindex_seek(which, ID, i + 1) : i + 1);
+			else
+				cend = min(cend, which >= 0 ? queryindex_seek(which, ID, i) : i);
+		}
 
-		if(filterforwarddest)
+		// Walk the candidates newest first (or oldest first for asc) and stop
+		// at the first matching query which does not fit on this page
+		int sent = 0, last = -1;
+		bool more = false;
+		for(int p = asc ? cbeg : cend - 1; p >= cbeg && p < cend; p += asc ? 1 : -1)
 		{
-			// Does the user want to see queries answered from blocking lists?
-			if(forwarddestid == -2 && queries[i].status != QUERY_GRAVITY
-			                       && queries[i].status != QUERY_WILDCARD
-			                       && queries[i].status != QUERY_BLACKLIST)
-				continue;
-			// Does the user want to see queries answered from local cache?
-			else if(forwarddestid == -1 && queries[i].status != QUERY_CACHE)
-				continue;
-			// Does the user want to see queries answered by an upstream server?
-			else if(forwarddestid >= 0 && forwarddestid != queries[i].forwardID)
+			int i = which >= 0 ? queryindex_at(which, ID, p) : p;
+			if(!queryMatches(i, &queryfilter))
 				continue;
+			if(sent == limit)
+			{
+				more = true;
+				break;
+			}
+			if(!sendQuery(i, sock))
+				break;
+			last = i;
+			sent++;
 		}
 
-		// Ask subroutine for domain. It may return "hidden" depending on
-		// the privacy settings at the time the query was made
-		char *domain = getDomainString(i);
-		// Similarly for the client
-		char *client;
-		if(clients[queries[i].clientID].name != NULL &&
-		   strlen(clients[queries[i].clientID].name) > 0 &&
-		   queries[i].privacylevel < PRIVACY_HIDE_DOMAINS_CLIENTS)
-			client = clients[queries[i].clientID].name;
-		else
-			client = getClientIPString(i);
-
-		unsigned long delay = queries[i].response;
-		// Check if received (delay should be smaller than 30min)
-		if(delay > 1.8e7)
-			delay = 0;
-
 		if(istelnet[*sock])
 		{
-			ssend(*sock,"%i %s %s %s %i %i %i %lu\n",queries[i].timestamp,qtype,domain,client,queries[i].status,queries[i].dnssec,queries[i].reply,delay);
+			ssend(*sock, "total %i\n", total);
+			if(more)
+				ssend(*sock, "next %lld\n", queryindex_sequence(last));
 		}
 		else
 		{
-			pack_int32(*sock, queries[i].timestamp);
-
-			// Use a fixstr because the length of qtype is always 4 (max is 31 for fixstr)
-			if(!pack_fixstr(*sock, qtype))
-				return;
-
-			// Use str32 for domain and client because we have no idea how long they will be (max is 4294967295 for str32)
-			if(!pack_str32(*sock, domain) || !pack_str32(*sock, client))
-				return;
-
-			pack_uint8(*sock, queries[i].status);
-			pack_uint8(*sock, queries[i].dnssec);
+			pack_int32(*sock, total);
+			pack_int64(*sock, more ? queryindex_sequence(last) : -1);
 		}
 	}
 
@@ -858,13 +898,14 @@ void getAllQueries(char *client_message, int *sock)
 		free(forwarddest);
 }
 
-void getRecentBlocked(char *client_message, int *sock)
+void getRecentBlocked(apirequestStruct *request, int *sock)
 {
 	int i, num=1;
 
 	// Test for integer that specifies number of entries to be shown
-	if(sscanf(client_message, "%*[^(](%i)", &num) > 0) {
+	if(request->count >= 0) {
 		// User wants a different number of requests
+		num = request->count;
 		if(num >= counters.queries)
 			num = 0;
 	}
@@ -1001,22 +1042,51 @@ void getDBstats(int *sock)
 		// stat() failed (maybe the file does not exist?)
 		filesize = -1;
 	else
-		filesize = st.st_size;
+		filesize = st.st_size + db_partitions_filesize();
 
 	char *prefix = calloc(2, sizeof(char));
 	if(prefix == NULL) return;
 	double formated = 0.0;
 	format_memory_size(prefix, filesize, &formated);
 
+	// Counts are maintained while storing and deleting queries
+	dbcontentStruct content;
+	if(!get_DB_content(&content))
+		content.queries = -2;
+
 	if(istelnet[*sock])
-		ssend(*sock,"queries in database: %i\ndatabase filesize: %.2f %sB\nSQLite version: %s\n", get_number_of_queries_in_DB(), formated, prefix, sqlite3_libversion());
+	{
+		ssend(*sock,"queries in database: %i\ndatabase filesize: %.2f %sB\nSQLite version: %s\n", content.queries, formated, prefix, sqlite3_libversion());
+		ssend(*sock,"oldest query: %i\nnewest query: %i\n", content.oldest, content.newest);
+		ssend(*sock,"status unknown: %i\nstatus gravity: %i\nstatus forwarded: %i\nstatus cached: %i\nstatus wildcard: %i\nstatus blacklist: %i\nstatus external blocked: %i\n",
+		      content.status[QUERY_UNKNOWN], content.status[QUERY_GRAVITY], content.status[QUERY_FORWARDED], content.status[QUERY_CACHE],
+		      content.status[QUERY_WILDCARD], content.status[QUERY_BLACKLIST], content.status[QUERY_EXTERNAL_BLOCKED]);
+		ssend(*sock,"pages: %i\nfree pages: %i\npage size: %i\nWAL size: %li\n", content.pages, content.freepages, content.pagesize, content.walsize);
+		ssend(*sock,"commits: %lu\nlast batch size: %u\nmax batch size: %u\n", dbstats.commits, dbstats.lastbatch, dbstats.maxbatch);
+		ssend(*sock,"commit latency: %.1f ms\naverage commit latency: %.1f ms\nmax commit latency: %.1f ms\n",
+		      dbstats.lastlatency, dbstats.commits > 0 ? dbstats.totallatency/dbstats.commits : 0.0, dbstats.maxlatency);
+		ssend(*sock,"WAL pages: %i\ncheckpoints: %lu\n", dbstats.walpages, dbstats.checkpoints);
+	}
 	else {
-		pack_int32(*sock, get_number_of_queries_in_DB());
+		pack_int32(*sock, content.queries);
 		pack_int64(*sock, filesize);
 
 		if(!pack_str32(*sock, (char *) sqlite3_libversion()))
+		{
+			free(prefix);
 			return;
+		}
+
+		pack_int32(*sock, content.oldest);
+		pack_int32(*sock, content.newest);
+		for(int status = QUERY_UNKNOWN; status < QUERY_STATUS_MAX; status++)
+			pack_int32(*sock, content.status[status]);
+		pack_int32(*sock, content.pages);
+		pack_int32(*sock, content.freepages);
+		pack_int32(*sock, content.pagesize);
+		pack_int64(*sock, content.walsize);
 	}
+	free(prefix);
 }
 
 void getClientsOverTime(int *sock)
@@ -1206,15 +1276,15 @@ void getUnknownQueries(int *sock)
 	}
 }
 
-void getDomainDetails(char *client_message, int *sock)
+void getDomainDetails(apirequestStruct *request, int *sock)
 {
 	// Get domain name
-	char domain[128];
-	if(sscanf(client_message, "%*[^ ] %127s", domain) < 1)
+	if(request->argc < 1)
 	{
 		ssend(*sock, "Need domain for this request\n");
 		return;
 	}
+	const char *domain = request->argv[0];
 
 	int i;
 	for(i = 0; i < counters.domains; i++)
@@ -1240,3 +1310,361 @@ void getDomainDetails(char *client_message, int *sock)
 	// for loop finished without an exact match
 	ssend(*sock,"Domain \"%s\" is unknown\n", domain);
 }
+
+// Long-term history served from the rollup tables of the database. Rows
+// are collected first and processed once the database lock has been released
+typedef struct {
+	int timestamp;
+	int item;
+	int count;
+	char *name;
+} historyRowStruct;
+
+typedef struct {
+	historyRowStruct *rows;
+	int count;
+	int size;
+} historyRowsStruct;
+
+typedef struct {
+	int *sock;
+	int rank;
+	int timestamp;
+	int total;
+	int blocked;
+	int *counts;
+	int max;
+} historyStruct;
+
+static void historyOverTimeRow(int timestamp, int item, const char *name, int count, void *arg)
+{
+	historyStruct *history = arg;
+	if(timestamp != history->timestamp)
+	{
+		if(history->total > 0 && istelnet[*history->sock])
+			ssend(*history->sock, "%i %i %i\n", history->timestamp, history->total, history->blocked);
+		else if(history->total > 0)
+		{
+			pack_int32(*history->sock, history->timestamp);
+			pack_int32(*history->sock, history->total);
+			pack_int32(*history->sock, history->blocked);
+		}
+		history->timestamp = timestamp;
+		history->total = 0;
+		history->blocked = 0;
+	}
+
+	history->total += count;
+	if(item == QUERY_GRAVITY || item == QUERY_WILDCARD ||
+	   item == QUERY_BLACKLIST || item == QUERY_EXTERNAL_BLOCKED)
+		history->blocked += count;
+}
+
+static void historyTopRow(int timestamp, int item, const char *name, int count, void *arg)
+{
+	historyStruct *history = arg;
+	if(istelnet[*history->sock])
+		ssend(*history->sock, "%i %i %s\n", history->rank++, count, name != NULL ? name : "");
+	else
+	{
+		pack_str32(*history->sock, name != NULL ? (char *)name : "");
+		pack_int32(*history->sock, count);
+	}
+}
+
+static void historyCountRow(int timestamp, int item, const char *name, int count, void *arg)
+{
+	historyStruct *history = arg;
+	if(item >= 0 && item < history->max)
+		history->counts[item] += count;
+}
+
+static void historyCollectRow(int timestamp, int item, const char *name, int count, void *arg)
+{
+	historyRowsStruct *rows = arg;
+	if(rows->count == rows->size)
+	{
+		rows->size = rows->size > 0 ? 2*rows->size : 64;
+		historyRowStruct *grown = realloc(rows->rows, rows->size*sizeof(historyRowStruct));
+		if(grown == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
+		rows->rows = grown;
+	}
+
+	historyRowStruct *row = &rows->rows[rows->count++];
+	row->timestamp = timestamp;
+	row->item = item;
+	row->count = count;
+	row->name = NULL;
+	if(name != NULL && (row->name = strdup(name)) == NULL)
+	{
+		logg("FATAL: Memory allocation failed! Exiting");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void readHistory(bool daily, int kind, int from, int until, bool totals, int limit,
+                        void (*callback)(int timestamp, int item, const char *name, int count, void *arg), historyStruct *history)
+{
+	historyRowsStruct rows = { NULL, 0, 0 };
+	db_read_rollups(daily, kind, from, until, totals, limit, historyCollectRow, &rows);
+
+	for(int i = 0; i < rows.count; i++)
+	{
+		callback(rows.rows[i].timestamp, rows.rows[i].item, rows.rows[i].name, rows.rows[i].count, history);
+		if(rows.rows[i].name != NULL)
+			free(rows.rows[i].name);
+	}
+	if(rows.rows != NULL)
+		free(rows.rows);
+}
+
+void getHistory(apirequestStruct *request, int *sock)
+{
+	historyStruct history = { sock, 0, 0, 0, 0, NULL, 0 };
+	int from, until, count = 10;
+	const char *cmd = request->command;
+
+	// example: >history-top-domains 1546300800 1548979200 daily (20)
+	if(!request_int(request, 0, &from) || !request_int(request, 1, &until))
+	{
+		ssend(*sock, "Need time interval for this request\n");
+		return;
+	}
+	bool daily = request_flag(request, "daily");
+	if(request->count >= 0)
+		count = request->count;
+	// (0) asks for the complete list, SQLite does not limit negative counts
+	if(count <= 0)
+		count = -1;
+
+	get_privacy_level(NULL);
+	if((strcmp(cmd, ">history-top-domains") == 0 || strcmp(cmd, ">history-top-ads") == 0) &&
+	   config.privacylevel >= PRIVACY_HIDE_DOMAINS)
+		return;
+	if(strcmp(cmd, ">history-top-clients") == 0 && config.privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
+		return;
+
+	// Neither reading from the database nor sending the result to a slow
+	// client may hold up DNS processing, the thread lock is not needed
+	// from here on
+	disable_thread_lock();
+	if(strcmp(cmd, ">history-overTime") == 0)
+	{
+		readHistory(daily, ROLLUP_STATUS, from, until, false, 0, historyOverTimeRow, &history);
+		// Send last bucket
+		historyOverTimeRow(0, QUERY_UNKNOWN, NULL, 0, &history);
+	}
+	else if(strcmp(cmd, ">history-top-domains") == 0 || strcmp(cmd, ">history-top-ads") == 0)
+	{
+		int kind = strcmp(cmd, ">history-top-ads") == 0 ? ROLLUP_BLOCKED_DOMAIN : ROLLUP_DOMAIN;
+		readHistory(daily, kind, from, until, true, count, historyTopRow, &history);
+	}
+	else if(strcmp(cmd, ">history-top-clients") == 0)
+	{
+		readHistory(daily, ROLLUP_CLIENT, from, until, true, count, historyTopRow, &history);
+	}
+	else if(strcmp(cmd, ">history-forward-dest") == 0)
+	{
+		readHistory(daily, ROLLUP_UPSTREAM, from, until, true, count, historyTopRow, &history);
+	}
+	else if(strcmp(cmd, ">history-querytypes") == 0)
+	{
+		int types[TYPE_MAX] = { 0 };
+		history.counts = types;
+		history.max = TYPE_MAX;
+		readHistory(daily, ROLLUP_TYPE, from, until, true, TYPE_MAX, historyCountRow, &history);
+		for(int i = TYPE_A; i < TYPE_MAX; i++)
+		{
+			if(istelnet[*sock])
+				ssend(*sock, "%s: %i\n", querytypes[i - TYPE_A], types[i]);
+			else
+			{
+				pack_str32(*sock, querytypes[i - TYPE_A]);
+				pack_int32(*sock, types[i]);
+			}
+		}
+	}
+	else if(strcmp(cmd, ">history-summary") == 0)
+	{
+		int status[QUERY_EXTERNAL_BLOCKED+1] = { 0 }, reply[REPLY_RRNAME+1] = { 0 };
+		history.counts = status;
+		history.max = QUERY_EXTERNAL_BLOCKED+1;
+		readHistory(daily, ROLLUP_STATUS, from, until, true, history.max, historyCountRow, &history);
+		history.counts = reply;
+		history.max = REPLY_RRNAME+1;
+		readHistory(daily, ROLLUP_REPLY, from, until, true, history.max, historyCountRow, &history);
+
+		int total = 0;
+		for(int i = 0; i <= QUERY_EXTERNAL_BLOCKED; i++)
+			total += status[i];
+		int blocked = status[QUERY_GRAVITY] + status[QUERY_WILDCARD] + status[QUERY_BLACKLIST] + status[QUERY_EXTERNAL_BLOCKED];
+		if(istelnet[*sock])
+		{
+			ssend(*sock, "dns_queries %i\nads_blocked %i\nqueries_forwarded %i\nqueries_cached %i\n",
+			      total, blocked, status[QUERY_FORWARDED], status[QUERY_CACHE]);
+			ssend(*sock, "reply_NODATA %i\nreply_NXDOMAIN %i\nreply_CNAME %i\nreply_IP %i\n",
+			      reply[REPLY_NODATA], reply[REPLY_NXDOMAIN], reply[REPLY_CNAME], reply[REPLY_IP]);
+		}
+		else
+		{
+			pack_int32(*sock, total);
+			pack_int32(*sock, blocked);
+			pack_int32(*sock, status[QUERY_FORWARDED]);
+			pack_int32(*sock, status[QUERY_CACHE]);
+			pack_int32(*sock, reply[REPLY_NODATA]);
+			pack_int32(*sock, reply[REPLY_NXDOMAIN]);
+			pack_int32(*sock, reply[REPLY_CNAME]);
+			pack_int32(*sock, reply[REPLY_IP]);
+		}
+	}
+	enable_thread_lock();
+}
+
+// Query log served from the database page by page. A page is collected
+// first and sent once the database lock has been released
+typedef struct {
+	int id;
+	int timestamp;
+	int type;
+	int status;
+	char *domain;
+	char *client;
+} dbqueryRowStruct;
+
+typedef struct {
+	dbqueryRowStruct *rows;
+	int count;
+} dbqueriesStruct;
+
+static void dbQueriesRow(int id, int timestamp, int type, int status, const char *domain, const char *client, void *arg)
+{
+	dbqueriesStruct *page = arg;
+	dbqueryRowStruct *row = &page->rows[page->count++];
+	row->id = id;
+	row->timestamp = timestamp;
+	row->type = type;
+	row->status = status;
+	row->domain = strdup(domain != NULL ? domain : "");
+	row->client = strdup(client != NULL ? client : "");
+	if(row->domain == NULL || row->client == NULL)
+	{
+		logg("FATAL: Memory allocation failed! Exiting");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void sendDBQuery(const dbqueryRowStruct *row, int *sock)
+{
+	int type = row->type;
+	char *qtype = querytypes[type >= TYPE_A && type < TYPE_MAX ? type - TYPE_A : TYPE_MAX - TYPE_A];
+	if(istelnet[*sock])
+		ssend(*sock, "%i %s %s %s %i %i\n", row->timestamp, qtype, row->domain, row->client, row->status, row->id);
+	else
+	{
+		pack_int32(*sock, row->timestamp);
+		pack_fixstr(*sock, qtype);
+		pack_str32(*sock, row->domain);
+		pack_str32(*sock, row->client);
+		pack_uint8(*sock, row->status);
+		pack_int32(*sock, row->id);
+	}
+}
+
+void getDBQueries(apirequestStruct *request, int *sock)
+{
+	// Exit before processing any data if requested via config setting
+	get_privacy_level(NULL);
+	if(config.privacylevel >= PRIVACY_MAXIMUM)
+		return;
+
+	// example: >dbqueries 1546300800 1548979200 client 192.168.2.10 domain example.com status 2 type 1 after 1548900000 123456 (100)
+	int from, until;
+	if(!request_int(request, 0, &from) || !request_int(request, 1, &until))
+	{
+		ssend(*sock, "Need time interval for this request\n");
+		return;
+	}
+
+	dbqueryfilterStruct filter = { from, until, INT_MAX, NULL, NULL, -1, 0, DBQUERYPAGE };
+	char *clientip = NULL;
+	int option;
+	if((option = request_option(request, "client")) >= 0)
+	{
+		filter.client = request->argv[option];
+		// Clients are stored by their IP address
+		for(int i = 0; i < counters.clients; i++)
+		{
+			validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
+			if(clients[i].name != NULL && strcmp(clients[i].name, filter.client) == 0)
+			{
+				clientip = strdup(clients[i].ip);
+				if(clientip == NULL)
+				{
+					logg("FATAL: Memory allocation failed! Exiting");
+					exit(EXIT_FAILURE);
+				}
+				filter.client = clientip;
+				break;
+			}
+		}
+	}
+	if((option = request_option(request, "domain")) >= 0)
+	{
+		strtolower(request->argv[option]);
+		filter.domain = request->argv[option];
+	}
+	request_int(request, request_option(request, "status"), &filter.status);
+	request_int(request, request_option(request, "type"), &filter.type);
+	if((option = request_option(request, "after")) >= 0)
+	{
+		request_int(request, option, &filter.cursortimestamp);
+		request_int(request, option + 1, &filter.cursorid);
+		// A cursor beyond the end of the interval must not widen it
+		if(filter.cursortimestamp > until)
+		{
+			filter.cursortimestamp = until;
+			filter.cursorid = INT_MAX;
+		}
+	}
+	if(request->count >= 0)
+		filter.limit = request->count < 1 ? 1 : (request->count > DBQUERYPAGEMAX ? DBQUERYPAGEMAX : request->count);
+
+	dbqueriesStruct page = { calloc(filter.limit, sizeof(dbqueryRowStruct)), 0 };
+	if(page.rows == NULL)
+	{
+		logg("FATAL: Memory allocation failed! Exiting");
+		exit(EXIT_FAILURE);
+	}
+
+	// Neither reading from the database nor sending the page to a slow
+	// client may hold up DNS processing, the thread lock is not needed
+	// from here on
+	disable_thread_lock();
+	int found = db_read_queries(&filter, dbQueriesRow, &page);
+
+	for(int i = 0; i < page.count; i++)
+	{
+		sendDBQuery(&page.rows[i], sock);
+		free(page.rows[i].domain);
+		free(page.rows[i].client);
+	}
+
+	// Continue with "after <timestamp> <id>" if there are more queries
+	bool more = found > filter.limit && page.count > 0;
+	if(istelnet[*sock])
+	{
+		if(more)
+			ssend(*sock, "next %i %i\n", page.rows[page.count-1].timestamp, page.rows[page.count-1].id);
+	}
+	else
+		pack_bool(*sock, more);
+
+	free(page.rows);
+	if(clientip != NULL)
+		free(clientip);
+	enable_thread_lock();
+}
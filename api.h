@@ -11,16 +11,19 @@
 // Statistic methods
 void getStats(int *sock);
 void getOverTime(int *sock);
-void getTopDomains(char *client_message, int *sock);
-void getTopClients(char *client_message, int *sock);
-void getForwardDestinations(char *client_message, int *sock);
+void getTopDomains(apirequestStruct *request, int *sock);
+void getTopClients(apirequestStruct *request, int *sock);
+void getForwardDestinations(apirequestStruct *request, int *sock);
 void getQueryTypes(int *sock);
-void getAllQueries(char *client_message, int *sock);
-void getRecentBlocked(char *client_message, int *sock);
+void getAllQueries(apirequestStruct *request, int *sock);
+void getRecentBlocked(apirequestStruct *request, int *sock);
 void getQueryTypesOverTime(int *sock);
 void getClientsOverTime(int *sock);
 void getClientNames(int *sock);
-void getDomainDetails(char *client_message, int *sock);
+void getDomainDetails(apirequestStruct *request, int *sock);
+void getHistory(apirequestStruct *request, int *sock);
+void getDBQueries(apirequestStruct *request, int *sock);
+bool sendQuery(int i, int *sock);
 
 // FTL methods
 void getClientID(int *sock);
@@ -31,6 +34,9 @@ void getUnknownQueries(int *sock);
 // DNS resolver methods (dnsmasq_interface.c)
 void getCacheInformation(int *sock);
 
+// Live query stream (stream.c)
+void getQueryStream(apirequestStruct *request, int *sock);
+
 // MessagePack serialization helpers
 void pack_eom(int sock);
 void pack_bool(int sock, bool value);
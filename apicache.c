@@ -0,0 +1,125 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2018 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  API response cache
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+
+// Dashboards poll the same summary requests over and over. Their serialized
+// responses are kept for APICACHETTL and sent again as they are. Entries are
+// keyed by the normalized request, the output format and the privacy level.
+// Changes which are not just new queries being counted (GC, reloaded lists,
+// ...) invalidate all entries at once. The cache is only used while holding
+// the thread lock
+typedef struct {
+	char *key;
+	bool telnet;
+	unsigned char privacylevel;
+	unsigned int generation;
+	long long created;
+	char *data;
+	size_t size;
+} apicacheStruct;
+
+static apicacheStruct cache[APICACHESIZE];
+static unsigned int generation = 0;
+
+// Milliseconds on a clock which is not affected by changes of the time
+static long long apicache_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+
+// The command, its arguments and the count separated by single spaces
+static void apicache_key(const apirequestStruct *request, char *key, size_t size)
+{
+	size_t len = snprintf(key, size, "%s", request->command);
+	for(int i = 0; i < request->argc && len < size; i++)
+		len += snprintf(key + len, size - len, " %s", request->argv[i]);
+	if(request->count >= 0 && len < size)
+		snprintf(key + len, size - len, " (%i)", request->count);
+}
+
+static apicacheStruct *apicache_find(const char *key, bool telnet)
+{
+	for(int i = 0; i < APICACHESIZE; i++)
+		if(cache[i].key != NULL && cache[i].telnet == telnet &&
+		   cache[i].privacylevel == config.privacylevel &&
+		   strcmp(cache[i].key, key) == 0)
+			return &cache[i];
+	return NULL;
+}
+
+// Answer the request from the cache if there is a recent enough response
+bool apicache_send(const apirequestStruct *request, int sock)
+{
+	if(config.APIcachettl <= 0)
+		return false;
+
+	char key[SOCKETBUFFERLEN + 16];
+	apicache_key(request, key, sizeof(key));
+	get_privacy_level(NULL);
+
+	apicacheStruct *entry = apicache_find(key, istelnet[sock]);
+	if(entry == NULL || entry->generation != generation ||
+	   apicache_now() - entry->created >= config.APIcachettl)
+		return false;
+
+	swrite(sock, entry->data, entry->size);
+	return true;
+}
+
+// Remember the response to this request if it is still in the output buffer
+void apicache_store(const apirequestStruct *request, int sock)
+{
+	const char *data;
+	size_t size;
+	if(config.APIcachettl <= 0 || !sbuffered(sock, &data, &size))
+		return;
+
+	char key[SOCKETBUFFERLEN + 16];
+	apicache_key(request, key, sizeof(key));
+
+	// Replace the previous response to this request or the oldest one
+	apicacheStruct *entry = apicache_find(key, istelnet[sock]);
+	for(int i = 0; entry == NULL && i < APICACHESIZE; i++)
+		if(cache[i].key == NULL)
+			entry = &cache[i];
+	for(int i = 0; entry == NULL && i < APICACHESIZE; i++)
+		if(i == 0 || cache[i].created < entry->created)
+			entry = &cache[i];
+
+	char *copy = malloc(size > 0 ? size : 1);
+	if(copy == NULL)
+		return;
+	memcpy(copy, data, size);
+
+	if(entry->key == NULL || strcmp(entry->key, key) != 0)
+	{
+		if(entry->key != NULL)
+			free(entry->key);
+		entry->key = strdup(key);
+	}
+	if(entry->data != NULL)
+		free(entry->data);
+
+	entry->telnet = istelnet[sock];
+	entry->privacylevel = config.privacylevel;
+	entry->generation = generation;
+	entry->created = apicache_now();
+	entry->data = copy;
+	entry->size = size;
+}
+
+// Drop all cached responses. Has to be called with the thread lock held
+void apicache_invalidate(void)
+{
+	generation++;
+}
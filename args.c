@@ -106,6 +106,17 @@ void parse_args(int argc, char* argv[])
 			ok = true;
 		}
 
+		// Compile gravity.list and black.list into the binary
+		// format that is mapped into memory at startup
+		if(strcmp(argv[i], "--compile-gravity") == 0)
+		{
+			open_FTL_log(true);
+			read_FTLconf();
+			bool success = gravity_compile(files.gravity);
+			success = gravity_compile(files.blacklist) && success;
+			exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
 		// If we find "--" we collect everything behind that for dnsmasq
 		if(strcmp(argv[i], "--") == 0)
 		{
@@ -143,6 +154,8 @@ void parse_args(int argc, char* argv[])
 			printf("\t-h, help          Display this help and exit\n");
 			printf("\tdnsmasq-test      Test syntax of dnsmasq's\n");
 			printf("\t                  config files and exit\n");
+			printf("\t--compile-gravity Compile gravity.list and\n");
+			printf("\t                  black.list for fast loading\n");
 			printf("\n\nOnline help: https://github.com/pi-hole/FTL\n");
 			exit(EXIT_SUCCESS);
 		}
@@ -0,0 +1,264 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2018 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Audit list
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include <sys/inotify.h>
+
+// The audit list is kept in memory as
+//   - a hash set of all entries (matched exactly)
+//   - a trie of the reversed wildcard entries: "*example.com" matches every
+//     domain ending in "example.com"
+// It is read once and read again whenever the file changes on disk
+typedef struct {
+	unsigned char c;
+	bool end;
+	int child;
+	int sibling;
+} audittrieStruct;
+
+typedef struct {
+	char **slots;
+	unsigned int size;
+	unsigned int count;
+	audittrieStruct *trie;
+	int nodes;
+	int capacity;
+} auditlistStruct;
+
+static auditlistStruct auditlist = { NULL, 0, 0, NULL, 0, 0 };
+static int inotifyfd = -1;
+
+// FNV-1a
+static unsigned int audit_hash(const char *str)
+{
+	unsigned int hash = 2166136261U;
+	while(*str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void audit_set_slot(char **slots, unsigned int size, char *entry)
+{
+	unsigned int mask = size - 1;
+	unsigned int pos = audit_hash(entry) & mask;
+	while(slots[pos] != NULL)
+		pos = (pos + 1) & mask;
+	slots[pos] = entry;
+}
+
+// Add an entry to the set, which is kept at most half full
+static void audit_set_add(auditlistStruct *list, const char *entry)
+{
+	unsigned int mask = list->size - 1;
+	for(unsigned int pos = audit_hash(entry) & mask; list->slots[pos] != NULL; pos = (pos + 1) & mask)
+		if(strcmp(list->slots[pos], entry) == 0)
+			return;
+
+	if(2*(list->count + 1) > list->size)
+	{
+		char **slots = calloc(2*list->size, sizeof(char*));
+		if(slots == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
+		for(unsigned int i = 0; i < list->size; i++)
+			if(list->slots[i] != NULL)
+				audit_set_slot(slots, 2*list->size, list->slots[i]);
+		free(list->slots);
+		list->slots = slots;
+		list->size *= 2;
+	}
+
+	audit_set_slot(list->slots, list->size, strdup(entry));
+	list->count++;
+}
+
+// Child of a trie node for the given character, added if requested
+static int audit_trie_child(auditlistStruct *list, int node, unsigned char c, bool add)
+{
+	int child;
+	for(child = list->trie[node].child; child > 0; child = list->trie[child].sibling)
+		if(list->trie[child].c == c)
+			return child;
+
+	if(!add)
+		return 0;
+
+	if(list->nodes == list->capacity)
+	{
+		int capacity = 2*list->capacity;
+		audittrieStruct *trie = realloc(list->trie, capacity*sizeof(audittrieStruct));
+		if(trie == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
+		list->trie = trie;
+		list->capacity = capacity;
+	}
+
+	child = list->nodes++;
+	list->trie[child].c = c;
+	list->trie[child].end = false;
+	list->trie[child].child = 0;
+	list->trie[child].sibling = list->trie[node].child;
+	list->trie[node].child = child;
+	return child;
+}
+
+static void audit_trie_add(auditlistStruct *list, const char *suffix)
+{
+	// The root matches everything, an empty suffix ("*") matches nothing
+	size_t len = strlen(suffix);
+	if(len == 0)
+		return;
+
+	int node = 0;
+	while(len > 0)
+		node = audit_trie_child(list, node, suffix[--len], true);
+	list->trie[node].end = true;
+}
+
+static void audit_free(auditlistStruct *list)
+{
+	for(unsigned int i = 0; i < list->size; i++)
+		if(list->slots[i] != NULL)
+			free(list->slots[i]);
+	if(list->slots != NULL)
+		free(list->slots);
+	if(list->trie != NULL)
+		free(list->trie);
+}
+
+// Read the audit list into a new set and swap it in
+static void audit_reload(void)
+{
+	auditlistStruct new = { NULL, 64, 0, NULL, 1, 64 };
+	FILE *fp = fopen(files.auditlist, "r");
+	if(fp != NULL)
+	{
+		new.slots = calloc(new.size, sizeof(char*));
+		new.trie = calloc(new.capacity, sizeof(audittrieStruct));
+		if(new.slots == NULL || new.trie == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
+
+		char *buffer = NULL;
+		size_t size = 0;
+		while(getline(&buffer, &size, fp) != -1)
+		{
+			// Strip potential newline character at the end of line we just read
+			size_t len = strlen(buffer);
+			if(len > 0 && buffer[len-1] == '\n')
+				buffer[len-1] = '\0';
+
+			if(buffer[0] == '*')
+				audit_trie_add(&new, buffer+1);
+			audit_set_add(&new, buffer);
+		}
+		if(buffer != NULL)
+			free(buffer);
+		fclose(fp);
+	}
+	else
+		new.size = 0;
+
+	enable_thread_lock();
+	auditlistStruct old = auditlist;
+	auditlist = new;
+	apicache_invalidate();
+	disable_thread_lock();
+
+	audit_free(&old);
+}
+
+// Read the audit list and watch its directory for changes
+void audit_init(void)
+{
+	inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotifyfd < 0)
+		logg("WARN: Cannot watch %s for changes: %s", files.auditlist, strerror(errno));
+	else
+	{
+		char *dir = strdup(files.auditlist);
+		char *slash = strrchr(dir, '/');
+		if(slash != NULL)
+			*(slash == dir ? slash + 1 : slash) = '\0';
+		else
+			strcpy(dir, ".");
+
+		if(inotify_add_watch(inotifyfd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0)
+			logg("WARN: Cannot watch %s for changes: %s", files.auditlist, strerror(errno));
+		free(dir);
+	}
+
+	audit_reload();
+}
+
+// Read the audit list again if it changed on disk. Called periodically
+void audit_check(void)
+{
+	if(inotifyfd < 0)
+		return;
+
+	const char *name = strrchr(files.auditlist, '/');
+	name = name != NULL ? name + 1 : files.auditlist;
+
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	bool changed = false;
+	ssize_t len;
+	while((len = read(inotifyfd, buffer, sizeof(buffer))) > 0)
+	{
+		for(char *ptr = buffer; ptr < buffer + len; )
+		{
+			const struct inotify_event *event = (const struct inotify_event *)ptr;
+			if(event->len > 0 && strcmp(event->name, name) == 0)
+				changed = true;
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+
+	if(changed)
+	{
+		audit_reload();
+		if(debug) logg("Reloaded %s", files.auditlist);
+	}
+}
+
+// Is the domain on the audit list, either exactly or through a wildcard
+// entry? Has to be called with the thread lock held
+bool in_auditlist(const char *domain)
+{
+	if(auditlist.size == 0)
+		return false;
+
+	unsigned int mask = auditlist.size - 1;
+	for(unsigned int pos = audit_hash(domain) & mask; auditlist.slots[pos] != NULL; pos = (pos + 1) & mask)
+		if(strcmp(auditlist.slots[pos], domain) == 0)
+			return true;
+
+	// Walk the trie from the end of the domain
+	int node = 0;
+	for(size_t len = strlen(domain); len > 0; )
+	{
+		node = audit_trie_child(&auditlist, node, domain[--len], false);
+		if(node == 0)
+			return false;
+		if(auditlist.trie[node].end)
+			return true;
+	}
+	return false;
+}
@@ -183,6 +183,26 @@ void read_FTLconf(void)
 	else
 		logg("   DBFILE: Not using database due to empty filename");
 
+	// SNAPSHOTFILE
+	// defaults to: "/etc/pihole/pihole-FTL.snapshot"
+	buffer = parse_FTLconf(fp, "SNAPSHOTFILE");
+
+	errno = 0;
+	// An empty file name disables snapshots
+	if(!(buffer != NULL && sscanf(buffer, "%127ms", &FTLfiles.snapshot)))
+		FTLfiles.snapshot = strdup("/etc/pihole/pihole-FTL.snapshot");
+
+	// Test if memory allocation was successful
+	if(FTLfiles.snapshot == NULL && errno != 0)
+	{
+		logg("FATAL: Allocating memory for FTLfiles.snapshot failed (%s, %i). Exiting.", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	else if(FTLfiles.snapshot != NULL && strlen(FTLfiles.snapshot) > 0)
+		logg("   SNAPSHOTFILE: Using %s", FTLfiles.snapshot);
+	else
+		logg("   SNAPSHOTFILE: Not using snapshots due to empty filename");
+
 	// FTLPORT
 	// On which port should FTL be listening?
 	// defaults to: 4711
@@ -289,6 +309,62 @@ void read_FTLconf(void)
 	else
 		logg("   DBIMPORT: Not importing history from database");
 
+	// DBPARTITION
+	// Store queries in one database file per day or week
+	// The queries view in DBFILE does not cover these files, they are
+	// only readable through the API (>dbqueries, >history-*)
+	// defaults to: none (all queries are stored in DBFILE)
+	config.DBpartition = 0;
+	buffer = parse_FTLconf(fp, "DBPARTITION");
+
+	if(buffer != NULL && strcasecmp(buffer, "day") == 0)
+		config.DBpartition = 86400;
+	else if(buffer != NULL && strcasecmp(buffer, "week") == 0)
+		config.DBpartition = 7*86400;
+
+	if(config.DBpartition == 86400)
+		logg("   DBPARTITION: Storing queries in daily database files");
+	else if(config.DBpartition > 0)
+		logg("   DBPARTITION: Storing queries in weekly database files");
+	else
+		logg("   DBPARTITION: Storing queries in the database file");
+	if(config.DBpartition > 0)
+		logg("   WARNING: Partitioned queries are not included in the queries view of %s, use >dbqueries and >history-* to read them", FTLfiles.db);
+
+	// SNAPSHOTINTERVAL
+	// How often do we refresh the snapshot used for a fast restart while
+	// running [minutes]? 0 writes it only on shutdown
+	// defaults to: once per hour
+	config.snapshotinterval = 3600;
+	buffer = parse_FTLconf(fp, "SNAPSHOTINTERVAL");
+
+	fvalue = 0;
+	if(buffer != NULL && sscanf(buffer, "%f", &fvalue))
+		if(fvalue >= 0.0f && fvalue <= 1440.0f)
+			config.snapshotinterval = (int)(fvalue * 60);
+
+	if(config.snapshotinterval > 0)
+		logg("   SNAPSHOTINTERVAL: Refreshing snapshot every %i seconds", config.snapshotinterval);
+	else
+		logg("   SNAPSHOTINTERVAL: Writing snapshot only on shutdown");
+
+	// APICACHETTL
+	// For how long may identical API requests be answered from the response
+	// cache [seconds]? 0 disables the cache
+	// defaults to: 1 second
+	config.APIcachettl = 1000;
+	buffer = parse_FTLconf(fp, "APICACHETTL");
+
+	fvalue = 0;
+	if(buffer != NULL && sscanf(buffer, "%f", &fvalue))
+		if(fvalue >= 0.0f && fvalue <= 3600.0f)
+			config.APIcachettl = (int)(fvalue * 1000);
+
+	if(config.APIcachettl > 0)
+		logg("   APICACHETTL: Caching API responses for %i ms", config.APIcachettl);
+	else
+		logg("   APICACHETTL: Not caching API responses");
+
 	// PIDFILE
 	getpath(fp, "PIDFILE", "/var/run/pihole-FTL.pid", &FTLfiles.pid);
 
@@ -332,7 +408,7 @@ void getpath(FILE* fp, const char *option, const char *defaultloc, char **pointe
 	// option:     Option string ("key") to try to read
 	// defaultloc: Value used if key is not found in file
 	// pointer:    Location where read (or default) parameter is stored
-	char *buffer = parse_FTLconf(fp, "PIDFILE");
+	char *buffer = parse_FTLconf(fp, option);
 
 	errno = 0;
 	// Use sscanf() to obtain filename from config file parameter only if buffer != NULL
@@ -10,19 +10,101 @@
 
 #include "FTL.h"
 
-sqlite3 *db;
+sqlite3 *db = NULL;
 bool database = false;
 bool DBdeleteoldqueries = false;
 long int lastdbindex = 0;
 long int lastDBimportedtimestamp = 0;
+dbstatsStruct dbstats = { 0 };
 
 pthread_mutex_t dblock;
 
 // TABLE ftl
-enum { DB_VERSION, DB_LASTTIMESTAMP, DB_FIRSTCOUNTERTIMESTAMP };
-// TABLE counters
-enum { DB_TOTALQUERIES, DB_BLOCKEDQUERIES };
-
+enum { DB_VERSION, DB_LASTTIMESTAMP, DB_FIRSTCOUNTERTIMESTAMP, DB_OLDESTTIMESTAMP };
+// TABLE counters (the number of stored queries with status s is kept in DB_STOREDSTATUS + s)
+enum { DB_TOTALQUERIES, DB_BLOCKEDQUERIES, DB_STOREDQUERIES, DB_STOREDSTATUS };
+
+// Prepared statements are compiled once on first use and
+// kept for the lifetime of the database connection
+enum { STMT_BEGIN, STMT_END, STMT_INSERT_QUERY, STMT_SET_COUNTER, STMT_UPDATE_COUNTER,
+       STMT_GET_PROPERTY, STMT_SET_PROPERTY, STMT_LOWER_PROPERTY, STMT_COUNT_OLD,
+       STMT_DELETE_OLD, STMT_FIND_DOMAIN, STMT_ADD_DOMAIN, STMT_FIND_CLIENT, STMT_ADD_CLIENT,
+       STMT_FIND_UPSTREAM, STMT_ADD_UPSTREAM, STMT_DOMAIN_BY_ID, STMT_CLIENT_BY_ID,
+       STMT_UPSTREAM_BY_ID, STMT_ROLLUP_HOURLY, STMT_ROLLUP_DAILY, STMT_PRUNE_HOURLY,
+       STMT_PRUNE_DAILY, STMT_INSERT_PARTITION, STMT_UPDATE_SEQUENCE,
+       STMT_GET_COUNTER, STMT_MAX };
+static const char *stmtSQL[STMT_MAX] = {
+	"BEGIN TRANSACTION;",
+	"END TRANSACTION;",
+	"INSERT INTO query_storage (timestamp,type,status,domain,client,forward) VALUES (?,?,?,?,?,?);",
+	"INSERT OR REPLACE INTO counters (id, value) VALUES (?,?);",
+	"UPDATE counters SET value = value + ? WHERE id = ?;",
+	"SELECT VALUE FROM ftl WHERE id = ?;",
+	"INSERT OR REPLACE INTO ftl (id, value) VALUES (?,?);",
+	"UPDATE ftl SET value = ?2 WHERE id = ?1 AND (value = 0 OR value > ?2);",
+	// Both select the same chunk of old queries (using idx_queries_time)
+	"SELECT status, COUNT(*) FROM query_storage WHERE id IN (SELECT id FROM query_storage WHERE timestamp <= ? ORDER BY timestamp, id LIMIT ?) GROUP BY status;",
+	"DELETE FROM query_storage WHERE id IN (SELECT id FROM query_storage WHERE timestamp <= ? ORDER BY timestamp, id LIMIT ?);",
+	"SELECT id FROM domains WHERE domain = ?;",
+	"INSERT INTO domains (domain) VALUES (?);",
+	"SELECT id FROM clients WHERE ip = ?;",
+	"INSERT INTO clients (ip) VALUES (?);",
+	"SELECT id FROM upstreams WHERE ip = ?;",
+	"INSERT INTO upstreams (ip) VALUES (?);",
+	"SELECT domain FROM domains WHERE id = ?;",
+	"SELECT ip FROM clients WHERE id = ?;",
+	"SELECT ip FROM upstreams WHERE id = ?;",
+	"INSERT INTO rollup_hourly (timestamp,kind,item,count) VALUES (?,?,?,?) ON CONFLICT(timestamp,kind,item) DO UPDATE SET count = count + excluded.count;",
+	"INSERT INTO rollup_daily (timestamp,kind,item,count) VALUES (?,?,?,?) ON CONFLICT(timestamp,kind,item) DO UPDATE SET count = count + excluded.count;",
+	// Keep only the ROLLUPTOPDOMAINS most queried domains of each bucket
+	"DELETE FROM rollup_hourly WHERE kind = ?1 AND (timestamp,item) IN (SELECT timestamp, item FROM (SELECT timestamp, item, ROW_NUMBER() OVER (PARTITION BY timestamp ORDER BY count DESC) AS position FROM rollup_hourly WHERE kind = ?1 AND timestamp >= ?2 AND timestamp < ?3) WHERE position > ?4);",
+	"DELETE FROM rollup_daily WHERE kind = ?1 AND (timestamp,item) IN (SELECT timestamp, item FROM (SELECT timestamp, item, ROW_NUMBER() OVER (PARTITION BY timestamp ORDER BY count DESC) AS position FROM rollup_daily WHERE kind = ?1 AND timestamp >= ?2 AND timestamp < ?3) WHERE position > ?4);",
+	"INSERT INTO part.query_storage (timestamp,type,status,domain,client,forward) VALUES (?,?,?,?,?,?);",
+	"UPDATE main.sqlite_sequence SET seq = ?1 WHERE name = 'query_storage' AND seq < ?1;",
+	"SELECT value FROM counters WHERE id = ?;"
+};
+static sqlite3_stmt *stmts[STMT_MAX] = { NULL };
+
+// Dictionary tables holding the strings referenced by query_storage
+enum { DICT_DOMAINS, DICT_CLIENTS, DICT_UPSTREAMS };
+static const unsigned int dictfind[] = { STMT_FIND_DOMAIN, STMT_FIND_CLIENT, STMT_FIND_UPSTREAM };
+static const unsigned int dictadd[] = { STMT_ADD_DOMAIN, STMT_ADD_CLIENT, STMT_ADD_UPSTREAM };
+static const unsigned int dictbyid[] = { STMT_DOMAIN_BY_ID, STMT_CLIENT_BY_ID, STMT_UPSTREAM_BY_ID };
+static const char *dictmaxid[] = { "SELECT MAX(id) FROM domains;", "SELECT MAX(id) FROM clients;", "SELECT MAX(id) FROM upstreams;" };
+// Dictionary IDs of the placeholders stored for hidden domains and clients
+static int hiddendomainID = 0, hiddenclientID = 0;
+
+// Rollup tables: bucket length [seconds], tables and their statements
+enum { ROLLUP_HOURLY, ROLLUP_DAILY, ROLLUP_PERIODS };
+static const int rollupperiod[ROLLUP_PERIODS] = { 3600, 86400 };
+static const char *rolluptable[ROLLUP_PERIODS] = { "rollup_hourly", "rollup_daily" };
+static const unsigned int rollupupsert[ROLLUP_PERIODS] = { STMT_ROLLUP_HOURLY, STMT_ROLLUP_DAILY };
+static const unsigned int rollupprune[ROLLUP_PERIODS] = { STMT_PRUNE_HOURLY, STMT_PRUNE_DAILY };
+
+// Counts of the current batch are summed up here before they are added to
+// the rollup tables. Open addressing, flushed when half of the slots are used
+#define ROLLUPSLOTS 4096
+static struct {
+	int period;
+	int timestamp;
+	int kind;
+	int item;
+	int count;
+} rollups[ROLLUPSLOTS];
+static int rollupsused = 0;
+
+// Time-partitioned storage (DBPARTITION): queries are stored in one file per
+// day or week next to the main database, which keeps the dictionaries,
+// counters and rollups. The partition written to is attached as "part",
+// older ones are attached only while they are read
+#define PARTITIONSATTACHED 8
+static time_t partcurrent = 0;
+static int partsattached = 0;
+
+bool dbquery(const char *format, ...);
+static int db_query_int(const char *querystr, int arg);
+static bool db_init_stored(const int *stored, int oldest);
+static int db_oldest_timestamp(void);
 bool db_set_counter(unsigned int ID, int value);
 bool db_set_FTL_property(unsigned int ID, int value);
 int db_get_FTL_property(unsigned int ID);
@@ -42,42 +124,142 @@ void check_database(int rc)
 	}
 }
 
-void dbclose(void)
+// Get a prepared statement from the cache, compile it on first use
+static sqlite3_stmt *db_stmt(unsigned int which)
 {
-	int rc = sqlite3_close(db);
-	// Report any error
-	if( rc )
-		logg("dbclose() - SQL error (%i): %s", rc, sqlite3_errmsg(db));
+	if(stmts[which] != NULL)
+		return stmts[which];
 
-	// Unlock mutex on the database
-	pthread_mutex_unlock(&dblock);
+	int rc = sqlite3_prepare_v3(db, stmtSQL[which], -1, SQLITE_PREPARE_PERSISTENT, &stmts[which], NULL);
+	if( rc ){
+		logg("db_stmt() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		logg("Query: \"%s\"", stmtSQL[which]);
+		check_database(rc);
+		stmts[which] = NULL;
+		return NULL;
+	}
+
+	return stmts[which];
 }
 
-double get_db_filesize(void)
+// Make a cached statement ready for its next use
+static void db_stmt_done(sqlite3_stmt *stmt)
 {
-	struct stat st;
-	if(stat(FTLfiles.db, &st) != 0)
-	{
-		// stat() failed (maybe the DB file does not exist?)
-		return 0;
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+}
+
+// Run a cached statement that does not return any rows
+static bool db_stmt_exec(unsigned int which)
+{
+	sqlite3_stmt *stmt = db_stmt(which);
+	if(stmt == NULL)
+		return false;
+
+	int rc = sqlite3_step(stmt);
+	db_stmt_done(stmt);
+	if( rc != SQLITE_DONE ){
+		logg("db_stmt_exec(%s) - SQL error (%i): %s", stmtSQL[which], rc, sqlite3_errmsg(db));
+		check_database(rc);
+		return false;
 	}
-	return 1e-6*st.st_size;
+
+	return true;
+}
+
+// Remember the size of the write-ahead log after each commit. Installing
+// this hook replaces SQLite's automatic checkpointing, see db_checkpoint()
+static int db_wal_hook(void *arg, sqlite3 *handle, const char *name, int pages)
+{
+	// With partitions, two logs are written to. Track the larger one
+	if(config.DBpartition == 0 || pages > dbstats.walpages)
+		dbstats.walpages = pages;
+	return SQLITE_OK;
+}
+
+// Set up a freshly opened database connection
+static void db_configure(void)
+{
+	// Write-ahead logging lets external readers (e.g. the web interface)
+	// and our writer work on the database at the same time. Synchronous
+	// NORMAL is safe in WAL mode and avoids a sync on every commit
+	dbquery("PRAGMA journal_mode=WAL;");
+	dbquery("PRAGMA synchronous=NORMAL;");
+	sqlite3_wal_hook(db, db_wal_hook, NULL);
 }
 
+// Lock the database connection for exclusive use by the calling thread.
+// The connection is opened on first use and kept open afterwards
 bool dbopen(void)
 {
 	pthread_mutex_lock(&dblock);
+	if(db != NULL)
+		return true;
+
+	if(!database)
+	{
+		pthread_mutex_unlock(&dblock);
+		return false;
+	}
+
 	int rc = sqlite3_open_v2(FTLfiles.db, &db, SQLITE_OPEN_READWRITE, NULL);
 	if( rc ){
 		logg("dbopen() - SQL error (%i): %s", rc, sqlite3_errmsg(db));
-		dbclose();
+		sqlite3_close(db);
+		db = NULL;
 		check_database(rc);
+		pthread_mutex_unlock(&dblock);
 		return false;
 	}
+	db_configure();
 
 	return true;
 }
 
+// Release the database connection, it stays open for the next user
+void dbclose(void)
+{
+	pthread_mutex_unlock(&dblock);
+}
+
+// Finalize all cached statements and close the database connection. It has
+// to be closed before forking as SQLite handles must not cross a fork()
+void db_close(void)
+{
+	if(db == NULL)
+		return;
+
+	pthread_mutex_lock(&dblock);
+	for(unsigned int i = 0; i < STMT_MAX; i++)
+	{
+		if(stmts[i] == NULL)
+			continue;
+		sqlite3_finalize(stmts[i]);
+		stmts[i] = NULL;
+	}
+
+	int rc = sqlite3_close(db);
+	// Report any error
+	if( rc )
+		logg("db_close() - SQL error (%i): %s", rc, sqlite3_errmsg(db));
+	db = NULL;
+	// Attached partitions are gone with the connection
+	partcurrent = 0;
+	partsattached = 0;
+	pthread_mutex_unlock(&dblock);
+}
+
+double get_db_filesize(void)
+{
+	struct stat st;
+	if(stat(FTLfiles.db, &st) != 0)
+	{
+		// stat() failed (maybe the DB file does not exist?)
+		return 0;
+	}
+	return 1e-6*(st.st_size + db_partitions_filesize());
+}
+
 bool dbquery(const char *format, ...)
 {
 	char *zErrMsg = NULL;
@@ -98,6 +280,7 @@ bool dbquery(const char *format, ...)
 	if( rc != SQLITE_OK ){
 		logg("dbquery(%s) - SQL error (%i): %s", query, rc, zErrMsg);
 		sqlite3_free(zErrMsg);
+		sqlite3_free(query);
 		check_database(rc);
 		return false;
 	}
@@ -108,28 +291,571 @@ bool dbquery(const char *format, ...)
 
 }
 
+// Table for storing queries, either in the main database or in a partition
+static bool create_query_storage(const char *schema)
+{
+	bool ret;
+	ret = dbquery("CREATE TABLE IF NOT EXISTS %s.query_storage ( id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward INTEGER );", schema);
+	if(!ret){ return false; }
+	// Covering indexes (database version 6) on the timestamps, the clients and
+	// the domains. The ID is part of them so that the query log can be read
+	// page by page in (timestamp, id) order without ever touching the table.
+	// They supersede the plain timestamp index of earlier versions
+	ret = dbquery("DROP INDEX IF EXISTS %s.idx_queries_timestamps;", schema);
+	if(!ret){ return false; }
+	ret = dbquery("CREATE INDEX IF NOT EXISTS %s.idx_queries_time ON query_storage (timestamp, id, status, type, client, domain);", schema);
+	if(!ret){ return false; }
+	ret = dbquery("CREATE INDEX IF NOT EXISTS %s.idx_queries_client ON query_storage (client, timestamp, id, status, type, domain);", schema);
+	if(!ret){ return false; }
+	ret = dbquery("CREATE INDEX IF NOT EXISTS %s.idx_queries_domain ON query_storage (domain, timestamp, id, status, type, client);", schema);
+	if(!ret){ return false; }
+
+	return true;
+}
+
+// Start of the partition holding a timestamp. Partitions are UTC days or
+// weeks, the latter start on Mondays (1 Jan 1970 was a Thursday)
+static time_t partition_start(time_t timestamp)
+{
+	time_t offset = config.DBpartition > 86400 ? 4*86400 : 0;
+	return timestamp - (timestamp - offset) % config.DBpartition;
+}
+
+// File name of a partition, has to be freed with sqlite3_free()
+static char *partition_file(time_t start)
+{
+	struct tm tm;
+	gmtime_r(&start, &tm);
+	return sqlite3_mprintf("%s.%04i%02i%02i", FTLfiles.db, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+}
+
+static int compare_time(const void *a, const void *b)
+{
+	const time_t x = *(const time_t *)a, y = *(const time_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Find all partitions next to the main database file. Returns their number,
+// the list of start times (ascending) has to be freed if it is not empty
+static int partition_list(time_t **list)
+{
+	*list = NULL;
+	const char *slash = strrchr(FTLfiles.db, '/');
+	const char *base = slash != NULL ? slash + 1 : FTLfiles.db;
+	char *dirname = sqlite3_mprintf("%.*s", slash != NULL ? (int)(slash - FTLfiles.db) + 1 : 0, FTLfiles.db);
+	if(dirname == NULL)
+		return 0;
+
+	DIR *dir = opendir(slash != NULL ? dirname : ".");
+	sqlite3_free(dirname);
+	if(dir == NULL)
+		return 0;
+
+	// Partitions are named <database>.YYYYMMDD
+	size_t len = strlen(base);
+	int count = 0, size = 0;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		const char *date = entry->d_name + len + 1;
+		if(strncmp(entry->d_name, base, len) != 0 || entry->d_name[len] != '.' ||
+		   strlen(date) != 8 || strspn(date, "0123456789") != 8)
+			continue;
+
+		struct tm tm = { 0 };
+		if(sscanf(date, "%4d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3)
+			continue;
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+
+		if(count == size)
+		{
+			size += 16;
+			time_t *resized = realloc(*list, size*sizeof(time_t));
+			if(resized == NULL)
+				break;
+			*list = resized;
+		}
+		(*list)[count++] = timegm(&tm);
+	}
+	closedir(dir);
+
+	if(count > 0)
+		qsort(*list, count, sizeof(time_t), compare_time);
+	else if(*list != NULL)
+	{
+		free(*list);
+		*list = NULL;
+	}
+	return count;
+}
+
+// Attach a partition under the given schema name. Missing partitions are
+// only created for storing queries, their IDs continue the ones stored so
+// far (the main database's sequence is kept up to date by save_to_DB())
+static bool partition_attach(const char *schema, time_t start, bool create)
+{
+	char *file = partition_file(start);
+	if(file == NULL)
+		return false;
+
+	struct stat st;
+	bool exists = stat(file, &st) == 0;
+	if(!exists && create)
+	{
+		// The connection has been opened without SQLITE_OPEN_CREATE, which
+		// applies to attached databases as well. SQLite accepts empty files
+		FILE *fp = fopen(file, "a");
+		if(fp != NULL)
+			fclose(fp);
+	}
+
+	bool ret = (exists || create) && dbquery("ATTACH DATABASE %Q AS %s;", file, schema);
+	sqlite3_free(file);
+	if(!ret || !create)
+		return ret;
+
+	ret = dbquery("PRAGMA %s.journal_mode=WAL;", schema) &&
+	      dbquery("PRAGMA %s.synchronous=NORMAL;", schema) &&
+	      create_query_storage(schema);
+	if(ret && !exists)
+		ret = dbquery("INSERT INTO %s.sqlite_sequence (name,seq) SELECT name, seq FROM main.sqlite_sequence WHERE name = 'query_storage';", schema);
+	if(!ret)
+		dbquery("DETACH DATABASE %s;", schema);
+	return ret;
+}
+
+// Make sure the partition queries with the given timestamp are stored in
+// is attached as "part". Partitions are only ever advanced, late queries
+// end up in the partition following theirs
+static bool partition_switch(time_t timestamp)
+{
+	time_t start = partition_start(timestamp);
+	if(partcurrent > 0 && start <= partcurrent)
+		return true;
+
+	if(partcurrent > 0 && !dbquery("DETACH DATABASE part;"))
+		return false;
+	partcurrent = 0;
+
+	// IDs of new partitions are taken from the main database's sequence
+	if(!dbquery("INSERT INTO main.sqlite_sequence (name,seq) SELECT 'query_storage', 0 WHERE NOT EXISTS (SELECT 1 FROM main.sqlite_sequence WHERE name = 'query_storage');"))
+		return false;
+
+	if(!partition_attach("part", start, true))
+	{
+		logg("partition_switch() - Cannot attach partition starting at %li", (long)start);
+		return false;
+	}
+
+	partcurrent = start;
+	return true;
+}
+
+// Attach all partitions overlapping [from,until] for reading and combine
+// them with the main database's queries in the temporary view query_union
+static bool partition_union(time_t from, time_t until)
+{
+	time_t *list = NULL;
+	int count = partition_list(&list);
+
+	char *view = sqlite3_mprintf("CREATE TEMP VIEW query_union AS SELECT * FROM main.query_storage");
+	for(int i = 0; i < count && view != NULL; i++)
+	{
+		if(list[i] + config.DBpartition <= from || list[i] > until)
+			continue;
+
+		char schema[16];
+		if(list[i] == partcurrent)
+			strcpy(schema, "part");
+		else if(partsattached < PARTITIONSATTACHED)
+		{
+			snprintf(schema, sizeof(schema), "p%i", partsattached);
+			if(!partition_attach(schema, list[i], false))
+				continue;
+			partsattached++;
+		}
+		else
+		{
+			logg("Warning: Reading only %i partitions at once", PARTITIONSATTACHED);
+			break;
+		}
+
+		char *extended = sqlite3_mprintf("%s UNION ALL SELECT * FROM %s.query_storage", view, schema);
+		sqlite3_free(view);
+		view = extended;
+	}
+	if(list != NULL)
+		free(list);
+
+	if(view == NULL)
+	{
+		logg("Memory allocation failed in partition_union()");
+		return false;
+	}
+
+	bool ret = dbquery("%s;", view);
+	sqlite3_free(view);
+	return ret;
+}
+
+// Drop the view created by partition_union() and detach its partitions
+static void partition_union_done(void)
+{
+	if(config.DBpartition == 0)
+		return;
+
+	dbquery("DROP VIEW IF EXISTS temp.query_union;");
+	while(partsattached > 0)
+		dbquery("DETACH DATABASE p%i;", --partsattached);
+}
+
+// Add the number of queries per status stored in the given schema
+static bool db_count_status(const char *schema, int *stored)
+{
+	char *querystr = sqlite3_mprintf("SELECT status, COUNT(*) FROM %s.query_storage GROUP BY status;", schema);
+	if(querystr == NULL)
+		return false;
+
+	sqlite3_stmt* stmt;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	sqlite3_free(querystr);
+	if( rc ){
+		logg("db_count_status() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+		return false;
+	}
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		int status = sqlite3_column_int(stmt, 0);
+		if(status >= QUERY_UNKNOWN && status < QUERY_STATUS_MAX)
+			stored[status] += sqlite3_column_int(stmt, 1);
+	}
+	sqlite3_finalize(stmt);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("db_count_status() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+		return false;
+	}
+	return true;
+}
+
+// Add the number of queries per status stored in all partitions
+static bool partition_count_status(int *stored)
+{
+	time_t *list = NULL;
+	int count = partition_list(&list);
+	bool ret = true;
+	for(int i = 0; i < count && ret; i++)
+	{
+		if(list[i] == partcurrent)
+			ret = db_count_status("part", stored);
+		else if(partition_attach("scan", list[i], false))
+		{
+			ret = db_count_status("scan", stored);
+			dbquery("DETACH DATABASE scan;");
+		}
+	}
+	if(list != NULL)
+		free(list);
+	return ret;
+}
+
+// Timestamp of the oldest query stored in any partition (0 = none)
+static int partition_oldest(void)
+{
+	time_t *list = NULL;
+	int count = partition_list(&list), oldest = 0;
+	for(int i = 0; i < count && oldest <= 0; i++)
+	{
+		if(list[i] == partcurrent)
+			oldest = db_query_int("SELECT IFNULL(MIN(timestamp),0) FROM part.query_storage;", 0);
+		else if(partition_attach("scan", list[i], false))
+		{
+			oldest = db_query_int("SELECT IFNULL(MIN(timestamp),0) FROM scan.query_storage;", 0);
+			dbquery("DETACH DATABASE scan;");
+		}
+	}
+	if(list != NULL)
+		free(list);
+	return oldest;
+}
+
+// Size of all partition files in bytes
+long int db_partitions_filesize(void)
+{
+	if(config.DBpartition == 0)
+		return 0;
+
+	time_t *list = NULL;
+	int count = partition_list(&list);
+	long int filesize = 0;
+	for(int i = 0; i < count; i++)
+	{
+		struct stat st;
+		char *file = partition_file(list[i]);
+		if(file != NULL && stat(file, &st) == 0)
+			filesize += st.st_size;
+		sqlite3_free(file);
+	}
+	if(list != NULL)
+		free(list);
+	return filesize;
+}
+
+// Delete partitions that only hold queries older than the given timestamp.
+// The partition currently written to is kept. The queries of deleted
+// partitions are added to stored (per status)
+static int partition_expire(time_t timestamp, int *stored)
+{
+	time_t *list = NULL;
+	int count = partition_list(&list), deleted = 0;
+	for(int i = 0; i < count; i++)
+	{
+		if(list[i] + config.DBpartition > timestamp || list[i] == partcurrent)
+			continue;
+
+		char *file = partition_file(list[i]);
+		if(file == NULL)
+			continue;
+
+		int queries[QUERY_STATUS_MAX] = { 0 };
+		if(partition_attach("scan", list[i], false))
+		{
+			db_count_status("scan", queries);
+			dbquery("DETACH DATABASE scan;");
+		}
+
+		// Remove the database and its write-ahead log (if any)
+		if(unlink(file) == 0)
+		{
+			deleted++;
+			for(int status = QUERY_UNKNOWN; status < QUERY_STATUS_MAX; status++)
+				stored[status] += queries[status];
+		}
+		else
+			logg("Cannot delete partition %s: %s", file, strerror(errno));
+		char *wal = sqlite3_mprintf("%s-wal", file), *shm = sqlite3_mprintf("%s-shm", file);
+		if(wal != NULL)
+			unlink(wal);
+		if(shm != NULL)
+			unlink(shm);
+		sqlite3_free(wal);
+		sqlite3_free(shm);
+		sqlite3_free(file);
+	}
+	if(list != NULL)
+		free(list);
+	return deleted;
+}
+
+// Tables for storing queries (database version 3). Domains, clients and
+// upstream servers are stored only once and referenced by their ID. The
+// queries view provides the table layout of earlier versions to external
+// readers, deleting rows through it is supported as well. It only covers
+// the main database, queries stored in partitions (DBPARTITION) are served
+// through the API (>dbqueries, >history-*)
+bool create_query_tables(void)
+{
+	bool ret;
+	ret = dbquery("CREATE TABLE domains ( id INTEGER PRIMARY KEY, domain TEXT NOT NULL UNIQUE );");
+	if(!ret){ return false; }
+	ret = dbquery("CREATE TABLE clients ( id INTEGER PRIMARY KEY, ip TEXT NOT NULL UNIQUE );");
+	if(!ret){ return false; }
+	ret = dbquery("CREATE TABLE upstreams ( id INTEGER PRIMARY KEY, ip TEXT NOT NULL UNIQUE );");
+	if(!ret){ return false; }
+	ret = create_query_storage("main");
+	if(!ret){ return false; }
+	ret = dbquery("CREATE VIEW queries AS SELECT query_storage.id AS id, timestamp, type, status, domains.domain AS domain, clients.ip AS client, upstreams.ip AS forward FROM query_storage JOIN domains ON domains.id = query_storage.domain JOIN clients ON clients.id = query_storage.client LEFT JOIN upstreams ON upstreams.id = query_storage.forward;");
+	if(!ret){ return false; }
+	ret = dbquery("CREATE TRIGGER queries_delete INSTEAD OF DELETE ON queries BEGIN DELETE FROM query_storage WHERE id = OLD.id; END;");
+	if(!ret){ return false; }
+
+	return true;
+}
+
+// Move the queries of a version 2 database into the dictionary tables
+bool upgrade_to_v3(void)
+{
+	logg("Upgrading long-term database to version 3, this may take a while...");
+	timer_start(DATABASE_WRITE_TIMER);
+
+	if(!dbquery("BEGIN TRANSACTION;"))
+		return false;
+
+	// The new tables need the names of the old table and its index
+	bool ret = dbquery("ALTER TABLE queries RENAME TO queries_v2;") &&
+	           dbquery("DROP INDEX idx_queries_timestamps;") &&
+	           create_query_tables() &&
+	           dbquery("INSERT INTO domains (domain) SELECT DISTINCT domain FROM queries_v2;") &&
+	           dbquery("INSERT INTO clients (ip) SELECT DISTINCT client FROM queries_v2;") &&
+	           dbquery("INSERT INTO upstreams (ip) SELECT DISTINCT forward FROM queries_v2 WHERE forward IS NOT NULL;") &&
+	           dbquery("INSERT INTO query_storage (id,timestamp,type,status,domain,client,forward) "
+	                   "SELECT queries_v2.id, timestamp, type, status, domains.id, clients.id, upstreams.id FROM queries_v2 "
+	                   "JOIN domains ON domains.domain = queries_v2.domain "
+	                   "JOIN clients ON clients.ip = queries_v2.client "
+	                   "LEFT JOIN upstreams ON upstreams.ip = queries_v2.forward;") &&
+	           dbquery("DROP TABLE queries_v2;") &&
+	           db_set_FTL_property(DB_VERSION, 3);
+
+	if(!ret || !dbquery("END TRANSACTION;"))
+	{
+		dbquery("ROLLBACK;");
+		return false;
+	}
+
+	logg("Database upgrade finished (took %.1f ms). Unused space is reclaimed with VACUUM", timer_elapsed_msec(DATABASE_WRITE_TIMER));
+	return true;
+}
+
+// Pre-aggregated statistics (database version 4). Every row holds the number
+// of queries of one bucket (hour or UTC day) with a certain status, type,
+// reply, client, upstream server or domain (see the ROLLUP_* kinds)
+bool create_rollup_tables(void)
+{
+	bool ret;
+	ret = dbquery("CREATE TABLE rollup_hourly ( timestamp INTEGER NOT NULL, kind INTEGER NOT NULL, item INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (timestamp, kind, item) ) WITHOUT ROWID;");
+	if(!ret){ return false; }
+	ret = dbquery("CREATE TABLE rollup_daily ( timestamp INTEGER NOT NULL, kind INTEGER NOT NULL, item INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (timestamp, kind, item) ) WITHOUT ROWID;");
+	if(!ret){ return false; }
+
+	return true;
+}
+
+// Remove all but the most queried domains from the rollup buckets in [from,until)
+static bool rollup_prune(unsigned int period, int from, int until)
+{
+	const int kinds[] = { ROLLUP_DOMAIN, ROLLUP_BLOCKED_DOMAIN };
+	for(unsigned int i = 0; i < sizeof(kinds)/sizeof(kinds[0]); i++)
+	{
+		sqlite3_stmt* stmt = db_stmt(rollupprune[period]);
+		if(stmt == NULL)
+			return false;
+
+		sqlite3_bind_int(stmt, 1, kinds[i]);
+		sqlite3_bind_int(stmt, 2, from);
+		sqlite3_bind_int(stmt, 3, until);
+		sqlite3_bind_int(stmt, 4, ROLLUPTOPDOMAINS);
+		if(!db_stmt_exec(rollupprune[period]))
+			return false;
+	}
+
+	return true;
+}
+
+// Create the rollup tables and fill them from the stored queries
+bool upgrade_to_v4(void)
+{
+	logg("Upgrading long-term database to version 4, this may take a while...");
+	timer_start(DATABASE_WRITE_TIMER);
+
+	if(!dbquery("BEGIN TRANSACTION;"))
+		return false;
+
+	bool ret = create_rollup_tables();
+	for(unsigned int period = ROLLUP_HOURLY; ret && period < ROLLUP_PERIODS; period++)
+	{
+		const char *table = rolluptable[period];
+		int length = rollupperiod[period];
+		ret = dbquery("INSERT INTO %s SELECT timestamp - timestamp %% %i, %i, status, COUNT(*) FROM query_storage GROUP BY 1, 3;", table, length, ROLLUP_STATUS) &&
+		      dbquery("INSERT INTO %s SELECT timestamp - timestamp %% %i, %i, type, COUNT(*) FROM query_storage GROUP BY 1, 3;", table, length, ROLLUP_TYPE) &&
+		      dbquery("INSERT INTO %s SELECT timestamp - timestamp %% %i, %i, client, COUNT(*) FROM query_storage GROUP BY 1, 3;", table, length, ROLLUP_CLIENT) &&
+		      dbquery("INSERT INTO %s SELECT timestamp - timestamp %% %i, %i, forward, COUNT(*) FROM query_storage WHERE forward IS NOT NULL GROUP BY 1, 3;", table, length, ROLLUP_UPSTREAM) &&
+		      dbquery("INSERT INTO %s SELECT timestamp - timestamp %% %i, %i, domain, COUNT(*) FROM query_storage WHERE status NOT IN (%i,%i,%i,%i) GROUP BY 1, 3;", table, length, ROLLUP_DOMAIN,
+		              QUERY_GRAVITY, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED) &&
+		      dbquery("INSERT INTO %s SELECT timestamp - timestamp %% %i, %i, domain, COUNT(*) FROM query_storage WHERE status IN (%i,%i,%i,%i) GROUP BY 1, 3;", table, length, ROLLUP_BLOCKED_DOMAIN,
+		              QUERY_GRAVITY, QUERY_WILDCARD, QUERY_BLACKLIST, QUERY_EXTERNAL_BLOCKED) &&
+		      rollup_prune(period, 0, time(NULL) - time(NULL) % length);
+	}
+	ret = ret && db_set_FTL_property(DB_VERSION, 4);
+
+	if(!ret || !dbquery("END TRANSACTION;"))
+	{
+		dbquery("ROLLBACK;");
+		return false;
+	}
+
+	logg("Database upgrade finished (took %.1f ms)", timer_elapsed_msec(DATABASE_WRITE_TIMER));
+	return true;
+}
+
+// Count the stored queries once, they are kept up to date afterwards
+bool upgrade_to_v5(void)
+{
+	logg("Upgrading long-term database to version 5, this may take a while...");
+	timer_start(DATABASE_WRITE_TIMER);
+
+	// Partitions cannot be attached within a transaction, count first
+	int stored[QUERY_STATUS_MAX] = { 0 };
+	if(!db_count_status("main", stored) ||
+	   (config.DBpartition > 0 && !partition_count_status(stored)))
+		return false;
+	int oldest = db_oldest_timestamp();
+
+	if(!dbquery("BEGIN TRANSACTION;"))
+		return false;
+
+	bool ret = db_init_stored(stored, oldest) &&
+	           db_set_FTL_property(DB_VERSION, 5);
+
+	if(!ret || !dbquery("END TRANSACTION;"))
+	{
+		dbquery("ROLLBACK;");
+		return false;
+	}
+
+	logg("Database upgrade finished (took %.1f ms)", timer_elapsed_msec(DATABASE_WRITE_TIMER));
+	return true;
+}
+
+// Replace the timestamp index by the covering indexes used by the query log.
+// Partitions are upgraded when they are attached for storing queries
+bool upgrade_to_v6(void)
+{
+	logg("Upgrading long-term database to version 6, this may take a while...");
+	timer_start(DATABASE_WRITE_TIMER);
+
+	if(!dbquery("BEGIN TRANSACTION;"))
+		return false;
+
+	bool ret = create_query_storage("main") &&
+	           db_set_FTL_property(DB_VERSION, 6);
+
+	if(!ret || !dbquery("END TRANSACTION;"))
+	{
+		dbquery("ROLLBACK;");
+		return false;
+	}
+
+	logg("Database upgrade finished (took %.1f ms)", timer_elapsed_msec(DATABASE_WRITE_TIMER));
+	return true;
+}
+
 bool create_counter_table(void)
 {
 	bool ret;
 	// Create FTL table in the database (holds properties like database version, etc.)
 	ret = dbquery("CREATE TABLE counters ( id INTEGER PRIMARY KEY NOT NULL, value INTEGER NOT NULL );");
-	if(!ret){ dbclose(); return false; }
+	if(!ret){ return false; }
 
 	// ID 0 = total queries
 	ret = db_set_counter(DB_TOTALQUERIES, 0);
-	if(!ret){ dbclose(); return false; }
+	if(!ret){ return false; }
 
 	// ID 1 = total blocked queries
 	ret = db_set_counter(DB_BLOCKEDQUERIES, 0);
-	if(!ret){ dbclose(); return false; }
+	if(!ret){ return false; }
 
 	// Time stamp of creation of the counters database
 	ret = db_set_FTL_property(DB_FIRSTCOUNTERTIMESTAMP, time(NULL));
-	if(!ret){ dbclose(); return false; }
+	if(!ret){ return false; }
 
 	// Update database version to 2
 	ret = db_set_FTL_property(DB_VERSION, 2);
-	if(!ret){ dbclose(); return false; }
+	if(!ret){ return false; }
 
 	return true;
 }
@@ -140,32 +866,41 @@ bool db_create(void)
 	int rc = sqlite3_open_v2(FTLfiles.db, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
 	if( rc ){
 		logg("db_create() - SQL error (%i): %s", rc, sqlite3_errmsg(db));
-		dbclose();
 		check_database(rc);
 		return false;
 	}
-	// Create Queries table in the database
-	ret = dbquery("CREATE TABLE queries ( id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain TEXT NOT NULL, client TEXT NOT NULL, forward TEXT );");
-	if(!ret){ dbclose(); return false; }
-	// Add an index on the timestamps (not a unique index!)
-	ret = dbquery("CREATE INDEX idx_queries_timestamps ON queries (timestamp);");
-	if(!ret){ dbclose(); return false; }
+	// Allow returning pages freed by deleting old queries to the file
+	// system. This has to be set before the first table is created
+	ret = dbquery("PRAGMA auto_vacuum=INCREMENTAL;");
+	if(!ret){ return false; }
+	// Create Queries tables in the database
+	if(!create_query_tables())
+		return false;
 	// Create FTL table in the database (holds properties like database version, etc.)
 	ret = dbquery("CREATE TABLE ftl ( id INTEGER PRIMARY KEY NOT NULL, value BLOB NOT NULL );");
-	if(!ret){ dbclose(); return false; }
-
-	// DB version 2
-	ret = dbquery("INSERT INTO ftl (ID,VALUE) VALUES(%i,2);", DB_VERSION);
-	if(!ret){ dbclose(); return false; }
+	if(!ret){ return false; }
 
 	// Most recent timestamp initialized to 00:00 1 Jan 1970
 	ret = dbquery("INSERT INTO ftl (ID,VALUE) VALUES(%i,0);", DB_LASTTIMESTAMP);
-	if(!ret){ dbclose(); return false; }
+	if(!ret){ return false; }
 
 	// Create counter table
 	if(!create_counter_table())
 		return false;
 
+	// Create rollup tables
+	if(!create_rollup_tables())
+		return false;
+
+	// No queries stored so far
+	int stored[QUERY_STATUS_MAX] = { 0 };
+	if(!db_init_stored(stored, 0))
+		return false;
+
+	// DB version 6
+	ret = db_set_FTL_property(DB_VERSION, 6);
+	if(!ret){ return false; }
+
 	return true;
 }
 
@@ -179,30 +914,41 @@ void db_init(void)
 		return;
 	}
 
+	if (pthread_mutex_init(&dblock, NULL) != 0)
+	{
+		logg("FATAL: DB mutex init failed\n");
+		// Return failure
+		exit(EXIT_FAILURE);
+	}
+
 	int rc = sqlite3_open_v2(FTLfiles.db, &db, SQLITE_OPEN_READWRITE, NULL);
 	if( rc ){
 		logg("db_init() - Cannot open database (%i): %s", rc, sqlite3_errmsg(db));
-		dbclose();
-		check_database(rc);
+		sqlite3_close(db);
+		db = NULL;
 
 		logg("Creating new (empty) database");
 		if (!db_create())
 		{
 			logg("Database not available");
 			database = false;
+			db_close();
 			return;
 		}
 	}
 
+	db_configure();
+
 	// Test DB version and see if we need to upgrade the database file
 	int dbversion = db_get_FTL_property(DB_VERSION);
 	if(dbversion < 1)
 	{
 		logg("Database version incorrect, database not available");
 		database = false;
+		db_close();
 		return;
 	}
-	else if(dbversion < 2)
+	if(dbversion < 2)
 	{
 		// Database is still in version 1
 		// Update to version 2 and create counters table
@@ -210,19 +956,57 @@ void db_init(void)
 		{
 			logg("Counter table not initialized, database not available");
 			database = false;
+			db_close();
 			return;
 		}
 	}
-
-	// Close database to prevent having it opened all time
-	// we already closed the database when we returned earlier
-	sqlite3_close(db);
-
-	if (pthread_mutex_init(&dblock, NULL) != 0)
+	if(dbversion < 3)
 	{
-		logg("FATAL: DB mutex init failed\n");
-		// Return failure
-		exit(EXIT_FAILURE);
+		// Database is in version 2
+		// Update to version 3 and move queries into dictionary tables
+		if (!upgrade_to_v3())
+		{
+			logg("Database upgrade failed, database not available");
+			database = false;
+			db_close();
+			return;
+		}
+	}
+	if(dbversion < 4)
+	{
+		// Database is in version 3
+		// Update to version 4 and create the rollup tables
+		if (!upgrade_to_v4())
+		{
+			logg("Database upgrade failed, database not available");
+			database = false;
+			db_close();
+			return;
+		}
+	}
+	if(dbversion < 5)
+	{
+		// Database is in version 4
+		// Update to version 5 and count the stored queries
+		if (!upgrade_to_v5())
+		{
+			logg("Database upgrade failed, database not available");
+			database = false;
+			db_close();
+			return;
+		}
+	}
+	if(dbversion < 6)
+	{
+		// Database is in version 5
+		// Update to version 6 and create the covering indexes
+		if (!upgrade_to_v6())
+		{
+			logg("Database upgrade failed, database not available");
+			database = false;
+			db_close();
+			return;
+		}
 	}
 
 	logg("Database successfully initialized");
@@ -231,151 +1015,389 @@ void db_init(void)
 
 int db_get_FTL_property(unsigned int ID)
 {
-	int rc, ret = 0;
-	sqlite3_stmt* dbstmt;
-	char *querystring = NULL;
-
-	// Prepare SQL statement
-	ret = asprintf(&querystring, "SELECT VALUE FROM ftl WHERE id = %u;",ID);
-
-	if(querystring == NULL || ret < 0)
-	{
-		logg("Memory allocation failed in db_get_FTL_property, not saving query with ID = %u (%i)", ID, ret);
-		return false;
-	}
-
-	rc = sqlite3_prepare(db, querystring, -1, &dbstmt, NULL);
-	if( rc ){
-		logg("db_get_FTL_property() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
-		logg("Query: \"%s\"", querystring);
-		dbclose();
-		check_database(rc);
+	sqlite3_stmt* stmt = db_stmt(STMT_GET_PROPERTY);
+	if(stmt == NULL)
 		return -1;
-	}
-	free(querystring);
+
+	sqlite3_bind_int(stmt, 1, ID);
 
 	// Evaluate SQL statement
-	rc = sqlite3_step(dbstmt);
+	int rc = sqlite3_step(stmt);
 	if( rc != SQLITE_ROW ){
 		logg("db_get_FTL_property() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
-		dbclose();
+		db_stmt_done(stmt);
 		check_database(rc);
 		return -1;
 	}
 
-	int result = sqlite3_column_int(dbstmt, 0);
-
-	sqlite3_finalize(dbstmt);
+	int result = sqlite3_column_int(stmt, 0);
+	db_stmt_done(stmt);
 
 	return result;
 }
 
 bool db_set_FTL_property(unsigned int ID, int value)
 {
-	return dbquery("INSERT OR REPLACE INTO ftl (id, value) VALUES ( %u, %i );", ID, value);
+	sqlite3_stmt* stmt = db_stmt(STMT_SET_PROPERTY);
+	if(stmt == NULL)
+		return false;
+
+	sqlite3_bind_int(stmt, 1, ID);
+	sqlite3_bind_int(stmt, 2, value);
+	return db_stmt_exec(STMT_SET_PROPERTY);
 }
 
 bool db_set_counter(unsigned int ID, int value)
 {
-	return dbquery("INSERT OR REPLACE INTO counters (id, value) VALUES ( %u, %i );", ID, value);
+	sqlite3_stmt* stmt = db_stmt(STMT_SET_COUNTER);
+	if(stmt == NULL)
+		return false;
+
+	sqlite3_bind_int(stmt, 1, ID);
+	sqlite3_bind_int(stmt, 2, value);
+	return db_stmt_exec(STMT_SET_COUNTER);
+}
+
+static bool db_update_counter(unsigned int ID, int delta)
+{
+	sqlite3_stmt* stmt = db_stmt(STMT_UPDATE_COUNTER);
+	if(stmt == NULL)
+		return false;
+
+	sqlite3_bind_int(stmt, 1, delta);
+	sqlite3_bind_int(stmt, 2, ID);
+	return db_stmt_exec(STMT_UPDATE_COUNTER);
 }
 
 bool db_update_counters(int total, int blocked)
 {
-	if(!dbquery("UPDATE counters SET value = value + %i WHERE id = %i;", total, DB_TOTALQUERIES))
+	if(!db_update_counter(DB_TOTALQUERIES, total))
 		return false;
-	if(!dbquery("UPDATE counters SET value = value + %i WHERE id = %i;", blocked, DB_BLOCKEDQUERIES))
+	if(!db_update_counter(DB_BLOCKEDQUERIES, blocked))
 		return false;
 	return true;
 }
 
-int number_of_queries_in_DB(void)
+static int db_get_counter(unsigned int ID)
 {
-	sqlite3_stmt* stmt;
-
-	// Count number of rows using the index timestamp is faster than select(*)
-	int rc = sqlite3_prepare_v2(db, "SELECT COUNT(timestamp) FROM queries", -1, &stmt, NULL);
-	if( rc ){
-		logg("number_of_queries_in_DB() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
-		dbclose();
-		check_database(rc);
+	sqlite3_stmt* stmt = db_stmt(STMT_GET_COUNTER);
+	if(stmt == NULL)
 		return -1;
-	}
 
-	rc = sqlite3_step(stmt);
+	sqlite3_bind_int(stmt, 1, ID);
+	int rc = sqlite3_step(stmt);
 	if( rc != SQLITE_ROW ){
-		logg("number_of_queries_in_DB() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
-		dbclose();
+		logg("db_get_counter() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		db_stmt_done(stmt);
 		check_database(rc);
 		return -1;
 	}
 
 	int result = sqlite3_column_int(stmt, 0);
-
-	sqlite3_finalize(stmt);
+	db_stmt_done(stmt);
 
 	return result;
 }
 
-int get_number_of_queries_in_DB(void)
+// Add (sign = 1) or subtract (sign = -1) stored queries, given per status
+static bool db_update_stored(const int *stored, int sign)
 {
-	int result = -1;
+	int total = 0;
+	for(int status = QUERY_UNKNOWN; status < QUERY_STATUS_MAX; status++)
+	{
+		if(stored[status] == 0)
+			continue;
+		if(!db_update_counter(DB_STOREDSTATUS + status, sign*stored[status]))
+			return false;
+		total += stored[status];
+	}
+	return total == 0 || db_update_counter(DB_STOREDQUERIES, sign*total);
+}
 
-	if(!dbopen())
+// Initialize the statistics about stored queries returned by get_DB_content()
+static bool db_init_stored(const int *stored, int oldest)
+{
+	int total = 0;
+	for(int status = QUERY_UNKNOWN; status < QUERY_STATUS_MAX; status++)
+	{
+		if(!db_set_counter(DB_STOREDSTATUS + status, stored[status]))
+			return false;
+		total += stored[status];
+	}
+	return db_set_counter(DB_STOREDQUERIES, total) &&
+	       db_set_FTL_property(DB_OLDESTTIMESTAMP, oldest);
+}
+
+// Timestamp of the oldest stored query (0 = none), uses the timestamp index
+static int db_oldest_timestamp(void)
+{
+	int oldest = db_query_int("SELECT IFNULL(MIN(timestamp),0) FROM main.query_storage;", 0);
+	if(config.DBpartition > 0)
 	{
-		logg("Failed to open DB in get_number_of_queries_in_DB()");
-		return -2;
+		int partoldest = partition_oldest();
+		if(partoldest > 0 && (oldest <= 0 || partoldest < oldest))
+			oldest = partoldest;
 	}
+	return oldest;
+}
 
-	result = number_of_queries_in_DB();
+// Statistics about the stored queries. They are kept up to date by
+// save_to_DB() and delete_old_queries_in_DB(), no table is scanned here
+bool get_DB_content(dbcontentStruct *content)
+{
+	memset(content, 0, sizeof(*content));
+	if(!dbopen())
+		return false;
 
-	// Close database
+	content->queries = db_get_counter(DB_STOREDQUERIES);
+	for(int status = QUERY_UNKNOWN; status < QUERY_STATUS_MAX; status++)
+		content->status[status] = db_get_counter(DB_STOREDSTATUS + status);
+	content->oldest = db_get_FTL_property(DB_OLDESTTIMESTAMP);
+	content->newest = db_get_FTL_property(DB_LASTTIMESTAMP);
+	content->pages = db_query_int("PRAGMA page_count;", 0);
+	content->freepages = db_query_int("PRAGMA freelist_count;", 0);
+	content->pagesize = db_query_int("PRAGMA page_size;", 0);
 	dbclose();
 
+	struct stat st;
+	char *walfile = sqlite3_mprintf("%s-wal", FTLfiles.db);
+	if(walfile != NULL && stat(walfile, &st) == 0)
+		content->walsize = st.st_size;
+	sqlite3_free(walfile);
+
+	return true;
+}
+
+// Total number of queries ever saved in the database, this changes with
+// every transaction that stored queries. Returns -1 on error
+int get_saved_queries_in_DB(void)
+{
+	if(!dbopen())
+		return -1;
+
+	int result = db_get_counter(DB_TOTALQUERIES);
+
+	dbclose();
 	return result;
 }
 
-void save_to_DB(void)
+// Get the ID of a domain, client or upstream server in its dictionary
+// table, adding it if it is not known yet. Returns 0 on error
+static int db_dictionary_id(unsigned int dict, const char *value)
+{
+	sqlite3_stmt* stmt = db_stmt(dictfind[dict]);
+	if(stmt == NULL)
+		return 0;
+
+	sqlite3_bind_text(stmt, 1, value, -1, SQLITE_STATIC);
+	int rc = sqlite3_step(stmt);
+	int id = rc == SQLITE_ROW ? sqlite3_column_int(stmt, 0) : 0;
+	db_stmt_done(stmt);
+
+	if(rc == SQLITE_ROW)
+		return id;
+	if(rc != SQLITE_DONE)
+	{
+		logg("db_dictionary_id() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+		return 0;
+	}
+
+	stmt = db_stmt(dictadd[dict]);
+	if(stmt == NULL)
+		return 0;
+
+	sqlite3_bind_text(stmt, 1, value, -1, SQLITE_STATIC);
+	if(!db_stmt_exec(dictadd[dict]))
+		return 0;
+
+	return sqlite3_last_insert_rowid(db);
+}
+
+// Dictionary IDs are cached in the domains, clients and forwarded structs.
+// They have to be forgotten when a transaction that may have added them
+// to the database is rolled back
+static void db_forget_dictionary_ids(void)
+{
+	int i;
+	for(i = 0; i < counters.domains; i++)
+		domains[i].dbid = 0;
+	for(i = 0; i < counters.clients; i++)
+		clients[i].dbid = 0;
+	for(i = 0; i < counters.forwarded; i++)
+		forwarded[i].dbid = 0;
+	hiddendomainID = hiddenclientID = 0;
+}
+
+static int db_domain_id(int queryID)
+{
+	if(queries[queryID].privacylevel >= PRIVACY_HIDE_DOMAINS)
+	{
+		if(hiddendomainID == 0)
+			hiddendomainID = db_dictionary_id(DICT_DOMAINS, HIDDEN_DOMAIN);
+		return hiddendomainID;
+	}
+
+	int domainID = queries[queryID].domainID;
+	validate_access("domains", domainID, true, __LINE__, __FUNCTION__, __FILE__);
+	if(domains[domainID].dbid == 0)
+		domains[domainID].dbid = db_dictionary_id(DICT_DOMAINS, domains[domainID].domain);
+	return domains[domainID].dbid;
+}
+
+static int db_client_id(int queryID)
+{
+	if(queries[queryID].privacylevel >= PRIVACY_HIDE_DOMAINS_CLIENTS)
+	{
+		if(hiddenclientID == 0)
+			hiddenclientID = db_dictionary_id(DICT_CLIENTS, HIDDEN_CLIENT);
+		return hiddenclientID;
+	}
+
+	int clientID = queries[queryID].clientID;
+	validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
+	if(clients[clientID].dbid == 0)
+		clients[clientID].dbid = db_dictionary_id(DICT_CLIENTS, clients[clientID].ip);
+	return clients[clientID].dbid;
+}
+
+static int db_upstream_id(int forwardID)
+{
+	validate_access("forwarded", forwardID, true, __LINE__, __FUNCTION__, __FILE__);
+	if(forwarded[forwardID].dbid == 0)
+		forwarded[forwardID].dbid = db_dictionary_id(DICT_UPSTREAMS, forwarded[forwardID].ip);
+	return forwarded[forwardID].dbid;
+}
+
+// Add the collected rollup counts to the rollup tables
+static void rollup_flush(void)
+{
+	for(unsigned int i = 0; i < ROLLUPSLOTS; i++)
+	{
+		if(rollups[i].count == 0)
+			continue;
+
+		unsigned int period = rollups[i].period;
+		sqlite3_stmt* stmt = db_stmt(rollupupsert[period]);
+		if(stmt != NULL)
+		{
+			sqlite3_bind_int(stmt, 1, rollups[i].timestamp);
+			sqlite3_bind_int(stmt, 2, rollups[i].kind);
+			sqlite3_bind_int(stmt, 3, rollups[i].item);
+			sqlite3_bind_int(stmt, 4, rollups[i].count);
+			db_stmt_exec(rollupupsert[period]);
+		}
+		rollups[i].count = 0;
+	}
+	rollupsused = 0;
+}
+
+static void rollup_count(unsigned int period, int timestamp, int kind, int item)
+{
+	if(rollupsused >= ROLLUPSLOTS/2)
+		rollup_flush();
+
+	int bucket = timestamp - timestamp % rollupperiod[period];
+	unsigned int pos = ((unsigned int)bucket * 31U + (unsigned int)kind * 131071U +
+	                    (unsigned int)item * 2654435761U + period) & (ROLLUPSLOTS-1);
+	while(rollups[pos].count > 0)
+	{
+		if(rollups[pos].period == (int)period && rollups[pos].timestamp == bucket &&
+		   rollups[pos].kind == kind && rollups[pos].item == item)
+		{
+			rollups[pos].count++;
+			return;
+		}
+		pos = (pos + 1) & (ROLLUPSLOTS-1);
+	}
+
+	rollups[pos].period = period;
+	rollups[pos].timestamp = bucket;
+	rollups[pos].kind = kind;
+	rollups[pos].item = item;
+	rollups[pos].count = 1;
+	rollupsused++;
+}
+
+// Count a stored query in the hourly and daily rollups
+static void rollup_query(int queryID, int domainID, int clientID, int forwardID)
+{
+	int timestamp = queries[queryID].timestamp;
+	unsigned char status = queries[queryID].status;
+	bool blocked = status == QUERY_GRAVITY || status == QUERY_WILDCARD ||
+	               status == QUERY_BLACKLIST || status == QUERY_EXTERNAL_BLOCKED;
+
+	for(unsigned int period = ROLLUP_HOURLY; period < ROLLUP_PERIODS; period++)
+	{
+		rollup_count(period, timestamp, ROLLUP_STATUS, status);
+		rollup_count(period, timestamp, ROLLUP_TYPE, queries[queryID].type);
+		rollup_count(period, timestamp, ROLLUP_REPLY, queries[queryID].reply);
+		rollup_count(period, timestamp, ROLLUP_CLIENT, clientID);
+		if(forwardID > 0)
+			rollup_count(period, timestamp, ROLLUP_UPSTREAM, forwardID);
+		rollup_count(period, timestamp, blocked ? ROLLUP_BLOCKED_DOMAIN : ROLLUP_DOMAIN, domainID);
+	}
+}
+
+// Store at most DBBATCHSIZE queries in one transaction, returns true
+// if the batch was full and there are more queries waiting to be stored
+bool save_to_DB(void)
 {
 	// Don't save anything to the database if in PRIVACY_NOSTATS mode
 	if(config.privacylevel >= PRIVACY_NOSTATS)
-		return;
+		return false;
 
 	// Start database timer
-	if(debug) timer_start(DATABASE_WRITE_TIMER);
+	timer_start(DATABASE_WRITE_TIMER);
 
 	// Open database
 	if(!dbopen())
 	{
 		logg("save_to_DB() - failed to open DB");
-		return;
+		return false;
 	}
 
 	unsigned int saved = 0, saved_error = 0;
 	long int i;
-	sqlite3_stmt* stmt;
 
-	bool ret = dbquery("BEGIN TRANSACTION");
-	if(!ret)
+	// Store queries in the partition of the oldest query not saved so far.
+	// A batch ends when reaching a query belonging to the next partition
+	time_t partend = 0;
+	if(config.DBpartition > 0)
+	{
+		time_t oldest = lastdbindex < counters.queries ? queries[lastdbindex].timestamp : time(NULL);
+		if(!partition_switch(oldest))
+		{
+			logg("save_to_DB() - unable to switch partition");
+			dbclose();
+			return false;
+		}
+		partend = partcurrent + config.DBpartition;
+	}
+
+	if(!db_stmt_exec(STMT_BEGIN))
 	{
-		logg("save_to_DB() - unable to begin transaction (%i): %s", ret, sqlite3_errmsg(db));
+		logg("save_to_DB() - unable to begin transaction");
 		dbclose();
-		return;
+		return false;
 	}
 
-	int rc = sqlite3_prepare_v2(db, "INSERT INTO queries VALUES (NULL,?,?,?,?,?,?)", -1, &stmt, NULL);
-	if( rc )
+	sqlite3_stmt* stmt = db_stmt(partend > 0 ? STMT_INSERT_PARTITION : STMT_INSERT_QUERY);
+	if(stmt == NULL)
 	{
-		logg("save_to_DB() - error in preparing SQL statement (%i): %s", ret, sqlite3_errmsg(db));
+		logg("save_to_DB() - error in preparing SQL statement");
+		dbquery("ROLLBACK;");
 		dbclose();
-		check_database(rc);
-		return;
+		return false;
 	}
 
-	int total = 0, blocked = 0;
+	int total = 0, blocked = 0, stored[QUERY_STATUS_MAX] = { 0 };
 	time_t currenttimestamp = time(NULL);
-	time_t newlasttimestamp = 0;
-	for(i = 0; i < counters.queries; i++)
+	time_t newlasttimestamp = 0, oldesttimestamp = 0;
+	sqlite3_int64 lastid = 0;
+	bool nextpartition = false;
+	// Everything before lastdbindex has already been stored
+	for(i = lastdbindex; i < counters.queries && saved < DBBATCHSIZE; i++)
 	{
 		validate_access("queries", i, true, __LINE__, __FUNCTION__, __FILE__);
 		if(queries[i].db)
@@ -384,6 +1406,13 @@ void save_to_DB(void)
 			continue;
 		}
 
+		if(partend > 0 && queries[i].timestamp >= partend)
+		{
+			// Continue with the next partition in a new transaction
+			nextpartition = true;
+			break;
+		}
+
 		if(!queries[i].complete && queries[i].timestamp > currenttimestamp-2)
 		{
 			// Break if a brand new query (age < 2 seconds) is not yet completed
@@ -401,6 +1430,13 @@ void save_to_DB(void)
 			continue;
 		}
 
+		// Resolve the dictionary IDs first, this may run other statements
+		int domainID = db_domain_id(i);
+		int clientID = db_client_id(i);
+		int forwardID = -1;
+		if(queries[i].status == QUERY_FORWARDED && queries[i].forwardID > -1)
+			forwardID = db_upstream_id(queries[i].forwardID);
+
 		// TIMESTAMP
 		sqlite3_bind_int(stmt, 1, queries[i].timestamp);
 
@@ -411,31 +1447,32 @@ void save_to_DB(void)
 		sqlite3_bind_int(stmt, 3, queries[i].status);
 
 		// DOMAIN
-		char *domain = getDomainString(i);
-		sqlite3_bind_text(stmt, 4, domain, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int(stmt, 4, domainID);
 
 		// CLIENT
-		char *client = getClientIPString(i);
-		sqlite3_bind_text(stmt, 5, client, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int(stmt, 5, clientID);
 
 		// FORWARD
-		if(queries[i].status == QUERY_FORWARDED && queries[i].forwardID > -1)
-		{
-			validate_access("forwarded", queries[i].forwardID, true, __LINE__, __FUNCTION__, __FILE__);
-			sqlite3_bind_text(stmt, 6, forwarded[queries[i].forwardID].ip, -1, SQLITE_TRANSIENT);
-		}
+		if(forwardID > -1)
+			sqlite3_bind_int(stmt, 6, forwardID);
 		else
-		{
 			sqlite3_bind_null(stmt, 6);
-		}
 
-		// Step and check if successful
-		rc = sqlite3_step(stmt);
-		sqlite3_clear_bindings(stmt);
-		sqlite3_reset(stmt);
+		// Step and check if successful. Failed dictionary
+		// lookups have already reported their error
+		bool resolved = domainID > 0 && clientID > 0 && forwardID != 0;
+		int rc = SQLITE_DONE;
+		if(resolved)
+			rc = sqlite3_step(stmt);
+		db_stmt_done(stmt);
 
-		if( rc != SQLITE_DONE ){
-			logg("save_to_DB() - SQL error (%i): %s", rc, sqlite3_errmsg(db));
+		if( !resolved || rc != SQLITE_DONE ){
+			if(rc != SQLITE_DONE)
+			{
+				logg("save_to_DB() - SQL error (%i): %s", rc, sqlite3_errmsg(db));
+				// Check this error message
+				check_database(rc);
+			}
 			saved_error++;
 			if(saved_error < 3)
 			{
@@ -446,13 +1483,13 @@ void save_to_DB(void)
 				logg("save_to_DB() - exiting due to too many errors");
 				break;
 			}
-			// Check this error message
-			check_database(rc);
 		}
 
 		saved++;
+		lastid = sqlite3_last_insert_rowid(db);
 		// Mark this query as saved in the database only if successful
 		queries[i].db = true;
+		rollup_query(i, domainID, clientID, forwardID);
 
 		// Total counter information (delta computation)
 		total++;
@@ -462,73 +1499,511 @@ void save_to_DB(void)
 		   queries[i].status == QUERY_EXTERNAL_BLOCKED)
 			blocked++;
 
+		if(queries[i].status < QUERY_STATUS_MAX)
+			stored[queries[i].status]++;
+
 		// Update lasttimestamp variable with timestamp of the latest stored query
 		if(queries[i].timestamp > newlasttimestamp)
 			newlasttimestamp = queries[i].timestamp;
+		if(oldesttimestamp == 0 || queries[i].timestamp < oldesttimestamp)
+			oldesttimestamp = queries[i].timestamp;
 	}
 
-	// Finish prepared statement
-	ret = dbquery("END TRANSACTION");
-	int ret2 = sqlite3_finalize(stmt);
-	if(!ret || ret2 != SQLITE_OK){ dbclose(); return; }
-
 	// Store index for next loop interation round and update last time stamp
 	// in the database only if all queries have been saved successfully
 	if(saved_error == 0)
 	{
 		lastdbindex = i;
-		db_set_FTL_property(DB_LASTTIMESTAMP, newlasttimestamp);
+		if(saved > 0)
+			db_set_FTL_property(DB_LASTTIMESTAMP, newlasttimestamp);
 	}
 
 	// Update total counters in DB
-	if(!db_update_counters(total, blocked))
+	db_update_counters(total, blocked);
+	db_update_stored(stored, 1);
+	if(oldesttimestamp > 0)
+	{
+		sqlite3_stmt* oldeststmt = db_stmt(STMT_LOWER_PROPERTY);
+		if(oldeststmt != NULL)
+		{
+			sqlite3_bind_int(oldeststmt, 1, DB_OLDESTTIMESTAMP);
+			sqlite3_bind_int(oldeststmt, 2, oldesttimestamp);
+			db_stmt_exec(STMT_LOWER_PROPERTY);
+		}
+	}
+	rollup_flush();
+
+	// Remember the last ID handed out in a partition, the next partition
+	// continues from there
+	if(partend > 0 && saved > 0)
+	{
+		sqlite3_stmt* seqstmt = db_stmt(STMT_UPDATE_SEQUENCE);
+		if(seqstmt != NULL)
+		{
+			sqlite3_bind_int64(seqstmt, 1, lastid);
+			db_stmt_exec(STMT_UPDATE_SEQUENCE);
+		}
+	}
+
+	// Finish transaction. Roll back if this failed so that the
+	// connection does not stay inside the open transaction
+	if(!db_stmt_exec(STMT_END))
 	{
+		dbquery("ROLLBACK;");
+		db_forget_dictionary_ids();
 		dbclose();
-		return;
+		return false;
 	}
 
-	// Close database
+	// Release database
 	dbclose();
 
+	// Update commit statistics (only for transactions that stored something)
+	double latency = timer_elapsed_msec(DATABASE_WRITE_TIMER);
+	if(saved > 0)
+	{
+		dbstats.commits++;
+		dbstats.lastbatch = saved;
+		dbstats.lastlatency = latency;
+		dbstats.totallatency += latency;
+		if(saved > dbstats.maxbatch)
+			dbstats.maxbatch = saved;
+		if(latency > dbstats.maxlatency)
+			dbstats.maxlatency = latency;
+	}
+
 	if(debug)
 	{
-		logg("Notice: Queries stored in DB: %u (took %.1f ms)", saved, timer_elapsed_msec(DATABASE_WRITE_TIMER));
+		logg("Notice: Queries stored in DB: %u (took %.1f ms)", saved, latency);
 		if(saved_error > 0)
 			logg("        There are queries that have not been saved");
 	}
+
+	return saved == DBBATCHSIZE || (nextpartition && saved_error == 0);
+}
+
+// Reduce the domains of closed rollup buckets to the most queried ones. A
+// bucket is considered closed once all of its queries have been stored
+static void db_prune_rollups(void)
+{
+	static int pruned[ROLLUP_PERIODS] = { 0 };
+	time_t closed = time(NULL) - config.DBinterval - 60;
+
+	for(unsigned int period = ROLLUP_HOURLY; period < ROLLUP_PERIODS; period++)
+	{
+		int length = rollupperiod[period];
+		int until = closed - closed % length;
+		if(until <= pruned[period])
+			continue;
+
+		// After a restart, only look at the most recent buckets
+		int from = pruned[period] > 0 ? pruned[period] : until - 2*length;
+		if(!dbopen())
+			return;
+		if(rollup_prune(period, from, until))
+			pruned[period] = until;
+		dbclose();
+	}
+}
+
+// Copy the write-ahead log into the database file. This is done only
+// once the log grew beyond DBCHECKPOINTPAGES to keep the number of
+// (random) writes to the database file low
+void db_checkpoint(void)
+{
+	if(!dbopen())
+		return;
+
+	if(debug) timer_start(DATABASE_WRITE_TIMER);
+	int logpages = 0, checkpointed = 0;
+	int rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &logpages, &checkpointed);
+	dbclose();
+
+	if(rc != SQLITE_OK)
+	{
+		logg("db_checkpoint() - SQL error (%i): %s", rc, sqlite3_errstr(rc));
+		check_database(rc);
+		return;
+	}
+
+	// The log is rewound with the next commit when everything has been
+	// copied, otherwise a reader is still holding back some pages
+	if(checkpointed == logpages)
+		dbstats.walpages = 0;
+	dbstats.checkpoints++;
+
+	if(debug) logg("Notice: Database checkpoint copied %i of %i pages (took %.1f ms)", checkpointed, logpages, timer_elapsed_msec(DATABASE_WRITE_TIMER));
+}
+
+// Run a query returning a single integer, the optional parameter is bound
+// to the first placeholder. Returns -1 on error
+static int db_query_int(const char *querystr, int arg)
+{
+	sqlite3_stmt* stmt;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	if( rc ){
+		logg("db_query_int(%s) - SQL error prepare (%i): %s", querystr, rc, sqlite3_errmsg(db));
+		check_database(rc);
+		return -1;
+	}
+
+	if(sqlite3_bind_parameter_count(stmt) > 0)
+		sqlite3_bind_int(stmt, 1, arg);
+
+	int result = -1;
+	rc = sqlite3_step(stmt);
+	if(rc == SQLITE_ROW)
+		result = sqlite3_column_int(stmt, 0);
+	else
+	{
+		logg("db_query_int(%s) - SQL error step (%i): %s", querystr, rc, sqlite3_errmsg(db));
+		check_database(rc);
+	}
+
+	sqlite3_finalize(stmt);
+	return result;
+}
+
+// Delete at most chunk queries older than timestamp and subtract them from
+// the stored query counts in one transaction. The deleted queries are
+// counted by their status first as the bundled SQLite does not support
+// DELETE ... RETURNING. Returns the number of deleted queries, -1 on error
+static int db_delete_chunk(int timestamp, int chunk)
+{
+	if(!db_stmt_exec(STMT_BEGIN))
+		return -1;
+
+	int deleted = 0, stored[QUERY_STATUS_MAX] = { 0 };
+	int rc = SQLITE_ERROR;
+	sqlite3_stmt* stmt = db_stmt(STMT_COUNT_OLD);
+	if(stmt != NULL)
+	{
+		sqlite3_bind_int(stmt, 1, timestamp);
+		sqlite3_bind_int(stmt, 2, chunk);
+		while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		{
+			int status = sqlite3_column_int(stmt, 0);
+			int count = sqlite3_column_int(stmt, 1);
+			if(status >= QUERY_UNKNOWN && status < QUERY_STATUS_MAX)
+				stored[status] += count;
+			deleted += count;
+		}
+		db_stmt_done(stmt);
+	}
+
+	// Delete the same queries (nothing else writes to the database
+	// while we are holding the lock)
+	if(rc == SQLITE_DONE && deleted > 0)
+	{
+		rc = SQLITE_ERROR;
+		stmt = db_stmt(STMT_DELETE_OLD);
+		if(stmt != NULL)
+		{
+			sqlite3_bind_int(stmt, 1, timestamp);
+			sqlite3_bind_int(stmt, 2, chunk);
+			rc = sqlite3_step(stmt);
+			db_stmt_done(stmt);
+		}
+	}
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("db_delete_chunk() - SQL error (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+	}
+
+	if(rc != SQLITE_DONE || !db_update_stored(stored, -1) || !db_stmt_exec(STMT_END))
+	{
+		dbquery("ROLLBACK;");
+		return -1;
+	}
+
+	return deleted;
 }
 
-void delete_old_queries_in_DB(void)
+// Delete queries older than MAXDBDAYS in chunks that use the timestamp
+// index. Every call works for about DBDELETEBUDGET milliseconds so that
+// saving new queries is never held up for long, and returns true once
+// all old queries have been deleted (and their space been reclaimed)
+bool delete_old_queries_in_DB(void)
 {
+	// Number of rows per chunk, adapted to the speed of the device
+	static int chunk = 1000;
+	// Rows deleted so far in this run
+	static int deleted = 0;
+
 	// Open database
 	if(!dbopen())
 	{
 		logg("Failed to open DB in delete_old_queries_in_DB()");
-		return;
+		return true;
 	}
 
+	timer_start(DATABASE_DELETE_TIMER);
 	int timestamp = time(NULL) - config.maxDBdays * 86400;
+	bool done = false;
 
-	if(!dbquery("DELETE FROM queries WHERE timestamp <= %i", timestamp))
+	// Partitions are deleted as a whole once all of their queries expired,
+	// the main database may still hold queries from before partitioning
+	if(config.DBpartition > 0 && deleted == 0)
 	{
-		dbclose();
-		logg("delete_old_queries_in_DB(): Deleting queries due to age of entries failed!");
-		database = true;
-		return;
+		int stored[QUERY_STATUS_MAX] = { 0 };
+		int expired = partition_expire(timestamp, stored);
+		if(expired > 0)
+		{
+			logg("Notice: Deleted %i expired database partition%s", expired, expired > 1 ? "s" : "");
+			db_update_stored(stored, -1);
+			for(int status = QUERY_UNKNOWN; status < QUERY_STATUS_MAX; status++)
+				deleted += stored[status];
+		}
 	}
 
-	// Get how many rows have been affected (deleted)
-	int affected = sqlite3_changes(db);
+	while(!done && timer_elapsed_msec(DATABASE_DELETE_TIMER) < DBDELETEBUDGET)
+	{
+		double start = timer_elapsed_msec(DATABASE_DELETE_TIMER);
+		int affected = db_delete_chunk(timestamp, chunk);
+		if(affected < 0)
+		{
+			dbclose();
+			logg("delete_old_queries_in_DB(): Deleting queries due to age of entries failed!");
+			deleted = 0;
+			database = true;
+			return true;
+		}
+
+		deleted += affected;
+		done = affected < chunk;
 
-	// Print final message only if there is a difference
-	if(debug || affected)
-		logg("Notice: Database size is %.2f MB, deleted %i rows", get_db_filesize(), affected);
+		// Aim for chunks taking about a quarter of the time budget
+		double took = timer_elapsed_msec(DATABASE_DELETE_TIMER) - start;
+		if(took > DBDELETEBUDGET/2.0 && chunk > 100)
+			chunk /= 2;
+		else if(took < DBDELETEBUDGET/8.0 && chunk < 100000 && affected == chunk)
+			chunk *= 2;
+	}
+
+	// Hourly rollups are kept as long as the queries themselves
+	if(done)
+		dbquery("DELETE FROM rollup_hourly WHERE timestamp <= %i;", timestamp);
 
-	// Close database
+	// The oldest remaining query is found using the timestamp index
+	if(done && deleted > 0)
+		db_set_FTL_property(DB_OLDESTTIMESTAMP, db_oldest_timestamp());
+
+	// Return free pages to the file system if the database has been
+	// created with auto_vacuum=INCREMENTAL (default for new databases)
+	if(done && db_query_int("PRAGMA auto_vacuum;", 0) == 2)
+	{
+		while(db_query_int("PRAGMA freelist_count;", 0) > 0)
+		{
+			if(timer_elapsed_msec(DATABASE_DELETE_TIMER) >= DBDELETEBUDGET)
+			{
+				done = false;
+				break;
+			}
+			dbquery("PRAGMA incremental_vacuum(%i);", DBVACUUMPAGES);
+		}
+	}
+
+	// Release database
 	dbclose();
 
+	// Print final message only if there is a difference
+	if(done && (debug || deleted))
+		logg("Notice: Database size is %.2f MB, deleted %i rows", get_db_filesize(), deleted);
+	if(done)
+		deleted = 0;
+
 	// Re-enable database actions
 	database = true;
+	return done;
+}
+
+// Read rollups for the API. With totals, the callback gets one row per item
+// summed up over [from,until] (most queried first, at most limit rows),
+// otherwise one row per bucket and item in chronological order. Names are
+// only available for clients, upstream servers and domains
+bool db_read_rollups(bool daily, int kind, int from, int until, bool totals, int limit,
+                     void (*callback)(int timestamp, int item, const char *name, int count, void *arg), void *arg)
+{
+	const char *name = "NULL", *join = "";
+	if(kind == ROLLUP_CLIENT)
+	{
+		name = "clients.ip";
+		join = "LEFT JOIN clients ON clients.id = item";
+	}
+	else if(kind == ROLLUP_UPSTREAM)
+	{
+		name = "upstreams.ip";
+		join = "LEFT JOIN upstreams ON upstreams.id = item";
+	}
+	else if(kind == ROLLUP_DOMAIN || kind == ROLLUP_BLOCKED_DOMAIN)
+	{
+		name = "domains.domain";
+		join = "LEFT JOIN domains ON domains.id = item";
+	}
+
+	const char *table = rolluptable[daily ? ROLLUP_DAILY : ROLLUP_HOURLY];
+	char *querystr;
+	if(totals)
+		querystr = sqlite3_mprintf("SELECT 0, item, %s, SUM(count) AS total FROM %s %s WHERE kind = ?1 AND timestamp >= ?2 AND timestamp <= ?3 GROUP BY item ORDER BY total DESC LIMIT ?4;", name, table, join);
+	else
+		querystr = sqlite3_mprintf("SELECT timestamp, item, %s, count FROM %s %s WHERE kind = ?1 AND timestamp >= ?2 AND timestamp <= ?3 ORDER BY timestamp, item;", name, table, join);
+	if(querystr == NULL)
+	{
+		logg("Memory allocation failed in db_read_rollups()");
+		return false;
+	}
+
+	if(!dbopen())
+	{
+		sqlite3_free(querystr);
+		return false;
+	}
+
+	sqlite3_stmt* stmt;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	sqlite3_free(querystr);
+	if( rc ){
+		logg("db_read_rollups() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+		dbclose();
+		return false;
+	}
+
+	sqlite3_bind_int(stmt, 1, kind);
+	sqlite3_bind_int(stmt, 2, from);
+	sqlite3_bind_int(stmt, 3, until);
+	if(totals)
+		sqlite3_bind_int(stmt, 4, limit);
+
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		callback(sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1),
+		         (const char *)sqlite3_column_text(stmt, 2), sqlite3_column_int(stmt, 3), arg);
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("db_read_rollups() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+	}
+
+	sqlite3_finalize(stmt);
+	dbclose();
+	return rc == SQLITE_DONE;
+}
+
+// Read queries of one schema for db_read_queries(), found is the number of
+// queries read from newer schemas. Returns the number of queries read here
+static int db_read_queries_from(const char *schema, const dbqueryfilterStruct *filter, int found,
+                                void (*callback)(int id, int timestamp, int type, int status, const char *domain, const char *client, void *arg), void *arg)
+{
+	// Filters on the client or domain compare dictionary IDs, the
+	// subqueries are run only once. Names are looked up for returned rows
+	char *querystr = sqlite3_mprintf("SELECT id, timestamp, type, status, "
+	                                 "(SELECT domain FROM main.domains WHERE id = q.domain), "
+	                                 "(SELECT ip FROM main.clients WHERE id = q.client) "
+	                                 "FROM %s.query_storage AS q WHERE timestamp >= ?1 AND (timestamp,id) < (?2,?3)%s%s%s%s "
+	                                 "ORDER BY timestamp DESC, id DESC LIMIT ?8;", schema,
+	                                 filter->client != NULL ? " AND client = (SELECT id FROM main.clients WHERE ip = ?4)" : "",
+	                                 filter->domain != NULL ? " AND domain = (SELECT id FROM main.domains WHERE domain = ?5)" : "",
+	                                 filter->status >= 0 ? " AND status = ?6" : "",
+	                                 filter->type > 0 ? " AND type = ?7" : "");
+	if(querystr == NULL)
+	{
+		logg("Memory allocation failed in db_read_queries()");
+		return -1;
+	}
+
+	sqlite3_stmt* stmt;
+	int rc = sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL);
+	sqlite3_free(querystr);
+	if( rc ){
+		logg("db_read_queries() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+		return -1;
+	}
+
+	sqlite3_bind_int(stmt, 1, filter->from);
+	sqlite3_bind_int(stmt, 2, filter->cursortimestamp);
+	sqlite3_bind_int(stmt, 3, filter->cursorid);
+	if(filter->client != NULL)
+		sqlite3_bind_text(stmt, 4, filter->client, -1, SQLITE_STATIC);
+	if(filter->domain != NULL)
+		sqlite3_bind_text(stmt, 5, filter->domain, -1, SQLITE_STATIC);
+	if(filter->status >= 0)
+		sqlite3_bind_int(stmt, 6, filter->status);
+	if(filter->type > 0)
+		sqlite3_bind_int(stmt, 7, filter->type);
+	// One more than requested tells if there is a further page
+	sqlite3_bind_int(stmt, 8, filter->limit + 1 - found);
+
+	int rows = 0;
+	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if(found + rows++ < filter->limit)
+			callback(sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1),
+			         sqlite3_column_int(stmt, 2), sqlite3_column_int(stmt, 3),
+			         (const char *)sqlite3_column_text(stmt, 4),
+			         (const char *)sqlite3_column_text(stmt, 5), arg);
+	}
+
+	if(rc != SQLITE_DONE)
+	{
+		logg("db_read_queries() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		check_database(rc);
+		rows = -1;
+	}
+
+	sqlite3_finalize(stmt);
+	return rows;
+}
+
+// Read one page of the query log for the API, newest queries first. Every
+// page is a range scan of one of the covering indexes, rows are handed to
+// the callback as they are read. Returns the number of matching queries
+// (one more than the limit if there is a further page), -1 on error
+int db_read_queries(const dbqueryfilterStruct *filter,
+                    void (*callback)(int id, int timestamp, int type, int status, const char *domain, const char *client, void *arg), void *arg)
+{
+	if(!dbopen())
+		return -1;
+
+	// Partitions are read newest first. The main database comes last,
+	// it holds the queries stored before partitioning has been enabled
+	time_t *list = NULL;
+	int count = config.DBpartition > 0 ? partition_list(&list) : 0;
+
+	int found = 0;
+	for(int i = count - 1; i >= -1 && found <= filter->limit; i--)
+	{
+		const char *schema = "main";
+		if(i >= 0)
+		{
+			if(list[i] > filter->cursortimestamp || list[i] + config.DBpartition <= filter->from)
+				continue;
+			if(list[i] == partcurrent)
+				schema = "part";
+			else if(partition_attach("p0", list[i], false))
+				schema = "p0";
+			else
+				continue;
+		}
+
+		int rows = db_read_queries_from(schema, filter, found, callback, arg);
+		if(strcmp(schema, "p0") == 0)
+			dbquery("DETACH DATABASE p0;");
+		if(rows < 0)
+		{
+			found = -1;
+			break;
+		}
+		found += rows;
+	}
+	if(list != NULL)
+		free(list);
+
+	dbclose();
+	return found;
 }
 
 int lastDBsave = 0;
@@ -543,35 +2018,108 @@ void *DB_thread(void *val)
 
 	while(!killed && database)
 	{
-		if(time(NULL) - lastDBsave >= config.DBinterval)
+		// Commit whenever a full batch is waiting, and anything
+		// that is left at least once every DBINTERVAL
+		if(time(NULL) - lastDBsave >= config.DBinterval ||
+		   counters.queries - lastdbindex >= DBBATCHSIZE)
 		{
 			// Update lastDBsave timer
 			lastDBsave = time(NULL) - time(NULL)%config.DBinterval;
 
-			// Lock FTL's data structure, since it is
-			// likely that it will be changed here
-			enable_thread_lock();
-
-			// Save data to database
-			save_to_DB();
+			bool more = true;
+			while(more && !killed)
+			{
+				// Lock FTL's data structure, since it is likely that it will be
+				// changed here. The lock is released between batches so that
+				// DNS queries are not held up by a long backlog
+				enable_thread_lock();
 
-			// Release thread lock
-			disable_thread_lock();
+				// Save data to database
+				more = save_to_DB();
 
-			// Check if GC should be done on the database
-			if(DBdeleteoldqueries)
-			{
-				// No thread locks needed
-				delete_old_queries_in_DB();
-				DBdeleteoldqueries = false;
+				// Release thread lock
+				disable_thread_lock();
 			}
+
+			// Reduce the domains of finished rollup buckets
+			db_prune_rollups();
+
+			// Run a checkpoint if the write-ahead log grew large enough
+			if(dbstats.walpages >= DBCHECKPOINTPAGES)
+				db_checkpoint();
+
 		}
+
+		// Check if GC should be done on the database. Old queries are
+		// deleted a chunk at a time in between storing new queries
+		// No thread locks needed
+		if(DBdeleteoldqueries && delete_old_queries_in_DB())
+			DBdeleteoldqueries = false;
+
 		sleepms(100);
 	}
 
 	return NULL;
 }
 
+// Add a dictionary entry to the in-memory structs while importing. The
+// import loop counts every query itself, so undo the count of find*ID()
+static int import_add(unsigned int dict, const char *str, int dbid)
+{
+	int ID;
+	switch(dict)
+	{
+		case DICT_DOMAINS:
+			ID = findDomainID(str);
+			domains[ID].count--;
+			domains[ID].dbid = dbid;
+			return ID;
+
+		case DICT_CLIENTS:
+			// Check if user wants to skip queries coming from localhost
+			if(config.ignore_localhost &&
+			   (strcmp(str, "127.0.0.1") == 0 || strcmp(str, "::1") == 0))
+				return -1;
+			ID = findClientID(str);
+			clients[ID].count--;
+			clients[ID].dbid = dbid;
+			return ID;
+
+		default:
+			ID = findForwardID(str, false);
+			forwarded[ID].dbid = dbid;
+			return ID;
+	}
+}
+
+// Map a dictionary ID to the ID of the corresponding in-memory struct. Each
+// entry is looked up only once, map holds ID + 1 afterwards (-1 = skip)
+static int import_id(unsigned int dict, int dbid, int *map, int mapsize)
+{
+	if(dbid < 1 || dbid >= mapsize)
+		return -1;
+
+	if(map[dbid] == 0)
+	{
+		map[dbid] = -1;
+		sqlite3_stmt* stmt = db_stmt(dictbyid[dict]);
+		if(stmt == NULL)
+			return -1;
+
+		sqlite3_bind_int(stmt, 1, dbid);
+		if(sqlite3_step(stmt) == SQLITE_ROW)
+		{
+			const char *str = (const char *)sqlite3_column_text(stmt, 0);
+			int ID = str != NULL ? import_add(dict, str, dbid) : -1;
+			if(ID > -1)
+				map[dbid] = ID + 1;
+		}
+		db_stmt_done(stmt);
+	}
+
+	return map[dbid] > 0 ? map[dbid] - 1 : -1;
+}
+
 // Get most recent 24 hours data from long-term database
 void read_data_from_DB(void)
 {
@@ -586,29 +2134,59 @@ void read_data_from_DB(void)
 		return;
 	}
 
-	// Prepare request
-	char *rstr = NULL;
+	timer_start(DATABASE_WRITE_TIMER);
+
 	// Get time stamp 24 hours in the past
 	time_t now = time(NULL);
 	time_t mintime = now - config.maxlogage;
-	int rc = asprintf(&rstr, "SELECT * FROM queries WHERE timestamp >= %li", mintime);
-	if(rc < 1)
+
+	// Queries stored in partitions are read through a temporary view
+	const char *source = "query_storage";
+	if(config.DBpartition > 0 && partition_union(mintime, now))
+		source = "query_union";
+
+	// Allocate all queries at once
+	char *querystr = sqlite3_mprintf("SELECT COUNT(timestamp) FROM %s WHERE timestamp >= ?;", source);
+	int expected = querystr != NULL ? db_query_int(querystr, mintime) : -1;
+	sqlite3_free(querystr);
+	if(expected > 0)
+		memory_reserve(QUERIES, counters.queries + expected);
+
+	// Dictionary IDs are mapped to the in-memory IDs on first use
+	int *map[3], mapsize[3];
+	for(unsigned int dict = DICT_DOMAINS; dict <= DICT_UPSTREAMS; dict++)
 	{
-		logg("read_data_from_DB() - Allocation error (%i): %s", rc, sqlite3_errmsg(db));
-		return;
+		mapsize[dict] = db_query_int(dictmaxid[dict], 0) + 1;
+		if(mapsize[dict] < 1)
+			mapsize[dict] = 1;
+		map[dict] = calloc(mapsize[dict], sizeof(int));
+		if(map[dict] == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
 	}
-	// Log DB query string in debug mode
-	if(debug) logg(rstr);
 
 	// Prepare SQLite3 statement
-	sqlite3_stmt* stmt;
-	rc = sqlite3_prepare_v2(db, rstr, -1, &stmt, NULL);
+	sqlite3_stmt* stmt = NULL;
+	querystr = sqlite3_mprintf("SELECT timestamp, type, status, domain, client, forward FROM %s WHERE timestamp >= ? ORDER BY timestamp, id;", source);
+	int rc = querystr != NULL ? sqlite3_prepare_v2(db, querystr, -1, &stmt, NULL) : SQLITE_NOMEM;
+	sqlite3_free(querystr);
 	if( rc ){
 		logg("read_data_from_DB() - SQL error prepare (%i): %s", rc, sqlite3_errmsg(db));
+		partition_union_done();
 		dbclose();
 		check_database(rc);
+		for(unsigned int dict = DICT_DOMAINS; dict <= DICT_UPSTREAMS; dict++)
+			free(map[dict]);
 		return;
 	}
+	sqlite3_bind_int(stmt, 1, mintime);
+
+	// Queries are returned in order of their timestamps (idx_queries_time),
+	// also when reading from several partitions, so consecutive queries
+	// mostly fall into the same overTime slot
+	int lastOverTimeTimeStamp = -1, timeidx = -1;
 
 	// Loop through returned database rows
 	while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
@@ -619,7 +2197,7 @@ void read_data_from_DB(void)
 		// Set ID for this query
 		int queryID = counters.queries;
 
-		int queryTimeStamp = sqlite3_column_int(stmt, 1);
+		int queryTimeStamp = sqlite3_column_int(stmt, 0);
 		// 1483228800 = 01/01/2017 @ 12:00am (UTC)
 		if(queryTimeStamp < 1483228800)
 		{
@@ -632,7 +2210,7 @@ void read_data_from_DB(void)
 			continue;
 		}
 
-		int type = sqlite3_column_int(stmt, 2);
+		int type = sqlite3_column_int(stmt, 1);
 		if(type < TYPE_A || type >= TYPE_MAX)
 		{
 			logg("DB warn: TYPE should not be %i", type);
@@ -645,54 +2223,51 @@ void read_data_from_DB(void)
 			continue;
 		}
 
-		int status = sqlite3_column_int(stmt, 3);
+		int status = sqlite3_column_int(stmt, 2);
 		if(status < QUERY_UNKNOWN || status > QUERY_EXTERNAL_BLOCKED)
 		{
 			logg("DB warn: STATUS should be within [%i,%i] but is %i", QUERY_UNKNOWN, QUERY_EXTERNAL_BLOCKED, status);
 			continue;
 		}
 
-		const char * domain = (const char *)sqlite3_column_text(stmt, 4);
-		if(domain == NULL)
-		{
-			logg("DB warn: DOMAIN should never be NULL, %i", queryTimeStamp);
-			continue;
-		}
-
-		const char * client = (const char *)sqlite3_column_text(stmt, 5);
-		if(client == NULL)
+		// Resolve the client first as queries from localhost may be skipped
+		int clientID = import_id(DICT_CLIENTS, sqlite3_column_int(stmt, 4), map[DICT_CLIENTS], mapsize[DICT_CLIENTS]);
+		if(clientID < 0)
 		{
-			logg("DB warn: CLIENT should never be NULL, %i", queryTimeStamp);
 			continue;
 		}
 
-		// Check if user wants to skip queries coming from localhost
-		if(config.ignore_localhost &&
-		   (strcmp(client, "127.0.0.1") == 0 || strcmp(client, "::1") == 0))
+		int domainID = import_id(DICT_DOMAINS, sqlite3_column_int(stmt, 3), map[DICT_DOMAINS], mapsize[DICT_DOMAINS]);
+		if(domainID < 0)
 		{
+			logg("DB warn: DOMAIN should never be unknown, %i", queryTimeStamp);
 			continue;
 		}
 
-		// Obtain IDs only after filtering which queries we want to keep
-		int domainID = findDomainID(domain);
-		int clientID = findClientID(client);
-
-		const char *forwarddest = (const char *)sqlite3_column_text(stmt, 6);
 		int forwardID = 0;
 		// Determine forwardID only when status == 2 (forwarded) as the
 		// field need not to be filled for other query status types
 		if(status == QUERY_FORWARDED)
 		{
-			if(forwarddest == NULL)
+			forwardID = import_id(DICT_UPSTREAMS, sqlite3_column_int(stmt, 5), map[DICT_UPSTREAMS], mapsize[DICT_UPSTREAMS]);
+			if(forwardID < 0)
 			{
 				logg("DB warn: FORWARD should not be NULL with status QUERY_FORWARDED, %i", queryTimeStamp);
 				continue;
 			}
-			forwardID = findForwardID(forwarddest, true);
+			forwarded[forwardID].count++;
 		}
 
+		// The query is kept, count it for its domain and client
+		domains[domainID].count++;
+		clients[clientID].count++;
+
 		int overTimeTimeStamp = queryTimeStamp - (queryTimeStamp % 600) + 300;
-		int timeidx = findOverTimeID(overTimeTimeStamp);
+		if(overTimeTimeStamp != lastOverTimeTimeStamp)
+		{
+			timeidx = findOverTimeID(overTimeTimeStamp);
+			lastOverTimeTimeStamp = overTimeTimeStamp;
+		}
 		validate_access("overTime", timeidx, true, __LINE__, __FUNCTION__, __FILE__);
 
 		// Store this query in memory
@@ -710,6 +2285,9 @@ void read_data_from_DB(void)
 		queries[queryID].complete = true; // Mark as all information is avaiable
 		queries[queryID].response = 0;
 		queries[queryID].AD = false;
+		queries[queryID].privacylevel = config.privacylevel;
+		queries[queryID].reply = REPLY_UNKNOWN;
+		queries[queryID].dnssec = DNSSEC_UNSPECIFIED;
 		lastDBimportedtimestamp = queryTimeStamp;
 
 		// Handle type counters
@@ -764,10 +2342,17 @@ void read_data_from_DB(void)
 				break;
 		}
 	}
-	logg("Imported %i queries from the long-term database", counters.queries);
+	logg("Imported %i queries from the long-term database (took %.1f ms)", counters.queries, timer_elapsed_msec(DATABASE_WRITE_TIMER));
+	for(unsigned int dict = DICT_DOMAINS; dict <= DICT_UPSTREAMS; dict++)
+		free(map[dict]);
+
+	// Imported queries need not be saved again
+	lastdbindex = counters.queries;
 
 	if( rc != SQLITE_DONE ){
 		logg("read_data_from_DB() - SQL error step (%i): %s", rc, sqlite3_errmsg(db));
+		sqlite3_finalize(stmt);
+		partition_union_done();
 		dbclose();
 		check_database(rc);
 		return;
@@ -775,6 +2360,6 @@ void read_data_from_DB(void)
 
 	// Finalize SQLite3 statement
 	sqlite3_finalize(stmt);
+	partition_union_done();
 	dbclose();
-	free(rstr);
 }
@@ -126,29 +126,95 @@ int findForwardID(const char * forward, bool count)
 	// to be done separately to be non-blocking
 	forwarded[forwardID].new = true;
 	forwarded[forwardID].name = NULL;
+	// Not yet stored in the long-term database
+	forwarded[forwardID].dbid = 0;
 	// Increase counter by one
 	counters.forwarded++;
 
 	return forwardID;
 }
 
-int findDomainID(const char *domain)
+// Hash indices over the domain names and client IPs. Slots hold the ID + 1
+// of the entry, 0 marks an empty slot. Entries are never removed, so the
+// index only ever grows together with the domains and clients arrays
+typedef struct {
+	int *slots;
+	unsigned int size;
+} stringIndexStruct;
+
+static stringIndexStruct domainindex = { NULL, 0 }, clientindex = { NULL, 0 };
+
+static const char *domainkey(int ID) { return domains[ID].domain; }
+static const char *clientkey(int ID) { return clients[ID].ip; }
+
+static unsigned int stringhash(const char *str)
 {
-	int i;
-	if(counters.domains > 0)
-		validate_access("domains", counters.domains-1, true, __LINE__, __FUNCTION__, __FILE__);
-	for(i=0; i < counters.domains; i++)
+	// FNV-1a
+	unsigned int hash = 2166136261U;
+	while(*str)
 	{
-		// Quick test: Does the domain start with the same character?
-		if(domains[i].domain[0] != domain[0])
-			continue;
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+// Returns the ID of str or -1 if it is not in the index
+static int index_find(const stringIndexStruct *index, const char *(*key)(int), const char *str)
+{
+	if(index->size == 0)
+		return -1;
 
-		// If so, compare the full domain using strcmp
-		if(strcmp(domains[i].domain, domain) == 0)
+	unsigned int mask = index->size - 1;
+	for(unsigned int pos = stringhash(str) & mask; index->slots[pos] != 0; pos = (pos + 1) & mask)
+	{
+		int ID = index->slots[pos] - 1;
+		if(strcmp(key(ID), str) == 0)
+			return ID;
+	}
+	return -1;
+}
+
+static void index_slot(stringIndexStruct *index, const char *(*key)(int), int ID)
+{
+	unsigned int mask = index->size - 1;
+	unsigned int pos = stringhash(key(ID)) & mask;
+	while(index->slots[pos] != 0)
+		pos = (pos + 1) & mask;
+	index->slots[pos] = ID + 1;
+}
+
+// Add an entry (IDs 0 ... ID-1 are in the index already). The
+// index is kept at most half full and rebuilt when it grows
+static void index_add(stringIndexStruct *index, const char *(*key)(int), int ID)
+{
+	if(2*(unsigned int)(ID + 1) > index->size)
+	{
+		unsigned int size = index->size > 0 ? 2*index->size : 1024;
+		int *slots = calloc(size, sizeof(int));
+		if(slots == NULL)
 		{
-			domains[i].count++;
-			return i;
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
 		}
+		if(index->slots != NULL)
+			free(index->slots);
+		index->slots = slots;
+		index->size = size;
+		for(int i = 0; i < ID; i++)
+			index_slot(index, key, i);
+	}
+	index_slot(index, key, ID);
+}
+
+int findDomainID(const char *domain)
+{
+	int i = index_find(&domainindex, domainkey, domain);
+	if(i > -1)
+	{
+		validate_access("domains", i, true, __LINE__, __FUNCTION__, __FILE__);
+		domain_count_change(i, 1, 0);
+		return i;
 	}
 
 	// If we did not return until here, then this domain is not known
@@ -169,30 +235,25 @@ int findDomainID(const char *domain)
 	domains[domainID].domain = strdup(domain);
 	// RegEx needs to be evaluated for this new domain
 	domains[domainID].regexmatch = REGEX_UNKNOWN;
+	// Not yet stored in the long-term database
+	domains[domainID].dbid = 0;
+	index_add(&domainindex, domainkey, domainID);
 	// Increase counter by one
 	counters.domains++;
+	toplist_add_domain(domainID);
 
 	return domainID;
 }
 
 int findClientID(const char *client)
 {
-	int i;
 	// Compare content of client against known client IP addresses
-	if(counters.clients > 0)
-		validate_access("clients", counters.clients-1, true, __LINE__, __FUNCTION__, __FILE__);
-	for(i=0; i < counters.clients; i++)
+	int i = index_find(&clientindex, clientkey, client);
+	if(i > -1)
 	{
-		// Quick test: Does the clients IP start with the same character?
-		if(clients[i].ip[0] != client[0])
-			continue;
-
-		// If so, compare the full IP using strcmp
-		if(strcmp(clients[i].ip, client) == 0)
-		{
-			clients[i].count++;
-			return i;
-		}
+		validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
+		client_count_change(i, 1, 0);
+		return i;
 	}
 
 	// If we did not return until here, then this client is definitely new
@@ -217,12 +278,27 @@ int findClientID(const char *client)
 	// to be done separately to be non-blocking
 	clients[clientID].new = true;
 	clients[clientID].name = NULL;
+	// Not yet stored in the long-term database
+	clients[clientID].dbid = 0;
+	index_add(&clientindex, clientkey, clientID);
 	// Increase counter by one
 	counters.clients++;
+	toplist_add_client(clientID);
 
 	return clientID;
 }
 
+// Like findDomainID() and findClientID() but neither counting nor adding
+int lookupDomainID(const char *domain)
+{
+	return index_find(&domainindex, domainkey, domain);
+}
+
+int lookupClientID(const char *client)
+{
+	return index_find(&clientindex, clientkey, client);
+}
+
 bool isValidIPv4(const char *addr)
 {
 	struct sockaddr_in sa;
@@ -989,6 +989,10 @@ int check_for_local_domain(char *name, time_t now)
       (crecp->flags & (F_HOSTS | F_DHCP | F_CONFIG)))
     return 1;
 
+  /* Pi-hole: domains on block lists are local, too */
+  if (gravity_match(name) >= 0)
+    return 1;
+
   for (naptr = daemon->naptr; naptr; naptr = naptr->next)
      if (hostname_isequal(name, naptr->name))
       return 1;
@@ -1282,6 +1286,8 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
   int nxdomain = 0, auth = 1, trunc = 0, sec_data = 1;
   struct mx_srv_record *rec;
   size_t len;
+  unsigned int blockflags;
+  char *blocksource;
 
   if (ntohs(header->ancount) != 0 ||
       ntohs(header->nscount) != 0 ||
@@ -1652,7 +1658,29 @@ size_t answer_request(struct dns_header *header, char *limit, size_t qlen,
 		}
 
 	    cname_restart:
-	      if ((crecp = cache_find_by_name(NULL, name, now, flag | F_CNAME | (dryrun ? F_NO_RR : 0))))
+	      if ((blockflags = FTL_blocklist_lookup(flag, name, &addr, &blocksource)))
+		{
+		  /* Pi-hole: domain is on a block list, reply like
+		     we would for the equivalent /etc/hosts record */
+		  ans = 1;
+		  sec_data = 0;
+		  if (blockflags & F_NEG)
+		    {
+		      auth = 0;
+		      if (blockflags & F_NXDOMAIN)
+			nxdomain = 1;
+		    }
+		  if (!dryrun)
+		    {
+		      log_query(blockflags, name, (blockflags & F_NEG) ? NULL : &addr, blocksource);
+		      FTL_cache(blockflags, name, (blockflags & F_NEG) ? NULL : &addr, blocksource, daemon->log_display_id);
+		      if (!(blockflags & F_NEG) &&
+			  add_resource_record(header, limit, &trunc, nameoffset, &ansp,
+					      daemon->local_ttl, NULL, type, C_IN, type == T_A ? "4" : "6", &addr))
+			anscount++;
+		    }
+		}
+	      else if ((crecp = cache_find_by_name(NULL, name, now, flag | F_CNAME | (dryrun ? F_NO_RR : 0))))
 		{
 		  int localise = 0;
 
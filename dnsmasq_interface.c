@@ -166,6 +166,7 @@ void FTL_new_query(unsigned int flags, char *name, struct all_addr *addr, char *
 
 	// Increase DNS queries counter
 	counters.queries++;
+	queryindex_add(queryID);
 	// Count this query as unknown as long as no reply has
 	// been found and analyzed
 	counters.unknown++;
@@ -351,12 +352,23 @@ void FTL_dnsmasq_reload(void)
 
 	// Called when dnsmasq re-reads its config and hosts files
 	// Reset number of blocked domains
+	enable_thread_lock();
 	counters.gravity = 0;
+	disable_thread_lock();
+
+	// Release block lists, they are loaded again when dnsmasq
+	// hands the lists to FTL_listsfile() on re-reading
+	gravity_release();
 
 	// Inspect 01-pihole.conf to see if Pi-hole blocking is enabled,
 	// i.e. if /etc/pihole/gravity.list is sourced as addn-hosts file
 	check_blocking_status();
 
+	// Cached API responses may still show the previous lists and status
+	enable_thread_lock();
+	apicache_invalidate();
+	disable_thread_lock();
+
 	// Reread pihole-FTL.conf to see which blocking mode the user wants to use
 	// It is possible to change the blocking mode here as we anyhow clear the
 	// cache and reread all blocking lists
@@ -442,10 +454,10 @@ void FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id)
 			overTime[timeidx].blocked++;
 
 			validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
-			domains[queries[i].domainID].blockedcount++;
+			domain_count_change(queries[i].domainID, 0, 1);
 
 			validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
-			clients[queries[i].clientID].blockedcount++;
+			client_count_change(queries[i].clientID, 0, 1);
 
 			queries[i].status = QUERY_WILDCARD;
 		}
@@ -495,6 +507,10 @@ void FTL_reply(unsigned short flags, char *name, struct all_addr *addr, int id)
 		print_flags(flags);
 	}
 
+	// The query is final once its reply has been analyzed
+	if(queries[i].reply != REPLY_UNKNOWN)
+		stream_publish(i);
+
 	disable_thread_lock();
 }
 
@@ -566,9 +582,9 @@ static void query_externally_blocked(int i)
 	counters.blocked++;
 	overTime[queries[i].timeidx].blocked++;
 	validate_access("domains", queries[i].domainID, true, __LINE__, __FUNCTION__, __FILE__);
-	domains[queries[i].domainID].blockedcount++;
+	domain_count_change(queries[i].domainID, 0, 1);
 	validate_access("clients", queries[i].clientID, true, __LINE__, __FUNCTION__, __FILE__);
-	clients[queries[i].clientID].blockedcount++;
+	client_count_change(queries[i].clientID, 0, 1);
 
 	queries[i].status = QUERY_EXTERNAL_BLOCKED;
 }
@@ -694,8 +710,8 @@ void FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg,
 				case QUERY_WILDCARD: // regex blocked
 					counters.blocked++;
 					overTime[timeidx].blocked++;
-					domains[domainID].blockedcount++;
-					clients[clientID].blockedcount++;
+					domain_count_change(domainID, 0, 1);
+					client_count_change(clientID, 0, 1);
 					break;
 				case QUERY_CACHE: // cached from one of the lists
 					counters.cached++;
@@ -712,6 +728,7 @@ void FTL_cache(unsigned int flags, char *name, struct all_addr *addr, char *arg,
 
 			// Hereby, this query is now fully determined
 			queries[i].complete = true;
+			stream_publish(i);
 		}
 	}
 	else
@@ -849,12 +866,11 @@ void save_reply_type(unsigned int flags, int queryID, struct timeval response)
 	                            queries[queryID].response;
 }
 
-pthread_t telnet_listenthreadv4;
-pthread_t telnet_listenthreadv6;
 pthread_t socket_listenthread;
 pthread_t DBthread;
 pthread_t GCthread;
 pthread_t DNSclientthread;
+pthread_t streamthread;
 
 void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 {
@@ -874,24 +890,10 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 	// Bind to sockets
 	bind_sockets();
 
-	// Start TELNET IPv4 thread
-	if(ipv4telnet && pthread_create( &telnet_listenthreadv4, &attr, telnet_listening_thread_IPv4, NULL ) != 0)
-	{
-		logg("Unable to open IPv4 telnet listening thread. Exiting...");
-		exit(EXIT_FAILURE);
-	}
-
-	// Start TELNET IPv6 thread
-	if(ipv6telnet &&  pthread_create( &telnet_listenthreadv6, &attr, telnet_listening_thread_IPv6, NULL ) != 0)
-	{
-		logg("Unable to open IPv6 telnet listening thread. Exiting...");
-		exit(EXIT_FAILURE);
-	}
-
-	// Start SOCKET thread
+	// Start API thread, it serves the telnet ports and the Unix socket
 	if(pthread_create( &socket_listenthread, &attr, socket_listening_thread, NULL ) != 0)
 	{
-		logg("Unable to open Unix socket listening thread. Exiting...");
+		logg("Unable to open API listening thread. Exiting...");
 		exit(EXIT_FAILURE);
 	}
 
@@ -916,6 +918,13 @@ void FTL_fork_and_bind_sockets(struct passwd *ent_pw)
 		exit(EXIT_FAILURE);
 	}
 
+	// Start thread that sends answered queries to subscribers of the live query stream
+	if(pthread_create( &streamthread, &attr, stream_thread, NULL ) != 0)
+	{
+		logg("Unable to open query stream thread. Exiting...");
+		exit(EXIT_FAILURE);
+	}
+
 	// Chown files if FTL started as user root but a dnsmasq config option
 	// states to run as a different user/group (e.g. "nobody")
 	if(ent_pw != NULL && getuid() == 0)
@@ -941,6 +950,15 @@ void getCacheInformation(int *sock)
 	// New queries are always cached. If the cache is full with entries
 	// which haven't reached the end of their time-to-live, then the entry
 	// which hasn't been looked up for the longest time is evicted.
+
+	// Blocked domains are kept outside of the cache (see gravity.c)
+	unsigned long domains, bytes;
+	double expectedfpr, observedfpr;
+	gravity_bloom_info(&domains, &bytes, &expectedfpr, &observedfpr);
+	ssend(*sock,"blocklist-domains: %lu\nbloom-filter-size: %lu\nbloom-filter-fpr-expected: %.6f\nbloom-filter-fpr-observed: %.6f\n",
+	            domains, bytes, expectedfpr, observedfpr);
+	// The expected false positive rate follows from the bits set in the filter,
+	// the observed one is the share of non-blocked domains that passed the filter
 }
 
 void FTL_forwarding_failed(struct server *server)
@@ -1025,9 +1043,12 @@ static void prepare_blocking_mode(struct all_addr *addr4, struct all_addr *addr6
 	clearSetupVarsArray(); // will free/invalidate IPv6addr
 }
 
+// Addresses used to answer queries for domains on block lists
+static struct all_addr blocking_addr4, blocking_addr6;
+static bool blocking_has_IPv4 = false, blocking_has_IPv6 = false;
+
 // Prototypes from functions in dnsmasq's source
 void add_hosts_entry(struct crec *cache, struct all_addr *addr, int addrlen, unsigned int index, struct crec **rhash, int hashsz);
-void rehash(int size);
 
 // This routine adds one domain to the resolver's cache. Depending on the configured blocking mode it may create
 // a single entry valid for IPv4 & IPv6 (containing only NXDOMAIN) or two entries one for IPv4 and one for IPv6
@@ -1080,12 +1101,47 @@ static void block_single_domain(char *domain)
 	return;
 }
 
+// Check if name is on one of the block lists. If so, return the flags a
+// cache record created by add_blocked_domain_cache() would carry for the requested
+// address family (flag is either F_IPV4 or F_IPV6) and fill in the address to
+// reply with as well as the list the domain was found on. Returns 0 otherwise
+unsigned int FTL_blocklist_lookup(unsigned int flag, char *name, struct all_addr *addr, char **source)
+{
+	int list = gravity_match(name);
+	if(list < 0)
+		return 0;
+
+	if(source != NULL)
+		*source = (list == LIST_GRAVITY) ? files.gravity : files.blacklist;
+
+	unsigned int flags = F_HOSTS | F_IMMORTAL | F_FORWARD;
+	// In NXDOMAIN mode, a single record is valid for both A and AAAA queries
+	if(config.blockingmode == MODE_NX)
+		return blocking_has_IPv4 ? flags | F_IPV4 | F_IPV6 | F_NEG | F_NXDOMAIN : 0;
+
+	if(flag == F_IPV4)
+	{
+		if(!blocking_has_IPv4)
+			return 0;
+		if(addr != NULL)
+			*addr = blocking_addr4;
+		return flags | F_IPV4;
+	}
+	else
+	{
+		if(!blocking_has_IPv6)
+			return 0;
+		if(addr != NULL)
+			*addr = blocking_addr6;
+		flags |= F_IPV6;
+		if(config.blockingmode == MODE_IP_NODATA_AAAA)
+			flags |= F_NEG;
+		return flags;
+	}
+}
+
 int FTL_listsfile(char* filename, unsigned int index, FILE *f, int cache_size, struct crec **rhash, int hashsz)
 {
-	int name_count = cache_size;
-	int added = 0;
-	size_t size = 0;
-	char *buffer = NULL;
 	struct all_addr addr4, addr6;
 	bool has_IPv4 = false, has_IPv6 = false;
 
@@ -1108,60 +1164,55 @@ int FTL_listsfile(char* filename, unsigned int index, FILE *f, int cache_size, s
 		return cache_size;
 	}
 
-	// Walk file line by line
-	bool firstline = true;
-	while(getline(&buffer, &size, f) != -1)
-	{
-		char *domain = buffer;
-		// Skip hashed out lines
-		if(*domain == '#')
-			continue;
-
-		// Filter leading dots or spaces
-		while (*domain == '.' || *domain == ' ') domain++;
-
-		// Check for spaces or tabs
-		// If found, then this list is still in HOSTS format and we
-		// don't analyze it here.
-		if(firstline &&
-		   (strstr(domain, " ") != NULL || strstr(domain, "\t") != NULL))
-		{
-			// Reset file pointer back to beginning of the list
-			rewind(f);
-			logg("File %s is in HOSTS format, please run pihole -g!", filename);
-			return name_count;
-		}
-		firstline = false;
-
-		// Skip empty lines
-		if(strlen(domain) == 0)
-			continue;
+	// Remember addresses for replies to blocked domains
+	blocking_addr4 = addr4;
+	blocking_addr6 = addr6;
+	blocking_has_IPv4 = has_IPv4;
+	blocking_has_IPv6 = has_IPv6;
 
-		// Strip newline character at the end of line we just read
-		if(domain[strlen(domain)-1] == '\n')
-			domain[strlen(domain)-1] = '\0';
-
-		// As of here we assume the entry to be valid
-		// Rehash every 1000 valid names
-		if(rhash && ((name_count - cache_size) > 1000))
-		{
-			rehash(name_count);
-			cache_size = name_count;
-		}
-
-		name_count += add_blocked_domain_cache(&addr4, &addr6, has_IPv4, has_IPv6, domain, rhash, hashsz, index);
-		// Count added domain
-		added++;
+	struct stat st;
+	if(fstat(fileno(f), &st) != 0)
+	{
+		logg("ERROR: Cannot stat %s: %s", filename, strerror(errno));
+		return cache_size;
 	}
 
-	// Free allocated memory
-	if(buffer != NULL)
+	// Blocked domains are not added to the cache. The resolver looks them up
+	// in the block lists directly (see FTL_blocklist_lookup()). Use the compiled
+	// list (see pihole-FTL --compile-gravity) if there is an up-to-date one
+	int list = strcmp(filename, files.gravity) == 0 ? LIST_GRAVITY : LIST_BLACKLIST;
+	blocklistStruct new = { 0 };
+	bool mapped = gravity_load(filename, &st, &new);
+	int result = mapped ? PARSE_OK : gravity_parse_file(f, &st, &new);
+	if(result != PARSE_OK)
 	{
-		free(buffer);
-		buffer = NULL;
+		// Reset file pointer back to beginning of the list
+		rewind(f);
+		if(result == PARSE_HOSTS)
+			logg("File %s is in HOSTS format, please run pihole -g!", filename);
+		else
+			logg("ERROR: Cannot parse %s, reading it as HOSTS file instead", filename);
+		return cache_size;
 	}
 
-	logg("%s: parsed %i domains (took %.1f ms)", filename, added, timer_elapsed_msec(LISTS_TIMER));
-	counters.gravity += added;
-	return name_count;
+	// We consumed the list entirely, make sure dnsmasq's
+	// HOSTS parser does not find anything left to read
+	fseek(f, 0, SEEK_END);
+
+	double size;
+	char prefix[2] = { 0 };
+	format_memory_size(prefix, new.size, &size);
+	logg("%s: %s %u domains (%.1f %sB, took %.1f ms)", filename, mapped ? "mapped" : "parsed",
+	     new.header->count, size, prefix, timer_elapsed_msec(LISTS_TIMER));
+	// Put the new list in place and free the previous version (if any)
+	int newcount = new.header->count;
+	int oldcount = gravity_replace(list, &new, -1);
+	gravity_free(&new);
+
+	enable_thread_lock();
+	counters.gravity += newcount - oldcount;
+	apicache_invalidate();
+	disable_thread_lock();
+
+	return cache_size;
 }
@@ -23,3 +23,5 @@ void FTL_header_ADbit(unsigned char header4, int id);
 
 void FTL_forwarding_failed(struct server *server);
 int FTL_listsfile(char* filename, unsigned int index, FILE *f, int cache_size, struct crec **rhash, int hashsz);
+unsigned int FTL_blocklist_lookup(unsigned int flag, char *name, struct all_addr *addr, char **source);
+int gravity_match(const char *domain);
@@ -17,9 +17,14 @@ void *GC_thread(void *val)
 	// Set thread name
 	prctl(PR_SET_NAME,"housekeeper",0,0,0);
 
+	// Read the audit list and watch it for changes. This has to happen
+	// after dnsmasq closed all inherited file descriptors
+	audit_init();
+
 	// Save timestamp as we do not want to store immediately
 	// to the database
 	lastGCrun = time(NULL) - time(NULL)%GCinterval;
+	time_t lastsnapshot = time(NULL);
 	while(!killed)
 	{
 		if(time(NULL) - GCdelay - lastGCrun >= GCinterval || doGC)
@@ -60,7 +65,7 @@ void *GC_thread(void *val)
 				// Adjust client counter
 				int clientID = queries[i].clientID;
 				validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
-				clients[clientID].count--;
+				client_count_change(clientID, -1, 0);
 
 				// Adjust corresponding overTime counters
 				validate_access_oTcl(timeidx, clientID, __LINE__, __FUNCTION__, __FILE__);
@@ -69,7 +74,7 @@ void *GC_thread(void *val)
 				// Adjust domain counter (no overTime information)
 				int domainID = queries[i].domainID;
 				validate_access("domains", domainID, true, __LINE__, __FUNCTION__, __FILE__);
-				domains[domainID].count--;
+				domain_count_change(domainID, -1, 0);
 
 				// Change other counters according to status of this query
 				switch(queries[i].status)
@@ -82,8 +87,8 @@ void *GC_thread(void *val)
 						// Blocked by Pi-hole's blocking lists
 						counters.blocked--;
 						overTime[timeidx].blocked--;
-						domains[domainID].blockedcount--;
-						clients[clientID].blockedcount--;
+						domain_count_change(domainID, 0, -1);
+						client_count_change(clientID, 0, -1);
 						break;
 					case QUERY_FORWARDED:
 						// Forwarded to an upstream DNS server
@@ -102,8 +107,8 @@ void *GC_thread(void *val)
 					case QUERY_EXTERNAL_BLOCKED: // blocked by upstream provider (fall through)
 						counters.blocked--;
 						overTime[timeidx].blocked--;
-						domains[domainID].blockedcount--;
-						clients[clientID].blockedcount--;
+						domain_count_change(domainID, 0, -1);
+						client_count_change(clientID, 0, -1);
 						break;
 					default:
 						/* That cannot happen */
@@ -150,6 +155,10 @@ void *GC_thread(void *val)
 
 			}
 
+			// Drop the removed queries from the per-domain and per-client lists
+			queryindex_remove(removed);
+			apicache_invalidate();
+
 			// Move memory forward to keep only what we want
 			// Note: for overlapping memory blocks, memmove() is a safer approach than memcpy()
 			// Example: (I = now invalid, X = still valid queries, F = free space)
@@ -160,6 +169,12 @@ void *GC_thread(void *val)
 			// Update queries counter
 			counters.queries -= removed;
 
+			// Queries before lastdbindex have been stored in the database
+			// already, keep it pointing at the first unsaved query
+			lastdbindex -= removed;
+			if(lastdbindex < 0)
+				lastdbindex = 0;
+
 			// Zero out remaining memory (marked as "F" in the above example)
 			memset(&queries[counters.queries], 0, (counters.queries_MAX - counters.queries)*sizeof(*queries));
 
@@ -174,6 +189,25 @@ void *GC_thread(void *val)
 			// ever larger and larger
 			DBdeleteoldqueries = true;
 		}
+
+		// Refresh the snapshot used for a fast restart. After a crash, it
+		// is only used if no queries have been stored in the database since
+		if(config.snapshotinterval > 0 && time(NULL) - lastsnapshot >= config.snapshotinterval)
+		{
+			lastsnapshot = time(NULL);
+			snapshot_refresh();
+		}
+
+		// Apply changes to the block lists if requested (SIGRTMIN)
+		if(rereadgravity)
+		{
+			rereadgravity = 0;
+			gravity_reload();
+		}
+
+		// Apply changes to the audit list
+		audit_check();
+
 		sleepms(100);
 	}
 
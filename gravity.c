@@ -0,0 +1,733 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2018 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Compiled block lists
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// A compiled block list is a single image made of
+//   - a header (gravityHeaderStruct)
+//   - an open-addressing hash index (gravitySlotStruct[buckets])
+//   - a string table holding the sorted, deduplicated and lower-cased
+//     domains, each terminated by a NUL byte
+// The image is stored in host byte order and can be mapped read-only
+// into memory without any further processing
+#define GRAVITY_MAGIC "FTLGRAV"
+#define GRAVITY_VERSION 1
+
+// Block lists currently in use. Lookups happen in the resolver thread while
+// lists may be replaced by the housekeeper thread (see gravity_reload())
+static blocklistStruct blocklist[LIST_MAX];
+static bool listactive[LIST_MAX] = { false };
+// Bumped whenever the lists are released so a reload that started
+// before cannot put an outdated or no longer sourced list back in place
+static unsigned int listgeneration = 0;
+static pthread_rwlock_t blocklistlock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Bloom filter statistics per gravity_match() call on a domain that is on none
+// of the lists. Updated under the read lock only, hence the relaxed atomics
+static unsigned long bloomnegatives = 0, bloomfalsepositives = 0;
+
+// FNV-1a hash of the lower-cased domain, also returns the length of the domain
+static uint32_t gravity_hash(const char *domain, size_t *len)
+{
+	uint32_t hash = 2166136261U;
+	const char *p;
+	for(p = domain; *p; p++)
+	{
+		hash ^= (unsigned char)tolower((unsigned char)*p);
+		hash *= 16777619U;
+	}
+	*len = p - domain;
+	return hash;
+}
+
+static uint32_t gravity_header_checksum(const gravityHeaderStruct *header)
+{
+	// FNV-1a over all header fields preceding the checksum itself
+	uint32_t hash = 2166136261U;
+	const unsigned char *p = (const unsigned char*)header;
+	for(size_t i = 0; i < offsetof(gravityHeaderStruct, checksum); i++)
+	{
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+// Cache-line-blocked Bloom filter: each domain sets BLOOM_HASHES bits within a
+// single 512 bit block, so a lookup touches exactly one cache line
+#define BLOOM_BLOCKBITS 512
+#define BLOOM_BITS_PER_DOMAIN 10
+#define BLOOM_HASHES 6
+
+static uint64_t bloom_mix(uint32_t hash)
+{
+	// Spread the 32 bit hash over 64 bits (splitmix64 finalizer)
+	uint64_t x = hash * 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static void bloom_add(blocklistStruct *list, uint32_t hash)
+{
+	uint64_t *block = list->bloom + (size_t)(hash & (list->bloomblocks - 1)) * (BLOOM_BLOCKBITS/64);
+	uint64_t bits = bloom_mix(hash);
+	for(int i = 0; i < BLOOM_HASHES; i++, bits >>= 9)
+		block[(bits & 511) >> 6] |= 1ULL << (bits & 63);
+}
+
+static bool bloom_check(const blocklistStruct *list, uint32_t hash)
+{
+	const uint64_t *block = list->bloom + (size_t)(hash & (list->bloomblocks - 1)) * (BLOOM_BLOCKBITS/64);
+	uint64_t bits = bloom_mix(hash);
+	for(int i = 0; i < BLOOM_HASHES; i++, bits >>= 9)
+		if(!(block[(bits & 511) >> 6] & (1ULL << (bits & 63))))
+			return false;
+	return true;
+}
+
+// Build the Bloom filter from the hashes stored in the index
+static void bloom_build(blocklistStruct *list)
+{
+	uint32_t count = list->header->count;
+	list->bloomblocks = 1;
+	while((uint64_t)list->bloomblocks * BLOOM_BLOCKBITS < (uint64_t)count * BLOOM_BITS_PER_DOMAIN)
+		list->bloomblocks <<= 1;
+
+	size_t size = (size_t)list->bloomblocks * BLOOM_BLOCKBITS/8;
+	if(posix_memalign((void**)&list->bloom, 64, size) != 0)
+	{
+		// Not fatal, lookups just don't get the fast path
+		logg("WARN: Cannot allocate %zu bytes for Bloom filter", size);
+		list->bloom = NULL;
+		return;
+	}
+	memset(list->bloom, 0, size);
+
+	for(uint32_t slot = 0; slot < list->header->buckets; slot++)
+		if(list->index[slot].offset != 0)
+			bloom_add(list, list->index[slot].hash);
+
+	// Expected false positive rate for a random domain not on the list
+	double fpr = 0.0;
+	for(uint32_t b = 0; b < list->bloomblocks; b++)
+	{
+		int set = 0;
+		for(int i = 0; i < BLOOM_BLOCKBITS/64; i++)
+			set += __builtin_popcountll(list->bloom[b*(BLOOM_BLOCKBITS/64) + i]);
+		double p = (double)set / BLOOM_BLOCKBITS, pk = 1.0;
+		for(int i = 0; i < BLOOM_HASHES; i++)
+			pk *= p;
+		fpr += pk;
+	}
+	list->bloomfpr = fpr / list->bloomblocks;
+}
+
+static int cmpdomain(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Set up the pointers into an image (mapped or allocated)
+static void gravity_attach(blocklistStruct *list, void *image, size_t size, bool mapped)
+{
+	list->image = image;
+	list->size = size;
+	list->mapped = mapped;
+	list->header = image;
+	list->index = (const gravitySlotStruct*)((char*)image + sizeof(gravityHeaderStruct));
+	list->strings = (const char*)(list->index + list->header->buckets);
+}
+
+// Build an image from the (lower-cased, NUL-terminated) domains. The array
+// is sorted and deduplicated in place
+static bool gravity_build(char **domains, size_t n, const struct stat *src, blocklistStruct *list)
+{
+	qsort(domains, n, sizeof(char*), cmpdomain);
+
+	// Remove duplicates and determine size of the string table
+	size_t count = 0, strsize = 0;
+	for(size_t i = 0; i < n; i++)
+	{
+		if(count > 0 && strcmp(domains[i], domains[count-1]) == 0)
+			continue;
+		domains[count++] = domains[i];
+		strsize += strlen(domains[i]) + 1;
+	}
+
+	// Keep the load factor of the index below 75%
+	uint32_t buckets = 64;
+	while(buckets < count + count/3 && buckets < (1U << 31))
+		buckets <<= 1;
+
+	if(count >= buckets || strsize >= UINT32_MAX)
+	{
+		logg("ERROR: Block list too large (%zu domains, %zu bytes)", count, strsize);
+		return false;
+	}
+
+	size_t size = sizeof(gravityHeaderStruct) + buckets*sizeof(gravitySlotStruct) + strsize;
+	char *image = calloc(size, 1);
+	if(image == NULL)
+	{
+		logg("ERROR: Cannot allocate %zu bytes for block list", size);
+		return false;
+	}
+
+	gravityHeaderStruct *header = (gravityHeaderStruct*)image;
+	memcpy(header->magic, GRAVITY_MAGIC, sizeof(header->magic));
+	header->version = GRAVITY_VERSION;
+	header->count = count;
+	header->buckets = buckets;
+	header->strsize = strsize;
+	header->srcmtime = src->st_mtime;
+	header->srcsize = src->st_size;
+	header->checksum = gravity_header_checksum(header);
+
+	gravitySlotStruct *index = (gravitySlotStruct*)(image + sizeof(gravityHeaderStruct));
+	char *strings = (char*)(index + buckets);
+	uint32_t offset = 0;
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t len;
+		uint32_t hash = gravity_hash(domains[i], &len);
+		memcpy(strings + offset, domains[i], len + 1);
+
+		uint32_t slot = hash & (buckets - 1);
+		while(index[slot].offset != 0)
+			slot = (slot + 1) & (buckets - 1);
+		index[slot].hash = hash;
+		// Offsets are stored one-based, zero marks an empty slot
+		index[slot].offset = offset + 1;
+
+		offset += len + 1;
+	}
+
+	gravity_attach(list, image, size, false);
+	bloom_build(list);
+	return true;
+}
+
+// Parse a list in the format written by "pihole -g" (one domain per line)
+// and build a block list image from it. Returns PARSE_HOSTS if the list is
+// still in HOSTS format and PARSE_FAILED on errors (which are logged)
+static int gravity_parse(const char *start, const char *end, const struct stat *src, blocklistStruct *list)
+{
+	// Skip leading white space the same way dnsmasq does
+	while(start < end && isspace((unsigned char)*start)) start++;
+
+	// Copy all domains into one scratch buffer, lower-casing and
+	// terminating them on the fly, and collect pointers for sorting
+	size_t n = 0, max = 1024;
+	char *scratch = calloc(end - start + 1, 1);
+	char **domains = calloc(max, sizeof(char*));
+	if(scratch == NULL || domains == NULL)
+	{
+		logg("ERROR: Cannot allocate memory for parsing block list");
+		if(scratch != NULL) free(scratch);
+		if(domains != NULL) free(domains);
+		return PARSE_FAILED;
+	}
+
+	bool firstline = true;
+	char *out = scratch;
+	const char *line = start;
+	while(line < end)
+	{
+		const char *eol = memchr(line, '\n', end - line);
+		if(eol == NULL)
+			eol = end;
+		const char *domain = line;
+		line = eol + 1;
+
+		// Skip hashed out lines
+		if(*domain == '#')
+			continue;
+
+		// Filter leading dots or spaces and trailing carriage returns
+		while(domain < eol && (*domain == '.' || *domain == ' ')) domain++;
+		while(eol > domain && eol[-1] == '\r') eol--;
+		size_t len = eol - domain;
+
+		// Check for spaces or tabs in the first line, the
+		// list is still in HOSTS format if we find any
+		if(firstline &&
+		   (memchr(domain, ' ', len) != NULL || memchr(domain, '\t', len) != NULL))
+		{
+			free(scratch);
+			free(domains);
+			return PARSE_HOSTS;
+		}
+		firstline = false;
+
+		// Skip empty lines
+		if(len == 0)
+			continue;
+
+		if(n == max)
+		{
+			max *= 2;
+			char **new = realloc(domains, max*sizeof(char*));
+			if(new == NULL)
+			{
+				logg("ERROR: Cannot allocate memory for parsing block list");
+				free(scratch);
+				free(domains);
+				return PARSE_FAILED;
+			}
+			domains = new;
+		}
+		domains[n++] = out;
+		for(size_t i = 0; i < len; i++)
+			*out++ = tolower((unsigned char)domain[i]);
+		*out++ = '\0';
+	}
+
+	bool success = gravity_build(domains, n, src, list);
+
+	free(scratch);
+	free(domains);
+	return success ? PARSE_OK : PARSE_FAILED;
+}
+
+// Map the (text) list opened as fp and parse it, see gravity_parse()
+int gravity_parse_file(FILE *fp, const struct stat *st, blocklistStruct *list)
+{
+	// Empty lists result in an empty image (mmap() refuses zero-length mappings)
+	if(st->st_size == 0)
+		return gravity_parse(NULL, NULL, st, list);
+
+	char *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if(map == MAP_FAILED)
+	{
+		logg("ERROR: Cannot map list into memory: %s", strerror(errno));
+		return PARSE_FAILED;
+	}
+
+	// We read the list strictly sequentially
+	madvise(map, st->st_size, MADV_SEQUENTIAL);
+	int result = gravity_parse(map, map + st->st_size, st, list);
+	munmap(map, st->st_size);
+
+	return result;
+}
+
+// Check if domain (with given length and hash) is in the index of the given list
+static bool gravity_lookup(blocklistStruct *list, const char *domain, size_t len, uint32_t hash)
+{
+	uint32_t buckets = list->header->buckets, strsize = list->header->strsize;
+	uint32_t slot = hash & (buckets - 1);
+
+	for(uint32_t probes = 0; probes < buckets; probes++, slot = (slot + 1) & (buckets - 1))
+	{
+		const gravitySlotStruct *entry = &list->index[slot];
+		if(entry->offset == 0)
+			break;
+		if(entry->hash != hash || entry->offset > strsize)
+			continue;
+
+		// The string table is known to end in a NUL byte so this
+		// comparison cannot run past the end of the image
+		const char *s = list->strings + entry->offset - 1;
+		size_t i;
+		for(i = 0; i < len && (unsigned char)s[i] == tolower((unsigned char)domain[i]); i++);
+		if(i == len && s[i] == '\0')
+			return true;
+	}
+
+	return false;
+}
+
+void gravity_free(blocklistStruct *list)
+{
+	if(list->image == NULL)
+		return;
+
+	if(list->mapped)
+		munmap(list->image, list->size);
+	else
+		free(list->image);
+
+	if(list->bloom != NULL)
+		free(list->bloom);
+
+	memset(list, 0, sizeof(blocklistStruct));
+}
+
+static char *gravity_binfile(const char *listfile)
+{
+	char *binfile = NULL;
+	if(asprintf(&binfile, "%s.bin", listfile) < 0)
+		return NULL;
+	return binfile;
+}
+
+// Map the compiled version of listfile into memory. This fails if there is no
+// compiled list, if it is damaged, or if it does not match the current source
+// list (given by src) anymore
+bool gravity_load(const char *listfile, const struct stat *src, blocklistStruct *list)
+{
+	char *binfile = gravity_binfile(listfile);
+	if(binfile == NULL)
+		return false;
+
+	FILE *fp = fopen(binfile, "r");
+	if(fp == NULL)
+	{
+		// No compiled list, this is not an error
+		free(binfile);
+		return false;
+	}
+
+	struct stat st;
+	void *image = MAP_FAILED;
+	errno = EINVAL;
+	if(fstat(fileno(fp), &st) == 0 && (size_t)st.st_size >= sizeof(gravityHeaderStruct))
+		image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+	fclose(fp);
+
+	if(image == MAP_FAILED)
+	{
+		logg("WARN: Cannot map %s: %s", binfile, strerror(errno));
+		free(binfile);
+		return false;
+	}
+
+	const gravityHeaderStruct *header = image;
+	const char *reason = NULL;
+	if(memcmp(header->magic, GRAVITY_MAGIC, sizeof(header->magic)) != 0 ||
+	   header->version != GRAVITY_VERSION)
+		reason = "unknown format";
+	else if(header->checksum != gravity_header_checksum(header))
+		reason = "header checksum mismatch";
+	else if(header->buckets == 0 || (header->buckets & (header->buckets - 1)) != 0 ||
+	        header->count >= header->buckets ||
+	        (size_t)st.st_size != sizeof(gravityHeaderStruct) + (size_t)header->buckets*sizeof(gravitySlotStruct) + header->strsize)
+		reason = "size mismatch";
+	else if(header->srcmtime != (int64_t)src->st_mtime || header->srcsize != (int64_t)src->st_size)
+		reason = "outdated";
+
+	if(reason == NULL)
+	{
+		gravity_attach(list, image, st.st_size, true);
+		if(header->strsize > 0 && list->strings[header->strsize - 1] != '\0')
+			reason = "string table not terminated";
+	}
+
+	if(reason != NULL)
+	{
+		logg("INFO: Not using %s (%s)", binfile, reason);
+		munmap(image, st.st_size);
+		memset(list, 0, sizeof(blocklistStruct));
+		free(binfile);
+		return false;
+	}
+
+	// Lookups will hit random pages of the index
+	madvise(image, st.st_size, MADV_RANDOM);
+	bloom_build(list);
+
+	free(binfile);
+	return true;
+}
+
+// Write a block list image atomically to listfile.bin
+static bool gravity_write(const blocklistStruct *list, const char *listfile)
+{
+	char *binfile = gravity_binfile(listfile), *tmpfile = NULL;
+	if(binfile == NULL || asprintf(&tmpfile, "%s.tmp", binfile) < 0)
+	{
+		if(binfile != NULL) free(binfile);
+		return false;
+	}
+
+	// Write to a temporary file first and move it into place afterwards. A running
+	// FTL instance that has the previous version mapped keeps using the old inode
+	bool success = false;
+	FILE *fp = fopen(tmpfile, "w");
+	if(fp == NULL)
+	{
+		printf("Cannot create %s: %s\n", tmpfile, strerror(errno));
+	}
+	else
+	{
+		bool written = fwrite(list->image, list->size, 1, fp) == 1;
+		if(fclose(fp) == 0 && written && rename(tmpfile, binfile) == 0)
+			success = true;
+		else
+		{
+			printf("Cannot write %s: %s\n", binfile, strerror(errno));
+			unlink(tmpfile);
+		}
+	}
+
+	free(binfile);
+	free(tmpfile);
+	return success;
+}
+
+// Compile listfile into listfile.bin (used by "pihole-FTL --compile-gravity")
+bool gravity_compile(const char *listfile)
+{
+	blocklistStruct list = { 0 };
+	struct stat st;
+
+	timer_start(LISTS_TIMER);
+
+	FILE *fp = fopen(listfile, "r");
+	if(fp == NULL || fstat(fileno(fp), &st) != 0)
+	{
+		printf("Cannot open %s: %s\n", listfile, strerror(errno));
+		if(fp != NULL) fclose(fp);
+		return false;
+	}
+
+	int result = gravity_parse_file(fp, &st, &list);
+	fclose(fp);
+
+	if(result == PARSE_HOSTS)
+	{
+		printf("Cannot compile %s (still in HOSTS format, please run pihole -g)\n", listfile);
+		return false;
+	}
+	else if(result != PARSE_OK)
+	{
+		printf("Cannot compile %s (see %s for details)\n", listfile, FTLfiles.log);
+		return false;
+	}
+
+	bool success = gravity_write(&list, listfile);
+	if(success)
+		printf("Compiled %s: %u domains (%zu bytes) in %.1f ms\n", listfile,
+		       list.header->count, list.size, timer_elapsed_msec(LISTS_TIMER));
+
+	gravity_free(&list);
+	return success;
+}
+
+// Check if domain is on any of the lists in use, returns the list it was found on or -1
+int gravity_match(const char *domain)
+{
+	int found = -1;
+	bool filtered = false, falsepositive = false;
+	size_t len;
+	uint32_t hash = gravity_hash(domain, &len);
+
+	pthread_rwlock_rdlock(&blocklistlock);
+	for(int list = 0; list < LIST_MAX && found < 0; list++)
+	{
+		blocklistStruct *bl = &blocklist[list];
+		if(bl->image == NULL)
+			continue;
+
+		// Most domains are not blocked, the Bloom filter rejects
+		// them without touching the index or the string table
+		if(bl->bloom != NULL)
+		{
+			filtered = true;
+			if(!bloom_check(bl, hash))
+				continue;
+		}
+
+		if(gravity_lookup(bl, domain, len, hash))
+			found = list;
+		else if(bl->bloom != NULL)
+			falsepositive = true;
+	}
+
+	if(found < 0 && filtered)
+	{
+		__atomic_fetch_add(&bloomnegatives, 1, __ATOMIC_RELAXED);
+		if(falsepositive)
+			__atomic_fetch_add(&bloomfalsepositives, 1, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&blocklistlock);
+	return found;
+}
+
+// Report number of domains and Bloom filter statistics over all lists in use. Both
+// false positive rates refer to a gravity_match() call on a domain on none of the lists
+void gravity_bloom_info(unsigned long *domains, unsigned long *bytes, double *expectedfpr, double *observedfpr)
+{
+	unsigned long negatives, falsepositives;
+	double fpr = 0.0;
+
+	*domains = *bytes = 0;
+	pthread_rwlock_rdlock(&blocklistlock);
+	for(int list = 0; list < LIST_MAX; list++)
+	{
+		if(blocklist[list].image == NULL)
+			continue;
+		*domains += blocklist[list].header->count;
+		if(blocklist[list].bloom == NULL)
+			continue;
+		*bytes += (unsigned long)blocklist[list].bloomblocks * BLOOM_BLOCKBITS/8;
+		// A domain that is on none of the lists is a false positive
+		// as soon as it passes at least one of the filters
+		fpr = 1.0 - (1.0 - fpr) * (1.0 - blocklist[list].bloomfpr);
+	}
+	negatives = __atomic_load_n(&bloomnegatives, __ATOMIC_RELAXED);
+	falsepositives = __atomic_load_n(&bloomfalsepositives, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&blocklistlock);
+
+	*expectedfpr = fpr;
+	*observedfpr = (negatives > 0) ? (double)falsepositives / negatives : 0.0;
+}
+
+// Put new in place of the list currently in use. On return, new holds
+// the previous version which the caller has to free. A non-negative
+// generation makes the swap conditional on the lists neither having been
+// released nor deactivated since. Returns the number of domains on the
+// replaced list or -1 if nothing was swapped
+int gravity_replace(int list, blocklistStruct *new, int generation)
+{
+	pthread_rwlock_wrlock(&blocklistlock);
+	if(generation >= 0 && ((unsigned int)generation != listgeneration || !listactive[list]))
+	{
+		pthread_rwlock_unlock(&blocklistlock);
+		return -1;
+	}
+	blocklistStruct old = blocklist[list];
+	blocklist[list] = *new;
+	listactive[list] = true;
+	// The expected rate changes with the lists, start counting afresh
+	__atomic_store_n(&bloomnegatives, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&bloomfalsepositives, 0, __ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&blocklistlock);
+	*new = old;
+	return (old.image != NULL) ? (int)old.header->count : 0;
+}
+
+// Release all lists, e.g. before dnsmasq re-reads its hosts files
+void gravity_release(void)
+{
+	for(int list = 0; list < LIST_MAX; list++)
+	{
+		pthread_rwlock_wrlock(&blocklistlock);
+		blocklistStruct old = blocklist[list];
+		memset(&blocklist[list], 0, sizeof(blocklistStruct));
+		listactive[list] = false;
+		listgeneration = (listgeneration + 1) & INT_MAX;
+		pthread_rwlock_unlock(&blocklistlock);
+		gravity_free(&old);
+	}
+}
+
+// Count domains that differ between two lists by walking both sorted string tables at once
+static void gravity_diff(const blocklistStruct *old, const blocklistStruct *new, unsigned int *added, unsigned int *removed)
+{
+	const char *a = old->strings, *aend = a + (old->image != NULL ? old->header->strsize : 0);
+	const char *b = new->strings, *bend = b + (new->image != NULL ? new->header->strsize : 0);
+
+	*added = *removed = 0;
+	while(a < aend || b < bend)
+	{
+		int cmp = (a >= aend) ? 1 : (b >= bend) ? -1 : strcmp(a, b);
+		if(cmp < 0)
+		{
+			if(debug) logg("   - %s", a);
+			(*removed)++;
+		}
+		else if(cmp > 0)
+		{
+			if(debug) logg("   + %s", b);
+			(*added)++;
+		}
+
+		if(cmp <= 0)
+			a += strlen(a) + 1;
+		if(cmp >= 0)
+			b += strlen(b) + 1;
+	}
+}
+
+// Re-read lists in use that changed on disk. The new versions are swapped in
+// while the resolver keeps answering queries, its cache is not touched
+void gravity_reload(void)
+{
+	const char *listfiles[LIST_MAX] = { files.gravity, files.blacklist };
+
+	for(int list = 0; list < LIST_MAX; list++)
+	{
+		// Only lists that dnsmasq has handed to us before are of interest.
+		// Other lists are not sourced (e.g. blocking is disabled)
+		pthread_rwlock_rdlock(&blocklistlock);
+		bool active = listactive[list];
+		int generation = (int)listgeneration;
+		int64_t mtime = -1, size = -1;
+		if(blocklist[list].image != NULL)
+		{
+			mtime = blocklist[list].header->srcmtime;
+			size = blocklist[list].header->srcsize;
+		}
+		pthread_rwlock_unlock(&blocklistlock);
+
+		if(!active)
+			continue;
+
+		struct stat st;
+		FILE *fp = fopen(listfiles[list], "r");
+		if(fp == NULL || fstat(fileno(fp), &st) != 0)
+		{
+			logg("WARN: Cannot reload %s: %s", listfiles[list], strerror(errno));
+			if(fp != NULL) fclose(fp);
+			continue;
+		}
+
+		// Skip lists that did not change
+		if((int64_t)st.st_mtime == mtime && (int64_t)st.st_size == size)
+		{
+			fclose(fp);
+			continue;
+		}
+
+		timer_start(RELOAD_TIMER);
+
+		blocklistStruct new = { 0 };
+		int result = gravity_load(listfiles[list], &st, &new) ? PARSE_OK :
+		             gravity_parse_file(fp, &st, &new);
+		fclose(fp);
+
+		if(result != PARSE_OK)
+		{
+			logg("WARN: Cannot reload %s%s, keeping previous version", listfiles[list],
+			     result == PARSE_HOSTS ? " (in HOSTS format, please run pihole -g)" : "");
+			continue;
+		}
+
+		// Determine changes. The read lock keeps the current list from being
+		// released underneath us without blocking lookups in the meantime
+		unsigned int added, removed;
+		pthread_rwlock_rdlock(&blocklistlock);
+		gravity_diff(&blocklist[list], &new, &added, &removed);
+		pthread_rwlock_unlock(&blocklistlock);
+
+		// The lists may have been released by a SIGHUP in the meantime, dnsmasq
+		// then hands them to FTL_listsfile() again (if they are still sourced)
+		int newcount = new.header->count;
+		int oldcount = gravity_replace(list, &new, generation);
+		gravity_free(&new);
+		if(oldcount < 0)
+		{
+			logg("%s: lists were reloaded in the meantime, discarding update", listfiles[list]);
+			continue;
+		}
+
+		enable_thread_lock();
+		counters.gravity += newcount - oldcount;
+		apicache_invalidate();
+		disable_thread_lock();
+
+		logg("%s: reloaded %i domains, %u added, %u removed (took %.1f ms)",
+		     listfiles[list], newcount, added, removed, timer_elapsed_msec(RELOAD_TIMER));
+	}
+}
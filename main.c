@@ -56,10 +56,18 @@ int main (int argc, char* argv[])
 	if(config.maxDBdays != 0)
 		db_init();
 
-	// Try to import queries from long-term database if available
-	if(database && config.DBimport)
+	// Resume from the snapshot written by the previous run if possible,
+	// import queries from the long-term database otherwise
+	if(config.DBimport && !snapshot_load() && database)
 		read_data_from_DB();
 
+	// Order the top lists once, they are kept in order from now on
+	toplist_init();
+	queryindex_init();
+
+	// The database connection is reopened on first use after forking
+	db_close();
+
 	log_counter_info();
 	check_setupVarsconf();
 
@@ -69,17 +77,22 @@ int main (int argc, char* argv[])
 	logg("Shutting down...");
 
 	// Cancel active threads as we don't need them any more
-	if(ipv4telnet) pthread_cancel(telnet_listenthreadv4);
-	if(ipv6telnet) pthread_cancel(telnet_listenthreadv6);
 	pthread_cancel(socket_listenthread);
 
 	// Save new queries to database
 	if(database)
 	{
-		save_to_DB();
+		while(save_to_DB());
 		logg("Finished final database update");
 	}
 
+	// Save the in-memory data for the next start
+	if(snapshot_save())
+		logg("Finished writing snapshot");
+
+	// Close the long-lived database connection
+	db_close();
+
 	// Close sockets
 	close_telnet_socket();
 	close_unix_socket();
@@ -19,6 +19,7 @@ FTLFileNamesStruct FTLfiles = {
 	NULL,
 	NULL,
 	NULL,
+	NULL,
 	NULL
 };
 
@@ -124,6 +125,36 @@ void memory_check(int which)
 	}
 }
 
+// Make room for (at least) count entries at once, e.g. before
+// importing many queries from the long-term database
+void memory_reserve(int which, int count)
+{
+	switch(which)
+	{
+		case QUERIES:
+			if(count > counters.queries_MAX)
+			{
+				// Round up to the next allocation step
+				int step = count - counters.queries_MAX;
+				step += QUERIESALLOCSTEP - step % QUERIESALLOCSTEP;
+				counters.queries_MAX += step;
+				logg_struct_resize("queries",counters.queries_MAX,step);
+				queries = realloc(queries, counters.queries_MAX*sizeof(queriesDataStruct));
+				if(queries == NULL)
+				{
+					logg("FATAL: Memory allocation failed! Exiting");
+					exit(EXIT_FAILURE);
+				}
+			}
+		break;
+		default:
+			/* That cannot happen */
+			logg("Fatal error in memory_reserve(%i)", which);
+			exit(EXIT_FAILURE);
+		break;
+	}
+}
+
 void validate_access(const char * name, int pos, bool testmagic, int line, const char * function, const char * file)
 {
 	int limit = 0;
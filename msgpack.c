@@ -18,8 +18,11 @@ void pack_eom(int sock) {
 }
 
 void pack_basic(int sock, uint8_t format, void *value, size_t size) {
-	swrite(sock, &format, sizeof(format));
-	swrite(sock, value, size);
+	// Format byte and payload are appended to the output buffer at once
+	uint8_t packed[9];
+	packed[0] = format;
+	memcpy(packed + 1, value, size);
+	swrite(sock, packed, size + 1);
 }
 
 uint64_t leToBe64(uint64_t value) {
@@ -84,9 +87,10 @@ bool pack_fixstr(int sock, char *string) {
 		return false;
 	}
 
-	uint8_t format = (uint8_t) (0xA0 | length);
-	swrite(sock, &format, sizeof(format));
-	swrite(sock, string, length);
+	uint8_t packed[32];
+	packed[0] = (uint8_t) (0xA0 | length);
+	memcpy(packed + 1, string, length);
+	swrite(sock, packed, length + 1);
 
 	return true;
 }
@@ -101,18 +105,20 @@ bool pack_str32(int sock, char *string) {
 		return false;
 	}
 
-	uint8_t format = 0xdb;
-	swrite(sock, &format, sizeof(format));
+	uint8_t header[5];
+	header[0] = 0xdb;
 	uint32_t bigELength = htonl((uint32_t) length);
-	swrite(sock, &bigELength, sizeof(bigELength));
+	memcpy(header + 1, &bigELength, sizeof(bigELength));
+	swrite(sock, header, sizeof(header));
 	swrite(sock, string, length);
 
 	return true;
 }
 
 void pack_map16_start(int sock, uint16_t length) {
-	uint8_t format = 0xde;
-	swrite(sock, &format, sizeof(format));
+	uint8_t header[3];
+	header[0] = 0xde;
 	uint16_t bigELength = htons(length);
-	swrite(sock, &bigELength, sizeof(bigELength));
+	memcpy(header + 1, &bigELength, sizeof(bigELength));
+	swrite(sock, header, sizeof(header));
 }
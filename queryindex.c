@@ -0,0 +1,204 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2018 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Per-domain and per-client lists of queries
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+
+// Every domain and client has a list of the queries it was involved in, in
+// the order they are stored in queries[]. The list stores a running number
+// instead of the index into queries[] so that it stays valid when the GC
+// moves the remaining queries to the front: index = number - removedqueries.
+// Old queries are dropped from the head of the list, the list is compacted
+// when it is about to grow
+typedef struct {
+	int *numbers;
+	int head;
+	int size;
+	int capacity;
+} postinglistStruct;
+
+typedef struct {
+	postinglistStruct *lists;
+	int count;
+} postinglistsStruct;
+
+static postinglistsStruct domainlists = { NULL, 0 }, clientlists = { NULL, 0 };
+// Number of queries removed by the GC since the lists were last renumbered
+static int removedqueries = 0;
+// Number of queries removed by the GC since FTL started
+static long long totalremoved = 0;
+// The lists are built once all history has been imported, see queryindex_init()
+static bool queryindexready = false;
+
+static postinglistsStruct *queryindex_lists(int which)
+{
+	return which == DOMAINS ? &domainlists : &clientlists;
+}
+
+static void queryindex_append(postinglistsStruct *lists, int ID, int number)
+{
+	if(ID >= lists->count)
+	{
+		int count = lists->count > 0 ? 2*lists->count : 1024;
+		while(count <= ID)
+			count *= 2;
+		postinglistStruct *new = realloc(lists->lists, count*sizeof(postinglistStruct));
+		if(new == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
+		memset(new + lists->count, 0, (count - lists->count)*sizeof(postinglistStruct));
+		lists->lists = new;
+		lists->count = count;
+	}
+
+	postinglistStruct *list = &lists->lists[ID];
+	if(list->head + list->size == list->capacity)
+	{
+		if(list->head > 0)
+		{
+			// Reuse the space of removed queries first
+			memmove(list->numbers, list->numbers + list->head, list->size*sizeof(int));
+			list->head = 0;
+		}
+		if(list->size == list->capacity)
+		{
+			int capacity = list->capacity > 0 ? 2*list->capacity : 16;
+			int *numbers = realloc(list->numbers, capacity*sizeof(int));
+			if(numbers == NULL)
+			{
+				logg("FATAL: Memory allocation failed! Exiting");
+				exit(EXIT_FAILURE);
+			}
+			list->numbers = numbers;
+			list->capacity = capacity;
+		}
+	}
+	list->numbers[list->head + list->size++] = number;
+}
+
+// Build the lists from the queries in memory. Called once after the history
+// has been imported, from then on queries are added as they come in
+void queryindex_init(void)
+{
+	queryindexready = true;
+	for(int i = 0; i < counters.queries; i++)
+		queryindex_add(i);
+}
+
+// Add a new query (which has to be the last one in queries[])
+void queryindex_add(int queryID)
+{
+	if(!queryindexready)
+		return;
+
+	int number = queryID + removedqueries;
+	queryindex_append(&domainlists, queries[queryID].domainID, number);
+	queryindex_append(&clientlists, queries[queryID].clientID, number);
+}
+
+// Drop the first removed queries from the lists. Has to be called by the GC
+// before the remaining queries are moved to the front
+void queryindex_remove(int removed)
+{
+	if(!queryindexready)
+		return;
+
+	for(int i = 0; i < removed; i++)
+	{
+		postinglistStruct *list = &domainlists.lists[queries[i].domainID];
+		list->head++;
+		list->size--;
+		list = &clientlists.lists[queries[i].clientID];
+		list->head++;
+		list->size--;
+	}
+	removedqueries += removed;
+	totalremoved += removed;
+
+	// Renumber before the running numbers can overflow
+	if(removedqueries > QUERYINDEXRENUMBER)
+	{
+		for(int which = 0; which < 2; which++)
+		{
+			postinglistsStruct *lists = which == 0 ? &domainlists : &clientlists;
+			for(int ID = 0; ID < lists->count; ID++)
+			{
+				postinglistStruct *list = &lists->lists[ID];
+				for(int i = list->head; i < list->head + list->size; i++)
+					list->numbers[i] -= removedqueries;
+			}
+		}
+		removedqueries = 0;
+	}
+}
+
+// Position in the list of a domain or client of its first query at or after
+// the given query ID
+int queryindex_seek(int which, int ID, int queryID)
+{
+	const postinglistsStruct *lists = queryindex_lists(which);
+	if(ID >= lists->count)
+		return 0;
+
+	const postinglistStruct *list = &lists->lists[ID];
+	int number = queryID + removedqueries;
+	int lo = 0, hi = list->size;
+	while(lo < hi)
+	{
+		int mid = lo + (hi - lo)/2;
+		if(list->numbers[list->head + mid] < number)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Query ID at the given position in the list of a domain or client
+int queryindex_at(int which, int ID, int pos)
+{
+	const postinglistStruct *list = &queryindex_lists(which)->lists[ID];
+	return list->numbers[list->head + pos] - removedqueries;
+}
+
+// Sequence number of a query. Unlike its ID, it does not change when the GC
+// removes older queries
+long long queryindex_sequence(int queryID)
+{
+	return queryID + totalremoved;
+}
+
+// ID of the query with the given sequence number, -1 if it has been removed
+// already and counters.queries if it is not known yet
+int queryindex_query(long long sequence)
+{
+	if(sequence < totalremoved)
+		return -1;
+	if(sequence - totalremoved > counters.queries)
+		return counters.queries;
+	return sequence - totalremoved;
+}
+
+// ID of the first query with a timestamp at or after the given one,
+// queries[] is ordered by time
+int queryindex_time(int timestamp)
+{
+	int lo = 0, hi = counters.queries;
+	while(lo < hi)
+	{
+		int mid = lo + (hi - lo)/2;
+		if(queries[mid].timestamp < timestamp)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
@@ -11,139 +11,168 @@
 #include "FTL.h"
 #include "api.h"
 
-bool command(char *client_message, const char* cmd) {
-	return strstr(client_message, cmd) != NULL;
+static void reresolve(int *sock)
+{
+	logg("Received API request to re-resolve host names");
+	// Need to release the thread lock already here to allow
+	// the resolver to process the incoming PTR requests
+	disable_thread_lock();
+	// onlynew=false -> reresolve all host names
+	resolveClients(false);
+	resolveForwardDestinations(false);
+	logg("Done re-resolving host names");
 }
 
-void process_request(char *client_message, int *sock)
+static void recompile_regex(int *sock)
 {
-	char EOT[2];
-	EOT[0] = 0x04;
-	EOT[1] = 0x00;
-	bool processed = false;
+	logg("Received API request to recompile regex");
+	free_regex();
+	read_regex_from_file();
+	apicache_invalidate();
+}
 
-	if(command(client_message, ">stats"))
-	{
-		processed = true;
-		getStats(sock);
-	}
-	else if(command(client_message, ">overTime"))
-	{
-		processed = true;
-		getOverTime(sock);
-	}
-	else if(command(client_message, ">top-domains") || command(client_message, ">top-ads"))
-	{
-		processed = true;
-		getTopDomains(client_message, sock);
-	}
-	else if(command(client_message, ">top-clients"))
-	{
-		processed = true;
-		getTopClients(client_message, sock);
-	}
-	else if(command(client_message, ">forward-dest"))
-	{
-		processed = true;
-		getForwardDestinations(client_message, sock);
-	}
-	else if(command(client_message, ">forward-names"))
-	{
-		processed = true;
-		getForwardDestinations(">forward-dest unsorted", sock);
-	}
-	else if(command(client_message, ">querytypes"))
-	{
-		processed = true;
-		getQueryTypes(sock);
-	}
-	else if(command(client_message, ">getallqueries"))
-	{
-		processed = true;
-		getAllQueries(client_message, sock);
-	}
-	else if(command(client_message, ">recentBlocked"))
-	{
-		processed = true;
-		getRecentBlocked(client_message, sock);
-	}
-	else if(command(client_message, ">clientID"))
-	{
-		processed = true;
-		getClientID(sock);
-	}
-	else if(command(client_message, ">QueryTypesoverTime"))
-	{
-		processed = true;
-		getQueryTypesOverTime(sock);
-	}
-	else if(command(client_message, ">version"))
-	{
-		processed = true;
-		getVersion(sock);
-	}
-	else if(command(client_message, ">dbstats"))
-	{
-		processed = true;
-		getDBstats(sock);
-	}
-	else if(command(client_message, ">ClientsoverTime"))
-	{
-		processed = true;
-		getClientsOverTime(sock);
-	}
-	else if(command(client_message, ">client-names"))
-	{
-		processed = true;
-		getClientNames(sock);
-	}
-	else if(command(client_message, ">unknown"))
-	{
-		processed = true;
-		getUnknownQueries(sock);
-	}
-	else if(command(client_message, ">domain"))
-	{
-		processed = true;
-		getDomainDetails(client_message, sock);
-	}
-	else if(command(client_message, ">cacheinfo"))
-	{
-		processed = true;
-		getCacheInformation(sock);
+// Commands and their handlers, sorted by name for bsearch(). Handlers of
+// commands without arguments only get the socket. Responses of cacheable
+// commands may be answered from the response cache for APICACHETTL
+typedef struct {
+	const char *name;
+	void (*handler)(apirequestStruct *request, int *sock);
+	void (*simple)(int *sock);
+	bool cacheable;
+} apicommandStruct;
+
+static const apicommandStruct commands[] = {
+	{ ">ClientsoverTime",       NULL,                   getClientsOverTime,    true },
+	{ ">QueryTypesoverTime",    NULL,                   getQueryTypesOverTime, true },
+	{ ">cacheinfo",             NULL,                   getCacheInformation,   true },
+	{ ">client-names",          NULL,                   getClientNames,        false },
+	{ ">clientID",              NULL,                   getClientID,           false },
+	{ ">dbqueries",             getDBQueries,           NULL,                  false },
+	{ ">dbstats",               NULL,                   getDBstats,            false },
+	{ ">domain",                getDomainDetails,       NULL,                  false },
+	{ ">forward-dest",          getForwardDestinations, NULL,                  true },
+	{ ">forward-names",         getForwardDestinations, NULL,                  true },
+	{ ">getallqueries",         getAllQueries,          NULL,                  false },
+	{ ">getallqueries-client",  getAllQueries,          NULL,                  false },
+	{ ">getallqueries-domain",  getAllQueries,          NULL,                  false },
+	{ ">getallqueries-forward", getAllQueries,          NULL,                  false },
+	{ ">getallqueries-qtype",   getAllQueries,          NULL,                  false },
+	{ ">getallqueries-time",    getAllQueries,          NULL,                  false },
+	{ ">history-forward-dest",  getHistory,             NULL,                  false },
+	{ ">history-overTime",      getHistory,             NULL,                  false },
+	{ ">history-querytypes",    getHistory,             NULL,                  false },
+	{ ">history-summary",       getHistory,             NULL,                  false },
+	{ ">history-top-ads",       getHistory,             NULL,                  false },
+	{ ">history-top-clients",   getHistory,             NULL,                  false },
+	{ ">history-top-domains",   getHistory,             NULL,                  false },
+	{ ">overTime",              NULL,                   getOverTime,           true },
+	{ ">querytypes",            NULL,                   getQueryTypes,         true },
+	{ ">recentBlocked",         getRecentBlocked,       NULL,                  true },
+	{ ">recompile-regex",       NULL,                   recompile_regex,       false },
+	{ ">reresolve",             NULL,                   reresolve,             false },
+	{ ">stats",                 NULL,                   getStats,              true },
+	{ ">stream",                getQueryStream,         NULL,                  false },
+	{ ">top-ads",               getTopDomains,          NULL,                  true },
+	{ ">top-clients",           getTopClients,          NULL,                  true },
+	{ ">top-domains",           getTopDomains,          NULL,                  true },
+	{ ">unknown",               NULL,                   getUnknownQueries,     false },
+	{ ">version",               NULL,                   getVersion,            false },
+};
+
+static int compare_command(const void *name, const void *entry)
+{
+	return strcmp(name, ((const apicommandStruct *)entry)->name);
+}
+
+// Split a request into the command word, its arguments and the number of
+// entries in parentheses, e.g. ">top-clients withzero (15)". The message
+// is modified, the request points into it
+static void tokenize_request(char *message, apirequestStruct *request)
+{
+	request->command = NULL;
+	request->argc = 0;
+	request->count = -1;
+	request->quit = false;
+
+	char *saveptr = NULL;
+	for(char *token = strtok_r(message, " \t\r\n", &saveptr); token != NULL;
+	    token = strtok_r(NULL, " \t\r\n", &saveptr))
+	{
+		int num;
+		char end;
+		if(token[0] == '(' && sscanf(token, "(%i%c", &num, &end) == 2 && end == ')')
+			request->count = num;
+		else if(strcmp(token, ">quit") == 0)
+			request->quit = true;
+		else if(request->command == NULL)
+			request->command = token;
+		else if(request->argc < APIMAXARGS)
+			request->argv[request->argc++] = token;
 	}
-	else if(command(client_message, ">reresolve"))
+}
+
+// Is the given word one of the arguments?
+bool request_flag(const apirequestStruct *request, const char *flag)
+{
+	for(int i = 0; i < request->argc; i++)
+		if(strcmp(request->argv[i], flag) == 0)
+			return true;
+	return false;
+}
+
+// Index of the argument following the given name, -1 if there is none
+int request_option(const apirequestStruct *request, const char *name)
+{
+	for(int i = 0; i + 1 < request->argc; i++)
+		if(strcmp(request->argv[i], name) == 0)
+			return i + 1;
+	return -1;
+}
+
+// Read the argument at the given index as an integer
+bool request_int(const apirequestStruct *request, int index, int *value)
+{
+	return index >= 0 && index < request->argc && sscanf(request->argv[index], "%i", value) == 1;
+}
+
+void process_request(char *client_message, int *sock)
+{
+	// Clients may close the connection by sending EOT
+	bool eot = strchr(client_message, 0x04) != NULL;
+
+	apirequestStruct request;
+	tokenize_request(client_message, &request);
+
+	const apicommandStruct *cmd = NULL;
+	if(request.command != NULL)
+		cmd = bsearch(request.command, commands, sizeof(commands)/sizeof(commands[0]),
+		              sizeof(commands[0]), compare_command);
+
+	if(cmd != NULL && cmd->cacheable && apicache_send(&request, *sock))
 	{
-		processed = true;
-		logg("Received API request to re-resolve host names");
-		// Need to release the thread lock already here to allow
-		// the resolver to process the incoming PTR requests
-		disable_thread_lock();
-		// onlynew=false -> reresolve all host names
-		resolveClients(false);
-		resolveForwardDestinations(false);
-		logg("Done re-resolving host names");
+		if(debug) logg("Answered %s from the response cache", request.command);
 	}
-	else if(command(client_message, ">recompile-regex"))
+	else if(cmd != NULL)
 	{
-		processed = true;
-		logg("Received API request to recompile regex");
-		free_regex();
-		read_regex_from_file();
+		if(cmd->handler != NULL)
+			cmd->handler(&request, sock);
+		else
+			cmd->simple(sock);
+
+		if(cmd->cacheable)
+			apicache_store(&request, *sock);
 	}
 
 	// Test only at the end if we want to quit or kill
 	// so things can be processed before
-	if(command(client_message, ">quit") || command(client_message, EOT))
+	if(request.quit || eot)
 	{
-		processed = true;
-		close(*sock);
+		// The connection is closed by the caller
 		*sock = 0;
 	}
-
-	if(!processed)
+	else if(cmd == NULL)
 	{
-		ssend(*sock,"unknown command: %s\n",client_message);
+		ssend(*sock,"unknown command: %s\n", request.command != NULL ? request.command : "");
 	}
 
 	// End of queryable commands
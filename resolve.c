@@ -88,6 +88,10 @@ void resolveClients(bool onlynew)
 
 		enable_thread_lock();
 
+		// Cached API responses may contain the previous name
+		if(clients[i].name == NULL || hostname == NULL || strcmp(clients[i].name, hostname) != 0)
+			apicache_invalidate();
+
 		if(clients[i].name != NULL)
 			free(clients[i].name);
 
@@ -116,6 +120,10 @@ void resolveForwardDestinations(bool onlynew)
 
 		enable_thread_lock();
 
+		// Cached API responses may contain the previous name
+		if(forwarded[i].name == NULL || hostname == NULL || strcmp(forwarded[i].name, hostname) != 0)
+			apicache_invalidate();
+
 		if(forwarded[i].name != NULL)
 			free(forwarded[i].name);
 
@@ -30,6 +30,8 @@ int findOverTimeID(int overTimetimestamp);
 int findForwardID(const char * forward, bool count);
 int findDomainID(const char *domain);
 int findClientID(const char *client);
+int lookupDomainID(const char *domain);
+int lookupClientID(const char *client);
 bool isValidIPv4(const char *addr);
 bool isValidIPv6(const char *addr);
 char *getDomainString(int queryID);
@@ -40,20 +42,25 @@ void close_unix_socket(void);
 void seom(int sock);
 void ssend(int sock, const char *format, ...);
 void swrite(int sock, void *value, size_t size);
-void *telnet_listening_thread_IPv4(void *args);
-void *telnet_listening_thread_IPv6(void *args);
+void sflush(int sock);
+bool sbuffered(int sock, const char **data, size_t *size);
+void sdetach(int sock);
+size_t spending(int sock);
+bool strysend(int sock);
+void sclose(int sock);
 
 void *socket_listening_thread(void *args);
 bool ipv6_available(void);
 void bind_sockets(void);
 
+// request.c
 void process_request(char *client_message, int *sock);
-bool command(char *client_message, const char* cmd);
-bool matchesEndpoint(char *client_message, const char *cmd);
+bool request_flag(const apirequestStruct *request, const char *flag);
+int request_option(const apirequestStruct *request, const char *name);
+bool request_int(const apirequestStruct *request, int index, int *value);
 
 // grep.c
 int countlines(const char* fname);
-int countlineswith(const char* str, const char* fname);
 void check_blocking_status(void);
 
 void check_setupVarsconf(void);
@@ -83,13 +90,61 @@ void *GC_thread(void *val);
 
 // database.c
 void db_init(void);
+void db_close(void);
 void *DB_thread(void *val);
-int get_number_of_queries_in_DB(void);
-void save_to_DB(void);
+bool get_DB_content(dbcontentStruct *content);
+bool save_to_DB(void);
+void db_checkpoint(void);
 void read_data_from_DB(void);
+long int db_partitions_filesize(void);
+int get_saved_queries_in_DB(void);
+bool db_read_rollups(bool daily, int kind, int from, int until, bool totals, int limit,
+                     void (*callback)(int timestamp, int item, const char *name, int count, void *arg), void *arg);
+int db_read_queries(const dbqueryfilterStruct *filter,
+                    void (*callback)(int id, int timestamp, int type, int status, const char *domain, const char *client, void *arg), void *arg);
+
+// toplist.c
+void toplist_init(void);
+void toplist_add_domain(int domainID);
+void toplist_add_client(int clientID);
+void domain_count_change(int domainID, int count, int blockedcount);
+void client_count_change(int clientID, int count, int blockedcount);
+int toplist_size(int list, bool nonzero);
+int toplist_get(int list, int rank, int *value);
+
+// queryindex.c
+void queryindex_init(void);
+void queryindex_add(int queryID);
+void queryindex_remove(int removed);
+int queryindex_seek(int which, int ID, int queryID);
+int queryindex_at(int which, int ID, int pos);
+long long queryindex_sequence(int queryID);
+int queryindex_query(long long sequence);
+int queryindex_time(int timestamp);
+
+// audit.c
+void audit_init(void);
+void audit_check(void);
+bool in_auditlist(const char *domain);
+
+// apicache.c
+bool apicache_send(const apirequestStruct *request, int sock);
+void apicache_store(const apirequestStruct *request, int sock);
+void apicache_invalidate(void);
+
+// stream.c
+void stream_publish(int queryID);
+void stream_attach(int sock, bool success);
+void *stream_thread(void *val);
+
+// snapshot.c
+bool snapshot_save(void);
+void snapshot_refresh(void);
+bool snapshot_load(void);
 
 // memory.c
 void memory_check(int which);
+void memory_reserve(int which, int count);
 char *FTLstrdup(const char *src, const char *file, const char *function, int line);
 void *FTLcalloc(size_t nmemb, size_t size, const char *file, const char *function, int line);
 void *FTLrealloc(void *ptr_in, size_t size, const char *file, const char *function, int line);
@@ -112,3 +167,14 @@ bool match_regex(char *input);
 void free_regex(void);
 void read_regex_from_file(void);
 bool in_whitelist(char *domain);
+
+// gravity.c
+int gravity_parse_file(FILE *fp, const struct stat *st, blocklistStruct *list);
+void gravity_free(blocklistStruct *list);
+bool gravity_load(const char *listfile, const struct stat *src, blocklistStruct *list);
+bool gravity_compile(const char *listfile);
+int gravity_match(const char *domain);
+int gravity_replace(int list, blocklistStruct *new, int generation);
+void gravity_release(void);
+void gravity_reload(void);
+void gravity_bloom_info(unsigned long *domains, unsigned long *bytes, double *expectedfpr, double *observedfpr);
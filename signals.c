@@ -12,6 +12,7 @@
 #include <execinfo.h>
 
 volatile sig_atomic_t killed = 0;
+volatile sig_atomic_t rereadgravity = 0;
 time_t FTLstarttime = 0;
 
 static void SIGSEGV_handler(int sig, siginfo_t *si, void *unused)
@@ -66,6 +67,13 @@ static void SIGSEGV_handler(int sig, siginfo_t *si, void *unused)
 	abort();
 }
 
+static void SIGRT_handler(int sig)
+{
+	// Re-read changed block lists in the housekeeper thread
+	// without clearing the resolver's cache (see gravity_reload())
+	rereadgravity = 1;
+}
+
 void handle_signals(void)
 {
 	struct sigaction old_action;
@@ -82,6 +90,9 @@ void handle_signals(void)
 		sigaction(SIGSEGV, &SEGVaction, NULL);
 	}
 
+	// Catch SIGRTMIN (incremental reload of gravity.list and black.list)
+	signal(SIGRTMIN, SIGRT_handler);
+
 	// Log start time of FTL
 	FTLstarttime = time(NULL);
 }
@@ -0,0 +1,479 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2018 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Snapshots of the in-memory data
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// A snapshot is a single file made of
+//   - a header (snapshotHeaderStruct) including the global counters
+//   - the queries and overTime arrays as they are kept in memory
+//   - the per-client counts of all overTime slots
+//   - one snapshotEntryStruct for each upstream server, client and domain
+//   - a string table holding their IPs, names and domains, each
+//     terminated by a NUL byte
+// Everything is stored in host byte order. The sizes of the structs are
+// part of the header, changing any of them invalidates existing snapshots
+#define SNAPSHOT_MAGIC "FTLSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_NONAME UINT32_MAX
+
+// Snapshots are serialized into memory first, the buffer starts with room
+// for the header
+typedef struct {
+	char *data;
+	size_t size;
+	size_t capacity;
+	uint32_t strsize;
+	bool ok;
+} snapshotWriterStruct;
+
+// Only one snapshot is written at a time
+static pthread_mutex_t snapshotlock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a, continued from hash
+static uint32_t snapshot_hash(uint32_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	for(size_t i = 0; i < len; i++)
+	{
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static uint32_t snapshot_header_checksum(const snapshotHeaderStruct *header)
+{
+	// All header fields preceding the checksum itself
+	return snapshot_hash(2166136261U, header, offsetof(snapshotHeaderStruct, checksum));
+}
+
+static void snapshot_put(snapshotWriterStruct *out, const void *data, size_t len)
+{
+	if(!out->ok || len == 0)
+		return;
+
+	if(out->size + len > out->capacity)
+	{
+		size_t capacity = out->capacity;
+		while(capacity < out->size + len)
+			capacity *= 2;
+		char *grown = realloc(out->data, capacity);
+		if(grown == NULL)
+		{
+			out->ok = false;
+			return;
+		}
+		out->data = grown;
+		out->capacity = capacity;
+	}
+
+	memcpy(out->data + out->size, data, len);
+	out->size += len;
+}
+
+// Write the entry of an upstream server, client or domain. Its strings
+// follow in the string table in the same order
+static void snapshot_put_entry(snapshotWriterStruct *out, int count, int blockedcount, const char *key, const char *name)
+{
+	snapshotEntryStruct entry = { count, blockedcount, out->strsize, SNAPSHOT_NONAME };
+	out->strsize += strlen(key) + 1;
+	if(name != NULL)
+	{
+		entry.name = out->strsize;
+		out->strsize += strlen(name) + 1;
+	}
+	snapshot_put(out, &entry, sizeof(entry));
+}
+
+static void snapshot_put_strings(snapshotWriterStruct *out, const char *key, const char *name)
+{
+	snapshot_put(out, key, strlen(key) + 1);
+	if(name != NULL)
+		snapshot_put(out, name, strlen(name) + 1);
+}
+
+static bool snapshot_enabled(void)
+{
+	return FTLfiles.snapshot != NULL && strlen(FTLfiles.snapshot) > 0 &&
+	       config.privacylevel < PRIVACY_NOSTATS;
+}
+
+// Serialize all in-memory data. The caller has to make sure the data does
+// not change in the meantime (thread lock or shutdown). The number of
+// queries stored in the database and the checksums are filled in by
+// snapshot_write()
+static bool snapshot_serialize(snapshotWriterStruct *out)
+{
+	// Most of the size is known in advance, strings are estimated
+	out->capacity = sizeof(snapshotHeaderStruct) +
+	                counters.queries*sizeof(queriesDataStruct) +
+	                counters.overTime*(sizeof(overTimeDataStruct) + counters.clients*sizeof(int)) +
+	                (counters.forwarded + counters.clients + counters.domains)*(sizeof(snapshotEntryStruct) + 32);
+	out->data = malloc(out->capacity);
+	out->size = sizeof(snapshotHeaderStruct);
+	out->strsize = 0;
+	out->ok = out->data != NULL;
+	if(!out->ok)
+	{
+		logg("WARN: Cannot allocate %zu bytes for snapshot", out->capacity);
+		return false;
+	}
+
+	snapshotHeaderStruct header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.querysize = sizeof(queriesDataStruct);
+	header.overtimesize = sizeof(overTimeDataStruct);
+	header.countersize = sizeof(countersStruct);
+	header.written = time(NULL);
+	header.lastdbindex = lastdbindex;
+	header.queries = counters.queries;
+	header.forwarded = counters.forwarded;
+	header.clients = counters.clients;
+	header.domains = counters.domains;
+	header.overtime = counters.overTime;
+	header.counters = counters;
+
+	snapshot_put(out, queries, counters.queries*sizeof(queriesDataStruct));
+	snapshot_put(out, overTime, counters.overTime*sizeof(overTimeDataStruct));
+	for(int i = 0; i < counters.overTime; i++)
+	{
+		snapshot_put(out, overTime[i].clientdata, overTime[i].clientnum*sizeof(int));
+		header.clientdata += overTime[i].clientnum;
+	}
+
+	for(int i = 0; i < counters.forwarded; i++)
+		snapshot_put_entry(out, forwarded[i].count, forwarded[i].failed, forwarded[i].ip, forwarded[i].name);
+	for(int i = 0; i < counters.clients; i++)
+		snapshot_put_entry(out, clients[i].count, clients[i].blockedcount, clients[i].ip, clients[i].name);
+	for(int i = 0; i < counters.domains; i++)
+		snapshot_put_entry(out, domains[i].count, domains[i].blockedcount, domains[i].domain, NULL);
+
+	for(int i = 0; i < counters.forwarded; i++)
+		snapshot_put_strings(out, forwarded[i].ip, forwarded[i].name);
+	for(int i = 0; i < counters.clients; i++)
+		snapshot_put_strings(out, clients[i].ip, clients[i].name);
+	for(int i = 0; i < counters.domains; i++)
+		snapshot_put_strings(out, domains[i].domain, NULL);
+
+	if(!out->ok)
+	{
+		logg("WARN: Cannot allocate memory for snapshot");
+		free(out->data);
+		return false;
+	}
+
+	header.strsize = out->strsize;
+	memcpy(out->data, &header, sizeof(header));
+	return true;
+}
+
+// Complete the header of a serialized snapshot and write it to the snapshot
+// file. The buffer is released. This works on the copy only and does not
+// need the thread lock
+static bool snapshot_write(snapshotWriterStruct *out, int dbqueries)
+{
+	snapshotHeaderStruct *header = (snapshotHeaderStruct *)out->data;
+	header->dbqueries = dbqueries;
+	header->datasum = snapshot_hash(2166136261U, out->data + sizeof(snapshotHeaderStruct), out->size - sizeof(snapshotHeaderStruct));
+	header->checksum = snapshot_header_checksum(header);
+	unsigned int numqueries = header->queries;
+
+	char *tmpfile = NULL;
+	if(asprintf(&tmpfile, "%s.tmp", FTLfiles.snapshot) < 0)
+	{
+		free(out->data);
+		return false;
+	}
+
+	FILE *fp = fopen(tmpfile, "w");
+	if(fp == NULL)
+	{
+		logg("Cannot create %s: %s", tmpfile, strerror(errno));
+		free(tmpfile);
+		free(out->data);
+		return false;
+	}
+	bool ok = fwrite(out->data, out->size, 1, fp) == 1;
+	free(out->data);
+
+	// Move the complete snapshot into place, the previous one stays
+	// valid until then
+	if(fclose(fp) != 0 || !ok || rename(tmpfile, FTLfiles.snapshot) != 0)
+	{
+		logg("Cannot write snapshot %s: %s", FTLfiles.snapshot, strerror(errno));
+		unlink(tmpfile);
+		free(tmpfile);
+		return false;
+	}
+	free(tmpfile);
+
+	if(debug) logg("Notice: Snapshot of %u queries written (took %.1f ms)", numqueries, timer_elapsed_msec(SNAPSHOT_TIMER));
+	return true;
+}
+
+// Write all in-memory data to the snapshot file at shutdown, when the data
+// does not change anymore
+bool snapshot_save(void)
+{
+	if(!snapshot_enabled())
+		return false;
+
+	pthread_mutex_lock(&snapshotlock);
+	timer_start(SNAPSHOT_TIMER);
+
+	snapshotWriterStruct out;
+	bool success = snapshot_serialize(&out) &&
+	               snapshot_write(&out, database ? get_saved_queries_in_DB() : -1);
+
+	pthread_mutex_unlock(&snapshotlock);
+	return success;
+}
+
+// Refresh the snapshot while FTL is running (every SNAPSHOTINTERVAL). Only
+// the copy into memory is made while holding the thread lock, the database
+// and the file are accessed after releasing it
+void snapshot_refresh(void)
+{
+	if(!snapshot_enabled())
+		return;
+
+	pthread_mutex_lock(&snapshotlock);
+	timer_start(SNAPSHOT_TIMER);
+
+	// Queries stored in the database while the copy is made would be
+	// stored a second time after restoring it. The copy is only used if
+	// the number of stored queries did not change in the meantime
+	for(int attempt = 0; attempt < 3; attempt++)
+	{
+		int before = database ? get_saved_queries_in_DB() : -1;
+
+		snapshotWriterStruct out;
+		enable_thread_lock();
+		bool success = snapshot_serialize(&out);
+		disable_thread_lock();
+		if(!success)
+			break;
+
+		int after = database ? get_saved_queries_in_DB() : -1;
+		if(after == before)
+		{
+			snapshot_write(&out, after);
+			break;
+		}
+		free(out.data);
+	}
+
+	pthread_mutex_unlock(&snapshotlock);
+}
+
+// Check a mapped snapshot, returns NULL if it can be used or the reason why not
+static const char *snapshot_check(const void *image, size_t size)
+{
+	const snapshotHeaderStruct *header = image;
+	if(size < sizeof(snapshotHeaderStruct) ||
+	   memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+	   header->version != SNAPSHOT_VERSION)
+		return "unknown format";
+	if(header->checksum != snapshot_header_checksum(header))
+		return "header checksum mismatch";
+	if(header->querysize != sizeof(queriesDataStruct) ||
+	   header->overtimesize != sizeof(overTimeDataStruct) ||
+	   header->countersize != sizeof(countersStruct))
+		return "written by an incompatible version";
+
+	uint64_t expected = sizeof(snapshotHeaderStruct) +
+	                    (uint64_t)header->queries*sizeof(queriesDataStruct) +
+	                    (uint64_t)header->overtime*sizeof(overTimeDataStruct) +
+	                    (uint64_t)header->clientdata*sizeof(int) +
+	                    ((uint64_t)header->forwarded + header->clients + header->domains)*sizeof(snapshotEntryStruct) +
+	                    header->strsize;
+	if(expected != size)
+		return "size mismatch";
+	if(header->datasum != snapshot_hash(2166136261U, (const char *)image + sizeof(snapshotHeaderStruct), size - sizeof(snapshotHeaderStruct)))
+		return "checksum mismatch";
+
+	// Everything older than MAXLOGAGE would be removed right away
+	time_t now = time(NULL);
+	if(header->written > now || header->written < now - config.maxlogage)
+		return "outdated";
+
+	// Queries have been stored in the database after the snapshot was
+	// written (e.g. FTL did not terminate properly afterwards)
+	if(header->dbqueries != (database ? get_saved_queries_in_DB() : -1))
+		return "database changed";
+
+	// The strings have to be terminated, the IDs within range
+	const char *strings = (const char *)image + size - header->strsize;
+	if(header->strsize > 0 && strings[header->strsize - 1] != '\0')
+		return "string table not terminated";
+	const snapshotEntryStruct *entries = (const snapshotEntryStruct *)(strings - ((uint64_t)header->forwarded + header->clients + header->domains)*sizeof(snapshotEntryStruct));
+	for(uint32_t i = 0; i < header->forwarded + header->clients + header->domains; i++)
+		if(entries[i].key >= header->strsize ||
+		   (entries[i].name != SNAPSHOT_NONAME && entries[i].name >= header->strsize))
+			return "invalid string offset";
+
+	const queriesDataStruct *q = (const queriesDataStruct *)(header + 1);
+	for(uint32_t i = 0; i < header->queries; i++)
+		if(q[i].magic != MAGICBYTE ||
+		   q[i].domainID < 0 || (uint32_t)q[i].domainID >= header->domains ||
+		   q[i].clientID < 0 || (uint32_t)q[i].clientID >= header->clients ||
+		   q[i].forwardID < -1 || (q[i].forwardID >= 0 && (uint32_t)q[i].forwardID >= header->forwarded) ||
+		   q[i].timeidx < 0 || (uint32_t)q[i].timeidx >= header->overtime)
+			return "invalid query";
+
+	const overTimeDataStruct *o = (const overTimeDataStruct *)(q + header->queries);
+	uint64_t clientdata = 0;
+	for(uint32_t i = 0; i < header->overtime; i++)
+	{
+		if(o[i].magic != MAGICBYTE || o[i].clientnum < 0 || (uint32_t)o[i].clientnum > header->clients)
+			return "invalid overTime data";
+		clientdata += o[i].clientnum;
+	}
+	if(clientdata != header->clientdata)
+		return "invalid overTime data";
+
+	return NULL;
+}
+
+// Restore the in-memory data from the snapshot written by the previous
+// run. This fails if there is no snapshot, if it is damaged, or if it
+// does not match the long-term database (anymore)
+bool snapshot_load(void)
+{
+	if(FTLfiles.snapshot == NULL || strlen(FTLfiles.snapshot) == 0 ||
+	   config.privacylevel >= PRIVACY_NOSTATS)
+		return false;
+
+	FILE *fp = fopen(FTLfiles.snapshot, "r");
+	if(fp == NULL)
+	{
+		// No snapshot, this is not an error
+		return false;
+	}
+
+	timer_start(SNAPSHOT_TIMER);
+
+	struct stat st;
+	void *image = MAP_FAILED;
+	errno = EINVAL;
+	if(fstat(fileno(fp), &st) == 0 && (size_t)st.st_size >= sizeof(snapshotHeaderStruct))
+		image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	fclose(fp);
+
+	if(image == MAP_FAILED)
+	{
+		logg("WARN: Cannot map %s: %s", FTLfiles.snapshot, strerror(errno));
+		return false;
+	}
+	madvise(image, st.st_size, MADV_SEQUENTIAL);
+
+	const char *reason = snapshot_check(image, st.st_size);
+	if(reason != NULL)
+	{
+		logg("INFO: Not using %s (%s)", FTLfiles.snapshot, reason);
+		munmap(image, st.st_size);
+		return false;
+	}
+
+	const snapshotHeaderStruct *header = image;
+	const queriesDataStruct *q = (const queriesDataStruct *)(header + 1);
+	const overTimeDataStruct *o = (const overTimeDataStruct *)(q + header->queries);
+	const int *clientdata = (const int *)(o + header->overtime);
+	const snapshotEntryStruct *entries = (const snapshotEntryStruct *)(clientdata + header->clientdata);
+	const char *strings = (const char *)(entries + header->forwarded + header->clients + header->domains);
+
+	// Upstream servers, clients and domains are added in their previous
+	// order so that they keep their IDs. Names of clients and upstream
+	// servers are known already, regex matches are evaluated again
+	for(uint32_t i = 0; i < header->forwarded; i++, entries++)
+	{
+		int ID = findForwardID(strings + entries->key, false);
+		forwarded[ID].count = entries->count;
+		forwarded[ID].failed = entries->blockedcount;
+		if(entries->name != SNAPSHOT_NONAME)
+		{
+			forwarded[ID].name = strdup(strings + entries->name);
+			forwarded[ID].new = false;
+		}
+	}
+	for(uint32_t i = 0; i < header->clients; i++, entries++)
+	{
+		int ID = findClientID(strings + entries->key);
+		clients[ID].count = entries->count;
+		clients[ID].blockedcount = entries->blockedcount;
+		if(entries->name != SNAPSHOT_NONAME)
+		{
+			clients[ID].name = strdup(strings + entries->name);
+			clients[ID].new = false;
+		}
+	}
+	for(uint32_t i = 0; i < header->domains; i++, entries++)
+	{
+		int ID = findDomainID(strings + entries->key);
+		domains[ID].count = entries->count;
+		domains[ID].blockedcount = entries->blockedcount;
+	}
+
+	for(uint32_t i = 0; i < header->overtime; i++)
+	{
+		memory_check(OVERTIME);
+		overTime[i] = o[i];
+		overTime[i].clientdata = NULL;
+		if(o[i].clientnum > 0)
+		{
+			overTime[i].clientdata = calloc(o[i].clientnum, sizeof(int));
+			if(overTime[i].clientdata == NULL)
+			{
+				logg("FATAL: Memory allocation failed! Exiting");
+				exit(EXIT_FAILURE);
+			}
+			memcpy(overTime[i].clientdata, clientdata, o[i].clientnum*sizeof(int));
+			clientdata += o[i].clientnum;
+		}
+		counters.overTime++;
+	}
+
+	memory_reserve(QUERIES, header->queries);
+	memcpy(queries, q, header->queries*sizeof(queriesDataStruct));
+	counters.queries = header->queries;
+	for(int i = 0; i < counters.queries; i++)
+	{
+		// This is dnsmasq's internal ID of the previous run
+		queries[i].id = 0;
+		// The privacy level may have been raised in the meantime
+		if(queries[i].privacylevel < config.privacylevel)
+			queries[i].privacylevel = config.privacylevel;
+		lastDBimportedtimestamp = queries[i].timestamp;
+	}
+
+	// Queries before lastdbindex are in the database already
+	lastdbindex = header->lastdbindex;
+	if(lastdbindex < 0 || lastdbindex > counters.queries)
+		lastdbindex = counters.queries;
+
+	counters.blocked = header->counters.blocked;
+	counters.cached = header->counters.cached;
+	counters.unknown = header->counters.unknown;
+	counters.forwardedqueries = header->counters.forwardedqueries;
+	memcpy(counters.querytype, header->counters.querytype, sizeof(counters.querytype));
+	counters.reply_NODATA = header->counters.reply_NODATA;
+	counters.reply_NXDOMAIN = header->counters.reply_NXDOMAIN;
+	counters.reply_CNAME = header->counters.reply_CNAME;
+	counters.reply_IP = header->counters.reply_IP;
+	counters.reply_domain = header->counters.reply_domain;
+
+	munmap(image, st.st_size);
+	logg("Restored %i queries from snapshot (took %.1f ms)", counters.queries, timer_elapsed_msec(SNAPSHOT_TIMER));
+	return true;
+}
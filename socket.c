@@ -25,7 +25,34 @@
 int socketfd, telnetfd4 = 0, telnetfd6 = 0;
 bool dualstack = false;
 bool ipv4telnet = false, ipv6telnet = false;
-bool istelnet[MAXCONNS];
+bool *istelnet = NULL;
+
+// Output buffer of a worker (see sappend())
+typedef struct {
+	size_t len;
+	bool failed;
+	bool flushed;
+	char data[SOCKETOUTBUFFERLEN];
+} outbufferStruct;
+
+// State of the client connections, indexed by their file descriptor. The
+// arrays are sized from the limit of open files so every descriptor fits.
+// Connections subscribed to the live query stream are left to stream.c
+enum { CONN_CLOSED, CONN_IDLE, CONN_QUEUED, CONN_STREAM };
+typedef struct {
+	unsigned char state;
+	outbufferStruct *out;
+} connectionStruct;
+static connectionStruct *connections = NULL;
+static int maxfds = 0;
+static int numconns = 0;
+
+// Connections with pending requests, answered by the worker threads
+static int epollfd = -1;
+static int workqueue[MAXCONNS];
+static int workhead = 0, workcount = 0;
+static pthread_mutex_t worklock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workready = PTHREAD_COND_INITIALIZER;
 
 void saveport(void)
 {
@@ -45,7 +72,7 @@ void saveport(void)
 bool bind_to_telnet_port_IPv4(int *socketdescriptor)
 {
 	// IPv4 socket
-	*socketdescriptor = socket(AF_INET, SOCK_STREAM, 0);
+	*socketdescriptor = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
 	if(*socketdescriptor < 0)
 	{
@@ -94,7 +121,7 @@ bool bind_to_telnet_port_IPv4(int *socketdescriptor)
 bool bind_to_telnet_port_IPv6(int *socketdescriptor)
 {
 	// IPv6 socket
-	*socketdescriptor = socket(AF_INET6, SOCK_STREAM, 0);
+	*socketdescriptor = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
 	if(*socketdescriptor < 0)
 	{
@@ -155,7 +182,7 @@ bool bind_to_telnet_port_IPv6(int *socketdescriptor)
 
 void bind_to_unix_socket(int *socketdescriptor)
 {
-	*socketdescriptor = socket(AF_LOCAL, SOCK_STREAM, 0);
+	*socketdescriptor = socket(AF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
 	if(*socketdescriptor < 0)
 	{
@@ -206,73 +233,159 @@ void seom(int sock)
 		ssend(sock, "---EOM---\n\n");
 	else
 		pack_eom(sock);
+	sflush(sock);
 }
 
-void ssend(int sock, const char *format, ...)
+// Write all of the given data, resuming after partial writes. Sockets may
+// be non-blocking, wait until they accept more data then
+static bool swritev(int sock, struct iovec *iov, int iovcnt)
 {
-	char *buffer;
-	va_list args;
-	va_start(args, format);
-	int ret = vasprintf(&buffer, format, args);
-	va_end(args);
-	if(ret > 0)
+	while(iovcnt > 0)
 	{
-		if(!write(sock, buffer, strlen(buffer)))
+		ssize_t n = writev(sock, iov, iovcnt);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN)
+			{
+				struct pollfd pfd = { sock, POLLOUT, 0 };
+				if(poll(&pfd, 1, SOCKETWRITETIMEOUT) > 0)
+					continue;
+				logg("WARNING: Socket write timed out");
+				return false;
+			}
 			logg("WARNING: Socket write returned error %s (%i)", strerror(errno), errno);
-		free(buffer);
+			return false;
+		}
+
+		// Skip what has been written
+		while(iovcnt > 0 && (size_t)n >= iov->iov_len)
+		{
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0)
+		{
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return true;
+}
+
+// Send the buffered output of a connection together with data that did
+// not fit into the buffer anymore
+static void sflush_with(int sock, const void *data, size_t size)
+{
+	outbufferStruct *out = sock >= 0 && sock < maxfds ? connections[sock].out : NULL;
+	struct iovec iov[2];
+	int iovcnt = 0;
+	if(out != NULL && out->len > 0)
+	{
+		iov[iovcnt].iov_base = out->data;
+		iov[iovcnt++].iov_len = out->len;
+		out->len = 0;
+	}
+	if(size > 0)
+	{
+		iov[iovcnt].iov_base = (void *)data;
+		iov[iovcnt++].iov_len = size;
+	}
+
+	if(iovcnt > 0 && out != NULL)
+		out->flushed = true;
+
+	if(iovcnt > 0 && !swritev(sock, iov, iovcnt) && out != NULL)
+	{
+		// Don't try to send the rest of the response
+		out->failed = true;
 	}
 }
 
-void swrite(int sock, void *value, size_t size) {
-	if(write(sock, value, size) == -1)
-		logg("WARNING: Socket write returned error code %i", errno);
+void sflush(int sock)
+{
+	sflush_with(sock, NULL, 0);
 }
 
-int checkClientLimit(int socket) {
-	if(socket < MAXCONNS)
+// Append data to the output buffer of a connection, it is sent when the
+// buffer is full or the response is complete
+static void sappend(int sock, const void *data, size_t size)
+{
+	outbufferStruct *out = sock >= 0 && sock < maxfds ? connections[sock].out : NULL;
+	if(out == NULL)
+		sflush_with(sock, data, size);
+	else if(out->failed)
+		return;
+	else if(out->len + size <= SOCKETOUTBUFFERLEN)
 	{
-		return socket;
+		memcpy(out->data + out->len, data, size);
+		out->len += size;
 	}
 	else
+		sflush_with(sock, data, size);
+}
+
+void ssend(int sock, const char *format, ...)
+{
+	va_list args;
+	outbufferStruct *out = sock >= 0 && sock < maxfds ? connections[sock].out : NULL;
+	if(out != NULL)
 	{
-		logg("Client denied (at max capacity of %i): %i", MAXCONNS, socket);
+		if(out->failed)
+			return;
+
+		// Format directly into the buffer if the line fits
+		for(int attempt = 0; attempt < 2; attempt++)
+		{
+			size_t space = SOCKETOUTBUFFERLEN - out->len;
+			va_start(args, format);
+			int len = vsnprintf(out->data + out->len, space, format, args);
+			va_end(args);
+			if(len < 0)
+				return;
+			if((size_t)len < space)
+			{
+				out->len += len;
+				return;
+			}
+			if(out->len == 0)
+				break;
+			sflush(sock);
+			if(out->failed)
+				return;
+		}
+	}
 
-		close(socket);
-		return -1;
+	// Lines longer than the buffer
+	char *buffer;
+	va_start(args, format);
+	int ret = vasprintf(&buffer, format, args);
+	va_end(args);
+	if(ret > 0)
+	{
+		sappend(sock, buffer, ret);
+		free(buffer);
 	}
 }
 
-int listener(int sockfd, char type)
+void swrite(int sock, void *value, size_t size)
 {
-	struct sockaddr_un un_addr;
-	struct sockaddr_in in4_addr;
-	struct sockaddr_in6 in6_addr;
-	socklen_t socklen = 0;
-	int socket;
-
-	switch(type)
-	{
-		case 0: // Unix socket
-			memset(&un_addr, 0, sizeof(un_addr));
-			socklen = sizeof(un_addr);
-			return accept(sockfd, (struct sockaddr *) &un_addr, &socklen);
-
-		case 4: // Internet socket (IPv4)
-			memset(&in4_addr, 0, sizeof(in4_addr));
-			socklen = sizeof(un_addr);
-			socket = accept(sockfd, (struct sockaddr *) &in4_addr, &socklen);
-			return checkClientLimit(socket);
-
-		case 6: // Internet socket (IPv6)
-			memset(&in6_addr, 0, sizeof(in6_addr));
-			socklen = sizeof(un_addr);
-			socket = accept(sockfd, (struct sockaddr *) &in6_addr, &socklen);
-			return checkClientLimit(socket);
-
-		default: // Should not happen
-			logg("Cannot listen on type %i connection, code error!", type);
-			exit(EXIT_FAILURE);
-	}
+	sappend(sock, value, size);
+}
+
+// Everything written to a connection since its current request arrived, as
+// long as nothing of it has been sent yet
+bool sbuffered(int sock, const char **data, size_t *size)
+{
+	outbufferStruct *out = sock >= 0 && sock < maxfds ? connections[sock].out : NULL;
+	if(out == NULL || out->flushed || out->failed)
+		return false;
+
+	*data = out->data;
+	*size = out->len;
+	return true;
 }
 
 void close_telnet_socket(void)
@@ -293,117 +406,204 @@ void close_unix_socket(void)
 	close(socketfd);
 }
 
-void *telnet_connection_handler_thread(void *socket_desc)
+// Size the per-connection arrays from the limit of open files
+static bool init_connections(void)
+{
+	struct rlimit limit;
+	if(getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > MAXFDS)
+		maxfds = MAXFDS;
+	else
+		maxfds = limit.rlim_cur;
+
+	connections = calloc(maxfds, sizeof(connectionStruct));
+	istelnet = calloc(maxfds, sizeof(bool));
+	return connections != NULL && istelnet != NULL;
+}
+
+// Wait for the next request of a connection again
+static void watch_connection(int fd)
 {
-	//Get the socket descriptor
-	int sock = *(int*)socket_desc;
-	// Set connection type to telnet
-	istelnet[sock] = true;
+	struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = fd };
+	connections[fd].state = CONN_IDLE;
+	if(epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event) != 0)
+		logg("WARNING: Cannot watch API connection %i: %s (%i)", fd, strerror(errno), errno);
+}
 
-	// Define buffer for client's message
-	char client_message[SOCKETBUFFERLEN] = "";
+static void close_connection(int fd)
+{
+	connections[fd].state = CONN_CLOSED;
+	pthread_mutex_lock(&worklock);
+	numconns--;
+	pthread_mutex_unlock(&worklock);
+	// Closing the descriptor removes it from the epoll set
+	close(fd);
+}
 
-	// Set thread name
-	char threadname[16];
-	sprintf(threadname,"telnet-%i",sock);
-	prctl(PR_SET_NAME,threadname,0,0,0);
-	//Receive from client
-	ssize_t n;
-	while((n = recv(sock,client_message,SOCKETBUFFERLEN-1, 0)))
+// Hand the connection over to the live query stream once the response to
+// the current request has been sent
+void sdetach(int sock)
+{
+	connections[sock].state = CONN_STREAM;
+}
+
+// Number of bytes of a streaming connection waiting to be sent
+size_t spending(int sock)
+{
+	return connections[sock].out->len;
+}
+
+// Send as much of the buffered output of a streaming connection as the
+// socket accepts without blocking. Returns false if the connection is gone
+bool strysend(int sock)
+{
+	outbufferStruct *out = connections[sock].out;
+	while(out->len > 0)
 	{
-		if (n > 0)
-		{
-			char *message = strdup(client_message);
-			if(message == NULL) break;
+		ssize_t n = write(sock, out->data, out->len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && errno == EAGAIN)
+			return true;
+		if(n <= 0)
+			return false;
 
-			// Clear client message receive buffer
-			memset(client_message, 0, sizeof client_message);
+		memmove(out->data, out->data + n, out->len - n);
+		out->len -= n;
+	}
+	return true;
+}
 
-			// Lock FTL data structure, since it is likely that it will be changed here
-			// Requests should not be processed/answered when data is about to change
-			enable_thread_lock();
+// Close a streaming connection
+void sclose(int sock)
+{
+	if(connections[sock].out != NULL)
+		free(connections[sock].out);
+	connections[sock].out = NULL;
+	close_connection(sock);
+}
 
-			process_request(message, &sock);
-			free(message);
+static bool is_listening_socket(int fd)
+{
+	return (ipv4telnet && fd == telnetfd4) || (ipv6telnet && fd == telnetfd6) || fd == socketfd;
+}
 
-			// Release thread lock
-			disable_thread_lock();
+// Accept all pending connections of a listening socket. The number of
+// connections is limited, not the value of their descriptors
+static void accept_connections(int listenfd)
+{
+	int fd;
+	while((fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+	{
+		pthread_mutex_lock(&worklock);
+		bool accepted = numconns < MAXCONNS && fd < maxfds;
+		if(accepted)
+			numconns++;
+		pthread_mutex_unlock(&worklock);
 
-			if(sock == 0)
-			{
-				// Client disconnected by sending EOT or ">quit"
-				break;
-			}
+		if(!accepted)
+		{
+			logg("Client denied (at max capacity of %i connections): %i", MAXCONNS, fd);
+			close(fd);
+			continue;
 		}
-		else if(n == -1)
+
+		istelnet[fd] = listenfd != socketfd;
+		connections[fd].state = CONN_IDLE;
+		connections[fd].out = NULL;
+		struct epoll_event event = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = fd };
+		if(epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event) != 0)
 		{
-			break;
+			logg("WARNING: Cannot watch API connection %i: %s (%i)", fd, strerror(errno), errno);
+			close_connection(fd);
 		}
 	}
 
-	//Free the socket pointer
-	if(sock != 0)
-		close(sock);
-	free(socket_desc);
-
-	return false;
+	if(errno != EAGAIN && errno != EINTR)
+		logg("API socket accept error: %s (%i)", strerror(errno), errno);
 }
 
-
-void *socket_connection_handler_thread(void *socket_desc)
+// Answer one request of a connection. Each received chunk is processed as
+// one message, like before. The worker's output buffer is lent to the
+// connection while the response is written
+static void handle_connection(int fd, outbufferStruct *out)
 {
-	//Get the socket descriptor
-	int sock = *(int*)socket_desc;
-	// Set connection type to not telnet
-	istelnet[sock] = false;
-
 	// Define buffer for client's message
-	char client_message[SOCKETBUFFERLEN] = "";
+	char client_message[SOCKETBUFFERLEN];
 
-	// Set thread name
-	char threadname[16];
-	sprintf(threadname,"socket-%i",sock);
-	prctl(PR_SET_NAME,threadname,0,0,0);
-	//Receive from client
-	ssize_t n;
-	while((n = recv(sock,client_message,SOCKETBUFFERLEN-1, 0)))
+	ssize_t n = recv(fd, client_message, SOCKETBUFFERLEN-1, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EINTR))
 	{
-		if (n > 0)
-		{
-			char *message = strdup(client_message);
-			if(message == NULL) break;
+		watch_connection(fd);
+		return;
+	}
+	if(n <= 0)
+	{
+		// Client disconnected or connection error
+		close_connection(fd);
+		return;
+	}
+	client_message[n] = '\0';
 
-			// Clear client message receive buffer
-			memset(client_message, 0, sizeof client_message);
+	out->len = 0;
+	out->failed = false;
+	out->flushed = false;
+	connections[fd].out = out;
 
-			// Lock FTL data structure, since it is likely that it will be changed here
-			// Requests should not be processed/answered when data is about to change
-			enable_thread_lock();
+	// Lock FTL data structure, since it is likely that it will be changed here
+	// Requests should not be processed/answered when data is about to change
+	int sock = fd;
+	enable_thread_lock();
+	process_request(client_message, &sock);
+	disable_thread_lock();
 
-			process_request(message, &sock);
-			free(message);
+	sflush(fd);
+	connections[fd].out = NULL;
 
-			// Release thread lock
-			disable_thread_lock();
+	if(connections[fd].state == CONN_STREAM)
+	{
+		// The connection subscribed to the live query stream and is served
+		// by the stream thread from now on, with an output buffer of its own
+		if(sock != 0 && !out->failed)
+			connections[fd].out = calloc(1, sizeof(outbufferStruct));
+		stream_attach(fd, connections[fd].out != NULL);
+		return;
+	}
 
-			if(sock == 0)
-			{
-				// Socket connection interrupted by sending EOT or ">quit"
-				break;
-			}
-		}
-		else if(n == -1)
-		{
-			break;
-		}
+	if(sock == 0 || out->failed)
+	{
+		// Client disconnected by sending EOT or ">quit" (or is gone)
+		close_connection(fd);
+		return;
 	}
 
-	//Free the socket pointer
-	if(sock != 0)
-		close(sock);
-	free(socket_desc);
+	watch_connection(fd);
+}
+
+static void *API_worker_thread(void *val)
+{
+	char threadname[16];
+	sprintf(threadname, "api-%i", (int)(intptr_t)val);
+	prctl(PR_SET_NAME,threadname,0,0,0);
+
+	outbufferStruct *out = calloc(1, sizeof(outbufferStruct));
+	if(out == NULL)
+		return NULL;
 
-	return false;
+	while(!killed)
+	{
+		pthread_mutex_lock(&worklock);
+		while(workcount == 0)
+			pthread_cond_wait(&workready, &worklock);
+		int fd = workqueue[workhead];
+		workhead = (workhead + 1) % MAXCONNS;
+		workcount--;
+		pthread_mutex_unlock(&worklock);
+
+		handle_connection(fd, out);
+	}
+
+	free(out);
+	return NULL;
 }
 
 void bind_sockets(void)
@@ -422,51 +622,37 @@ void bind_sockets(void)
 
 	// Initialize Unix socket
 	bind_to_unix_socket(&socketfd);
+
+	if(!init_connections())
+	{
+		logg("FATAL: Cannot allocate API connection table");
+		exit(EXIT_FAILURE);
+	}
 }
 
-void *telnet_listening_thread_IPv4(void *args)
+// Single thread waiting for new connections and requests on all API
+// sockets. Connections are watched one-shot: once a request arrives, the
+// connection is handed to a worker and watched again when it is answered
+void *socket_listening_thread(void *args)
 {
-	// We will use the attributes object later to start all threads in detached mode
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
-	// When a detached thread terminates, its resources are automatically released back to
-	// the system without the need for another thread to join with the terminated thread
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
 	// Set thread name
-	prctl(PR_SET_NAME,"telnet-IPv4",0,0,0);
+	prctl(PR_SET_NAME,"socket listener",0,0,0);
 
-	// Listen as long as FTL is not killed
-	while(!killed)
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if(epollfd < 0)
 	{
-		// Look for new clients that want to connect
-		int csck = listener(telnetfd4, 4);
-		if(csck == -1)
-		{
-			logg("IPv4 telnet error: %s (%i)", strerror(errno), errno);
-			continue;
-		}
-
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
+		logg("FATAL: Cannot create API epoll instance: %s (%i)", strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
 
-		pthread_t telnet_connection_thread;
-		// Create a new thread
-		if(pthread_create( &telnet_connection_thread, &attr, telnet_connection_handler_thread, (void*) newsock ) != 0)
-		{
-			// Log the error code description
-			logg("WARNING: Unable to open telnet processing thread, error: %s", strerror(errno));
-		}
+	const int listenfds[] = { ipv4telnet ? telnetfd4 : -1, ipv6telnet ? telnetfd6 : -1, socketfd };
+	for(unsigned int i = 0; i < sizeof(listenfds)/sizeof(listenfds[0]); i++)
+	{
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = listenfds[i] };
+		if(listenfds[i] >= 0 && epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfds[i], &event) != 0)
+			logg("WARNING: Cannot watch API socket %i: %s (%i)", listenfds[i], strerror(errno), errno);
 	}
-	return false;
-}
 
-void *telnet_listening_thread_IPv6(void *args)
-{
 	// We will use the attributes object later to start all threads in detached mode
 	pthread_attr_t attr;
 	// Initialize thread attributes object with default attribute values
@@ -474,70 +660,46 @@ void *telnet_listening_thread_IPv6(void *args)
 	// When a detached thread terminates, its resources are automatically released back to
 	// the system without the need for another thread to join with the terminated thread
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	// Set thread name
-	prctl(PR_SET_NAME,"telnet-IPv6",0,0,0);
-
-	// Listen as long as FTL is not killed
-	while(!killed)
+	for(int i = 0; i < APIWORKERS; i++)
 	{
-		// Look for new clients that want to connect
-		int csck = listener(telnetfd6, 6);
-		if(csck == -1)
-		{
-			logg("IPv6 telnet error: %s (%i)", strerror(errno), errno);
-			continue;
-		}
-
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
-
-		pthread_t telnet_connection_thread;
-		// Create a new thread
-		if(pthread_create( &telnet_connection_thread, &attr, telnet_connection_handler_thread, (void*) newsock ) != 0)
+		pthread_t worker;
+		if(pthread_create(&worker, &attr, API_worker_thread, (void *)(intptr_t)i) != 0)
 		{
-			// Log the error code description
-			logg("WARNING: Unable to open telnet processing thread, error: %s", strerror(errno));
+			logg("FATAL: Unable to open API worker thread, error: %s", strerror(errno));
+			exit(EXIT_FAILURE);
 		}
 	}
-	return false;
-}
-
-void *socket_listening_thread(void *args)
-{
-	// We will use the attributes object later to start all threads in detached mode
-	pthread_attr_t attr;
-	// Initialize thread attributes object with default attribute values
-	pthread_attr_init(&attr);
-	// When a detached thread terminates, its resources are automatically released back to
-	// the system without the need for another thread to join with the terminated thread
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	// Set thread name
-	prctl(PR_SET_NAME,"socket listener",0,0,0);
 
 	// Listen as long as FTL is not killed
+	struct epoll_event events[64];
 	while(!killed)
 	{
-		// Look for new clients that want to connect
-		int csck = listener(socketfd, 0);
-		if(csck < 0) continue;
-
-		// Allocate memory used to transport client socket ID to client listening thread
-		int *newsock;
-		newsock = calloc(1,sizeof(int));
-		if(newsock == NULL) break;
-		*newsock = csck;
+		int n = epoll_wait(epollfd, events, sizeof(events)/sizeof(events[0]), -1);
+		if(n < 0)
+		{
+			if(errno != EINTR)
+				logg("API epoll error: %s (%i)", strerror(errno), errno);
+			continue;
+		}
 
-		pthread_t socket_connection_thread;
-		// Create a new thread
-		if(pthread_create( &socket_connection_thread, &attr, socket_connection_handler_thread, (void*) newsock ) != 0)
+		for(int i = 0; i < n; i++)
 		{
-			// Log the error code description
-			logg("WARNING: Unable to open socket processing thread, error: %s", strerror(errno));
+			int fd = events[i].data.fd;
+			if(is_listening_socket(fd))
+			{
+				accept_connections(fd);
+				continue;
+			}
+
+			// Queue the connection, it is not watched until it has been answered
+			if(connections[fd].state != CONN_IDLE)
+				continue;
+			connections[fd].state = CONN_QUEUED;
+			pthread_mutex_lock(&worklock);
+			workqueue[(workhead + workcount) % MAXCONNS] = fd;
+			workcount++;
+			pthread_cond_signal(&workready);
+			pthread_mutex_unlock(&worklock);
 		}
 	}
 	return false;
@@ -0,0 +1,322 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2018 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Live query stream
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+#include "api.h"
+#include <sys/eventfd.h>
+
+// Connections which sent >stream get every query once it has been answered.
+// The DNS thread only queues the sequence number of the query for each
+// subscriber whose filters match. If the queue of a subscriber is full, the
+// query is dropped and counted instead. The stream thread sends the queued
+// queries in the format of >getallqueries without ever blocking on a socket,
+// so a slow subscriber loses queries but never holds up DNS processing.
+// Subscribers are only changed while holding the thread lock
+typedef struct {
+	int sock;
+	bool active;
+	// Filters: client IP or name (NULL = all) and its ID once known,
+	// status (-1 = all) and query type (0 = all)
+	char *client;
+	int clientID;
+	int status;
+	int querytype;
+	// Queued queries
+	long long queue[STREAMQUEUELEN];
+	int head;
+	int count;
+	// Dropped queries, in total and when last sent to the subscriber
+	long long dropped;
+	long long reported;
+} streamsubscriberStruct;
+
+static streamsubscriberStruct *subscribers[STREAMMAX];
+static int numsubscribers = 0;
+// Wakes up the stream thread when there are new queries to be sent
+static int wakeupfd = -1;
+
+static bool stream_matches(streamsubscriberStruct *sub, int queryID)
+{
+	if(sub->status >= 0 && queries[queryID].status != sub->status)
+		return false;
+	if(sub->querytype != 0 && queries[queryID].type != sub->querytype)
+		return false;
+
+	if(sub->client != NULL && queries[queryID].clientID != sub->clientID)
+	{
+		// Clients which were not known yet when subscribing are matched
+		// against the IP address and host name when they are first seen
+		int clientID = queries[queryID].clientID;
+		validate_access("clients", clientID, true, __LINE__, __FUNCTION__, __FILE__);
+		if(sub->clientID >= 0 ||
+		   (strcmp(clients[clientID].ip, sub->client) != 0 &&
+		    (clients[clientID].name == NULL || strcmp(clients[clientID].name, sub->client) != 0)))
+			return false;
+		sub->clientID = clientID;
+	}
+	return true;
+}
+
+// Queue an answered query for all subscribers interested in it. Called by
+// the DNS thread while holding the thread lock
+void stream_publish(int queryID)
+{
+	if(numsubscribers == 0 || queries[queryID].privacylevel >= PRIVACY_MAXIMUM)
+		return;
+
+	long long sequence = queryindex_sequence(queryID);
+	bool wakeup = false;
+	for(int s = 0; s < STREAMMAX; s++)
+	{
+		streamsubscriberStruct *sub = subscribers[s];
+		if(sub == NULL || !stream_matches(sub, queryID))
+			continue;
+
+		if(sub->count == STREAMQUEUELEN)
+		{
+			sub->dropped++;
+			continue;
+		}
+		sub->queue[(sub->head + sub->count) % STREAMQUEUELEN] = sequence;
+		if(sub->count++ == 0)
+			wakeup = true;
+	}
+
+	if(wakeup && wakeupfd >= 0)
+		eventfd_write(wakeupfd, 1);
+}
+
+// Number of dropped queries, sent at the end of every batch of queries
+static void stream_send_dropped(streamsubscriberStruct *sub)
+{
+	if(istelnet[sub->sock])
+		ssend(sub->sock, "dropped %lli\n", sub->dropped);
+	else
+		pack_int64(sub->sock, sub->dropped);
+	sub->reported = sub->dropped;
+}
+
+// >stream [client <IP or name>] [status <status>] [type <query type>]
+void getQueryStream(apirequestStruct *request, int *sock)
+{
+	// Exit before processing any data if requested via config setting
+	get_privacy_level(NULL);
+	if(config.privacylevel >= PRIVACY_MAXIMUM)
+		return;
+
+	int status = -1, querytype = 0;
+	int option = request_option(request, "status");
+	if(option >= 0 && (!request_int(request, option, &status) || status < 0 || status >= QUERY_STATUS_MAX))
+		return;
+	option = request_option(request, "type");
+	if(option >= 0 && (!request_int(request, option, &querytype) || querytype < 1 || querytype >= TYPE_MAX))
+		return;
+
+	int s;
+	for(s = 0; s < STREAMMAX && subscribers[s] != NULL; s++);
+	if(s == STREAMMAX)
+	{
+		logg("Query stream denied (at max capacity of %i subscribers)", STREAMMAX);
+		return;
+	}
+
+	streamsubscriberStruct *sub = calloc(1, sizeof(streamsubscriberStruct));
+	if(sub == NULL)
+	{
+		logg("FATAL: Memory allocation failed! Exiting");
+		exit(EXIT_FAILURE);
+	}
+	sub->sock = *sock;
+	sub->clientID = -1;
+	sub->status = status;
+	sub->querytype = querytype;
+
+	option = request_option(request, "client");
+	if(option >= 0)
+	{
+		sub->client = strdup(request->argv[option]);
+		// Try to match the requested string against the IP addresses first,
+		// then against the host names
+		sub->clientID = lookupClientID(sub->client);
+		for(int i = 0; sub->clientID < 0 && i < counters.clients; i++)
+		{
+			validate_access("clients", i, true, __LINE__, __FUNCTION__, __FILE__);
+			if(clients[i].name != NULL && strcmp(clients[i].name, sub->client) == 0)
+				sub->clientID = i;
+		}
+	}
+
+	// Queries are queued from now on but only sent once the connection has
+	// been handed over (see stream_attach())
+	subscribers[s] = sub;
+	numsubscribers++;
+	sdetach(*sock);
+
+	// Confirm the subscription with an empty batch
+	stream_send_dropped(sub);
+}
+
+static int stream_find(int sock)
+{
+	for(int s = 0; s < STREAMMAX; s++)
+		if(subscribers[s] != NULL && subscribers[s]->sock == sock)
+			return s;
+	return -1;
+}
+
+// Remove a subscriber and close its connection
+static void stream_remove(int sock)
+{
+	enable_thread_lock();
+	int s = stream_find(sock);
+	if(s >= 0)
+	{
+		if(subscribers[s]->client != NULL)
+			free(subscribers[s]->client);
+		free(subscribers[s]);
+		subscribers[s] = NULL;
+		numsubscribers--;
+	}
+	disable_thread_lock();
+
+	sclose(sock);
+}
+
+// Start sending queries to a subscribed connection once the response to
+// >stream has been sent. Called by the API worker without the thread lock
+void stream_attach(int sock, bool success)
+{
+	if(!success)
+	{
+		stream_remove(sock);
+		return;
+	}
+
+	enable_thread_lock();
+	int s = stream_find(sock);
+	if(s >= 0)
+		subscribers[s]->active = true;
+	disable_thread_lock();
+
+	if(wakeupfd >= 0)
+		eventfd_write(wakeupfd, 1);
+}
+
+// Format queued queries into the output buffer of a subscriber. It is never
+// filled beyond half of its size so that a row never has to be flushed
+static void stream_fill(streamsubscriberStruct *sub)
+{
+	int sock = sub->sock;
+	bool sent = false;
+	while(sub->count > 0 && spending(sock) < SOCKETOUTBUFFERLEN/2)
+	{
+		int i = queryindex_query(sub->queue[sub->head]);
+		sub->head = (sub->head + 1) % STREAMQUEUELEN;
+		sub->count--;
+
+		// The query may have been removed by the GC in the meantime
+		if(i < 0 || i >= counters.queries)
+			sub->dropped++;
+		else if(sendQuery(i, &sock))
+			sent = true;
+	}
+
+	if(!sent && sub->dropped == sub->reported)
+		return;
+
+	// Complete the batch
+	stream_send_dropped(sub);
+	if(istelnet[sock])
+		ssend(sock, "---EOM---\n\n");
+	else
+		pack_eom(sock);
+}
+
+void *stream_thread(void *val)
+{
+	// Set thread name
+	prctl(PR_SET_NAME,"stream",0,0,0);
+
+	// Created here as dnsmasq closes all descriptors it did not open itself
+	wakeupfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(wakeupfd < 0)
+		logg("WARN: Cannot create wakeup event for the query stream: %s", strerror(errno));
+
+	while(!killed)
+	{
+		// Format queued queries while holding the lock
+		struct pollfd pfds[STREAMMAX + 1];
+		bool more[STREAMMAX];
+		int n = 0;
+		enable_thread_lock();
+		for(int s = 0; s < STREAMMAX; s++)
+		{
+			streamsubscriberStruct *sub = subscribers[s];
+			if(sub == NULL || !sub->active)
+				continue;
+			stream_fill(sub);
+			pfds[n].fd = sub->sock;
+			more[n] = sub->count > 0;
+			n++;
+		}
+		disable_thread_lock();
+
+		// Send them without blocking. What a socket does not accept is sent
+		// when it becomes writable again
+		for(int i = 0; i < n; i++)
+		{
+			if(!strysend(pfds[i].fd))
+			{
+				stream_remove(pfds[i].fd);
+				pfds[i].fd = -1;
+			}
+			pfds[i].events = POLLIN;
+			if(pfds[i].fd >= 0 && (more[i] || spending(pfds[i].fd) > 0))
+				pfds[i].events |= POLLOUT;
+		}
+
+		pfds[n].fd = wakeupfd;
+		pfds[n].events = POLLIN;
+		if(poll(pfds, n + 1, wakeupfd >= 0 ? 1000 : 100) < 0 && errno != EINTR)
+		{
+			logg("Query stream poll error: %s (%i)", strerror(errno), errno);
+			sleepms(100);
+			continue;
+		}
+
+		if(wakeupfd >= 0 && (pfds[n].revents & POLLIN))
+		{
+			eventfd_t value;
+			eventfd_read(wakeupfd, &value);
+		}
+
+		// Subscribers end the stream by closing the connection or by
+		// sending >quit or EOT. Anything else they send is ignored
+		for(int i = 0; i < n; i++)
+		{
+			if(pfds[i].fd < 0 || !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			char buffer[SOCKETBUFFERLEN];
+			ssize_t len = recv(pfds[i].fd, buffer, sizeof(buffer) - 1, 0);
+			if(len < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if(len > 0)
+			{
+				buffer[len] = '\0';
+				if(strstr(buffer, ">quit") == NULL && strchr(buffer, 0x04) == NULL)
+					continue;
+			}
+			stream_remove(pfds[i].fd);
+		}
+	}
+
+	return NULL;
+}
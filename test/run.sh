@@ -48,6 +48,7 @@ cat <<EOT >> pihole-FTL.conf
 DBFILE=pihole-FTL.db
 LOGFILE=pihole-FTL.log
 SOCKETFILE=pihole-FTL.sock
+AUDITLISTFILE=auditlog.list
 EOT
 
 # Start FTL
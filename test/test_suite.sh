@@ -3,6 +3,20 @@
 load 'libs/bats-support/load'
 # load 'libs/bats-assert/load'
 
+# Restart FTL with additional config options, they are removed from the
+# config file again once FTL has read it. All other tests run with the
+# options set up by test/run.sh
+restart_FTL() {
+  kill $(pidof pihole-FTL)
+  while pidof pihole-FTL > /dev/null; do sleep 1; done
+  cp pihole-FTL.conf pihole-FTL.conf.orig
+  printf "%s\n" "$@" >> pihole-FTL.conf
+  ./pihole-FTL travis-ci
+  mv pihole-FTL.conf.orig pihole-FTL.conf
+  n=0
+  until [ $n -ge 45 ] || nc -z -w 30 127.0.0.1 4711; do n=$((n+1)); sleep 1; done
+}
+
 @test "Version" {
   run bash -c 'echo ">version" | nc -v 127.0.0.1 4711'
   echo "output: ${lines[@]}"
@@ -51,6 +65,16 @@ load 'libs/bats-support/load'
   [[ ${lines[4]} == "---EOM---" ]]
 }
 
+@test "Top Clients (all)" {
+  run bash -c 'echo ">top-clients (0)" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "0 4 192.168.2.208" ]]
+  [[ ${lines[2]} =~ "1 2 127.0.0.1" ]]
+  [[ ${lines[3]} =~ "2 1 10.8.0.2" ]]
+  [[ ${lines[4]} == "---EOM---" ]]
+}
+
 @test "Top Domains (descending, default)" {
   run bash -c 'echo ">top-domains" | nc -v 127.0.0.1 4711'
   echo "output: ${lines[@]}"
@@ -73,6 +97,15 @@ load 'libs/bats-support/load'
   [[ ${lines[5]} == "---EOM---" ]]
 }
 
+@test "Top Domains (audit list applied)" {
+  run bash -c 'printf "play.google.com\n*dyndns.org\n" > auditlog.list; sleep 1; echo ">top-domains for audit" | nc -v 127.0.0.1 4711; : > auditlog.list; sleep 1'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} == "0 1 raspberrypi" ]]
+  [[ ${lines[2]} == "1 1 example.com" ]]
+  [[ ${lines[3]} == "---EOM---" ]]
+}
+
 @test "Top Ads (descending, default)" {
   run bash -c 'echo ">top-ads" | nc -v 127.0.0.1 4711'
   echo "output: ${lines[@]}"
@@ -176,6 +209,36 @@ load 'libs/bats-support/load'
   [[ ${lines[2]} == "---EOM---" ]]
 }
 
+@test "Get all queries (paginated)" {
+  run bash -c 'echo ">getallqueries limit 2" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "IPv4 addomain.com" ]]
+  [[ ${lines[2]} =~ "IPv4 blacklisted.com" ]]
+  [[ ${lines[3]} == "total 7" ]]
+  [[ ${lines[4]} =~ ^next\ [0-9]+$ ]]
+  [[ ${lines[5]} == "---EOM---" ]]
+}
+
+@test "Get all queries (client filtered, next page)" {
+  run bash -c 'next=$(echo ">getallqueries-client 192.168.2.208 limit 1" | nc 127.0.0.1 4711 | sed -n "s/^next //p"); echo ">getallqueries-client 192.168.2.208 limit 1 after ${next}" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "IPv4 blacklisted.com" ]]
+  [[ ${lines[2]} == "total 4" ]]
+  [[ ${lines[3]} =~ ^next\ [0-9]+$ ]]
+  [[ ${lines[4]} == "---EOM---" ]]
+}
+
+@test "Get all queries (client filtered, last page)" {
+  run bash -c 'next=$(echo ">getallqueries-client 127.0.0.1 limit 1" | nc 127.0.0.1 4711 | sed -n "s/^next //p"); echo ">getallqueries-client 127.0.0.1 limit 1 after ${next}" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "IPv6 raspberrypi" ]]
+  [[ ${lines[2]} == "total 2" ]]
+  [[ ${lines[3]} == "---EOM---" ]]
+}
+
 @test "Memory" {
   run bash -c 'echo ">memory" | nc -v 127.0.0.1 4711'
   echo "output: ${lines[@]}"
@@ -201,6 +264,20 @@ load 'libs/bats-support/load'
   [[ ${lines[2]} == "---EOM---" ]]
 }
 
+@test "Cache info" {
+  run bash -c 'echo ">cacheinfo" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ "cache-size: " ]]
+  [[ ${lines[2]} =~ "cache-live-freed: " ]]
+  [[ ${lines[3]} =~ "cache-inserted: " ]]
+  [[ ${lines[4]} =~ ^"blocklist-domains: "[0-9]+$ ]]
+  [[ ${lines[5]} =~ ^"bloom-filter-size: "[0-9]+$ ]]
+  [[ ${lines[6]} =~ ^"bloom-filter-fpr-expected: "[0-9]+\.[0-9]{6}$ ]]
+  [[ ${lines[7]} =~ ^"bloom-filter-fpr-observed: "[0-9]+\.[0-9]{6}$ ]]
+  [[ ${lines[8]} == "---EOM---" ]]
+}
+
 # @test "IPv6 socket connection" {
 #   run bash -c 'echo ">recentBlocked" | nc -v ::1 4711'
 #   echo "output: ${lines[@]}"
@@ -212,13 +289,114 @@ load 'libs/bats-support/load'
 @test "DB test: Tables created and populated?" {
   run bash -c 'sqlite3 pihole-FTL.db .dump'
   echo "output: ${lines[@]}"
-  [[ "${lines[@]}" == *"CREATE TABLE queries ( id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain TEXT NOT NULL, client TEXT NOT NULL, forward TEXT );"* ]]
+  [[ "${lines[@]}" == *"CREATE TABLE query_storage ( id INTEGER PRIMARY KEY AUTOINCREMENT, timestamp INTEGER NOT NULL, type INTEGER NOT NULL, status INTEGER NOT NULL, domain INTEGER NOT NULL, client INTEGER NOT NULL, forward INTEGER );"* ]]
+  [[ "${lines[@]}" == *"CREATE TABLE domains ( id INTEGER PRIMARY KEY, domain TEXT NOT NULL UNIQUE );"* ]]
+  [[ "${lines[@]}" == *"CREATE TABLE clients ( id INTEGER PRIMARY KEY, ip TEXT NOT NULL UNIQUE );"* ]]
+  [[ "${lines[@]}" == *"CREATE TABLE upstreams ( id INTEGER PRIMARY KEY, ip TEXT NOT NULL UNIQUE );"* ]]
+  [[ "${lines[@]}" == *"CREATE VIEW queries AS SELECT query_storage.id AS id, timestamp, type, status, domains.domain AS domain, clients.ip AS client, upstreams.ip AS forward FROM query_storage"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE ftl ( id INTEGER PRIMARY KEY NOT NULL, value BLOB NOT NULL );"* ]]
   [[ "${lines[@]}" == *"CREATE TABLE counters ( id INTEGER PRIMARY KEY NOT NULL, value INTEGER NOT NULL );"* ]]
   [[ "${lines[@]}" == *"INSERT INTO \"counters\" VALUES(0,0);"* ]]
   [[ "${lines[@]}" == *"INSERT INTO \"counters\" VALUES(1,0);"* ]]
-  [[ "${lines[@]}" == *"INSERT INTO \"ftl\" VALUES(0,2);"* ]]
-  [[ "${lines[@]}" == *"CREATE INDEX idx_queries_timestamps ON queries (timestamp);"* ]]
+  [[ "${lines[@]}" == *"INSERT INTO \"counters\" VALUES(2,0);"* ]]
+  [[ "${lines[@]}" == *"CREATE TABLE rollup_hourly ( timestamp INTEGER NOT NULL, kind INTEGER NOT NULL, item INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (timestamp, kind, item) ) WITHOUT ROWID;"* ]]
+  [[ "${lines[@]}" == *"CREATE TABLE rollup_daily ( timestamp INTEGER NOT NULL, kind INTEGER NOT NULL, item INTEGER NOT NULL, count INTEGER NOT NULL, PRIMARY KEY (timestamp, kind, item) ) WITHOUT ROWID;"* ]]
+  [[ "${lines[@]}" == *"INSERT INTO \"ftl\" VALUES(0,6);"* ]]
+  [[ "${lines[@]}" == *"CREATE INDEX idx_queries_time ON query_storage (timestamp, id, status, type, client, domain);"* ]]
+  [[ "${lines[@]}" == *"CREATE INDEX idx_queries_client ON query_storage (client, timestamp, id, status, type, domain);"* ]]
+  [[ "${lines[@]}" == *"CREATE INDEX idx_queries_domain ON query_storage (domain, timestamp, id, status, type, client);"* ]]
+}
+
+@test "DB test: Queries stored in the database" {
+  run bash -c 'for i in $(seq 1 70); do [[ $(sqlite3 pihole-FTL.db "SELECT value FROM counters WHERE id = 0;") == "7" ]] && break; sleep 1; done; sqlite3 pihole-FTL.db "SELECT value FROM counters WHERE id = 0;"'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "7" ]]
+}
+
+@test "DB test: Database statistics" {
+  run bash -c 'echo ">dbstats" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} == "queries in database: 7" ]]
+  [[ ${lines[4]} =~ ^"oldest query: "[0-9]+$ ]]
+  [[ ${lines[5]} =~ ^"newest query: "[0-9]+$ ]]
+  [[ ${lines[6]} == "status unknown: 0" ]]
+  [[ ${lines[7]} == "status gravity: 1" ]]
+  [[ ${lines[8]} == "status forwarded: 3" ]]
+  [[ ${lines[9]} == "status cached: 2" ]]
+  [[ ${lines[10]} == "status wildcard: 0" ]]
+  [[ ${lines[11]} == "status blacklist: 1" ]]
+  [[ ${lines[12]} == "status external blocked: 0" ]]
+  [[ ${lines[13]} =~ ^"pages: "[0-9]+$ ]]
+  [[ ${lines[16]} =~ ^"WAL size: "[0-9]+$ ]]
+  [[ ${lines[17]} =~ ^"commits: "[0-9]+$ ]]
+  [[ ${lines[24]} =~ ^"checkpoints: "[0-9]+$ ]]
+  [[ ${lines[25]} == "---EOM---" ]]
+}
+
+@test "DB test: Queries (first page)" {
+  run bash -c 'echo ">dbqueries 0 $(date +%s) (2)" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ " A addomain.com 192.168.2.208 1 " ]]
+  [[ ${lines[2]} =~ " A blacklisted.com 192.168.2.208 5 " ]]
+  [[ ${lines[3]} =~ ^next\ [0-9]+\ [0-9]+$ ]]
+  [[ ${lines[4]} == "---EOM---" ]]
+}
+
+@test "DB test: Queries (next page)" {
+  run bash -c 'until=$(date +%s); next=$(echo ">dbqueries 0 ${until} (2)" | nc 127.0.0.1 4711 | sed -n "s/^next //p"); echo ">dbqueries 0 ${until} after ${next} (2)" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ " AAAA play.google.com 192.168.2.208 2 " ]]
+  [[ ${lines[2]} =~ " A play.google.com 192.168.2.208 2 " ]]
+  [[ ${lines[3]} =~ ^next\ [0-9]+\ [0-9]+$ ]]
+  [[ ${lines[4]} == "---EOM---" ]]
+}
+
+@test "DB test: Queries (client filtered, cursor beyond interval)" {
+  run bash -c 'echo ">dbqueries 0 $(date +%s) client 127.0.0.1 after 2147483647 0" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ " A checkip.dyndns.org 127.0.0.1 2 " ]]
+  [[ ${lines[2]} =~ " AAAA raspberrypi 127.0.0.1 3 " ]]
+  [[ ${lines[3]} == "---EOM---" ]]
+}
+
+@test "History summary" {
+  run bash -c 'echo ">history-summary 0 $(date +%s)" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} == "dns_queries 7" ]]
+  [[ ${lines[2]} == "ads_blocked 2" ]]
+  [[ ${lines[3]} == "queries_forwarded 3" ]]
+  [[ ${lines[4]} == "queries_cached 2" ]]
+  [[ ${lines[5]} =~ "reply_NODATA" ]]
+  [[ ${lines[6]} =~ "reply_NXDOMAIN" ]]
+  [[ ${lines[7]} =~ "reply_CNAME" ]]
+  [[ ${lines[8]} =~ "reply_IP" ]]
+  [[ ${lines[9]} == "---EOM---" ]]
+}
+
+@test "History top domains" {
+  run bash -c 'echo ">history-top-domains 0 $(date +%s) (3)" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} == "0 2 play.google.com" ]]
+  [[ ${lines[2]} =~ "1 1 " ]]
+  [[ ${lines[3]} =~ "2 1 " ]]
+  [[ ${lines[4]} == "---EOM---" ]]
+}
+
+@test "History top domains (all)" {
+  run bash -c 'echo ">history-top-domains 0 $(date +%s) (0)" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} == "0 2 play.google.com" ]]
+  [[ ${lines[2]} =~ "1 1 " ]]
+  [[ ${lines[3]} =~ "2 1 " ]]
+  [[ ${lines[4]} =~ "3 1 " ]]
+  [[ ${lines[5]} == "---EOM---" ]]
 }
 
 @test "Arguments check: Invalid option" {
@@ -234,6 +412,16 @@ load 'libs/bats-support/load'
   [[ ${lines[0]} == "pihole-FTL - The Pi-hole FTL engine" ]]
 }
 
+@test "Compile block lists into binary images" {
+  run bash -c 'rm -rf gravity-test && mkdir gravity-test && cd gravity-test && printf "GRAVITYFILE=gravity.list\nBLACKLISTFILE=black.list\nLOGFILE=pihole-FTL.log\n" > pihole-FTL.conf && printf "addomain.com\nads.example.com\n" > gravity.list && printf "blacklisted.com\n" > black.list && ../pihole-FTL --compile-gravity; echo "exit $?"; ls gravity.list.bin black.list.bin'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} =~ "Compiled gravity.list: 2 domains" ]]
+  [[ ${lines[1]} =~ "Compiled black.list: 1 domains" ]]
+  [[ ${lines[2]} == "exit 0" ]]
+  [[ ${lines[3]} == "black.list.bin" ]]
+  [[ ${lines[4]} == "gravity.list.bin" ]]
+}
+
 @test "Unix socket returning data" {
   run bash -c './socket-test travis'
   echo "output: ${lines[@]}"
@@ -242,6 +430,47 @@ load 'libs/bats-support/load'
   [[ ${lines[2]} == "d2 ff ff ff ff d2 00 00 00 07 d2 00 00 00 02 ca 41 e4 92 49 d2 00 00 00 06 d2 00 00 00 03 d2 00 00 00 02 d2 00 00 00 03 d2 00 00 00 03 cc 02 c1 " ]]
 }
 
+# The following tests send further DNS queries, they have to be run after
+# all tests that check the statistics of the queries above
+@test "Live query stream" {
+  run bash -c '(echo ">stream"; sleep 1; dig +short @127.0.0.1 localhost > /dev/null; sleep 1; echo ">quit") | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} == "dropped 0" ]]
+  [[ ${lines[2]} == "---EOM---" ]]
+  [[ ${lines[3]} =~ " localhost " ]]
+  [[ ${lines[4]} == "dropped 0" ]]
+  [[ ${lines[5]} == "---EOM---" ]]
+  [[ ${#lines[@]} == 6 ]]
+}
+
+@test "Live query stream (status filtered)" {
+  run bash -c '(echo ">stream status 1"; sleep 1; dig +short @127.0.0.1 localhost > /dev/null; sleep 1; echo ">quit") | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} == "dropped 0" ]]
+  [[ ${lines[2]} == "---EOM---" ]]
+  [[ ${#lines[@]} == 3 ]]
+}
+
+@test "DB test: Partitioned queries are served through the API" {
+  restart_FTL "DBPARTITION=day" "DBINTERVAL=0.1"
+  run bash -c 'from=$(date +%s); dig +short @127.0.0.1 localhost > /dev/null; part="pihole-FTL.db.$(date -u +%Y%m%d)"; for i in $(seq 1 30); do [[ -f ${part} && $(sqlite3 ${part} "SELECT COUNT(*) FROM query_storage;") -gt 0 ]] && break; sleep 1; done; echo ">dbqueries ${from} $(date +%s) domain localhost" | nc -v 127.0.0.1 4711'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} == "Connection to 127.0.0.1 4711 port [tcp/*] succeeded!" ]]
+  [[ ${lines[1]} =~ " A localhost 127.0.0.1 " ]]
+  [[ ${lines[2]} == "---EOM---" ]]
+}
+
+@test "API cache serves repeated requests until the lists are reloaded" {
+  restart_FTL "APICACHETTL=60"
+  run bash -c 'kill -HUP $(pidof pihole-FTL); sleep 1; echo ">stats" | nc 127.0.0.1 4711 | grep dns_queries_today; dig +short @127.0.0.1 localhost > /dev/null; echo ">stats" | nc 127.0.0.1 4711 | grep dns_queries_today; kill -HUP $(pidof pihole-FTL); sleep 1; echo ">stats" | nc 127.0.0.1 4711 | grep dns_queries_today'
+  echo "output: ${lines[@]}"
+  [[ ${lines[0]} =~ ^"dns_queries_today "[0-9]+$ ]]
+  [[ ${lines[1]} == ${lines[0]} ]]
+  [[ ${lines[2]} != ${lines[0]} ]]
+}
+
 @test "Verify no FATAL warnings are present in the generated log" {
   run bash -c 'grep -c "FATAL" pihole-FTL.log'
   echo "output: ${lines[@]}"
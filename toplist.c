@@ -0,0 +1,254 @@
+/* Pi-hole: A black hole for Internet advertisements
+*  (c) 2018 Pi-hole, LLC (https://pi-hole.net)
+*  Network-wide ad blocking via your own hardware.
+*
+*  FTL Engine
+*  Incrementally sorted top lists of domains and clients
+*
+*  This file is copyright under the latest version of the EUPL.
+*  Please see LICENSE file for your rights under this license. */
+
+#include "FTL.h"
+
+// Each top list keeps the IDs of all domains or clients ordered by
+// descending count, together with the position of every ID in this order.
+// Counters only ever change by one, so an entry is moved into place by
+// swapping it with the first (or last) entry of the run of entries sharing
+// its previous count. The run boundary is found by binary search
+typedef struct {
+	int *order;
+	int *pos;
+	int size;
+	int capacity;
+} toplistStruct;
+
+static toplistStruct toplist[TOPLIST_MAX];
+// The lists are built once all history has been imported, see toplist_init()
+static bool toplistready = false;
+
+// Value the given list is ordered by
+static int toplist_key(int list, int ID)
+{
+	switch(list)
+	{
+		case TOPLIST_DOMAINS:
+			// Count only permitted queries
+			return domains[ID].count - domains[ID].blockedcount;
+		case TOPLIST_ADS:
+			return domains[ID].blockedcount;
+		case TOPLIST_CLIENTS:
+			return clients[ID].count;
+		default:
+			return clients[ID].blockedcount;
+	}
+}
+
+static void toplist_swap(toplistStruct *top, int a, int b)
+{
+	int ID = top->order[a];
+	top->order[a] = top->order[b];
+	top->order[b] = ID;
+	top->pos[top->order[a]] = a;
+	top->pos[top->order[b]] = b;
+}
+
+// Restore the order after the value of the given ID changed by one
+static void toplist_moved(int list, int ID, int change)
+{
+	toplistStruct *top = &toplist[list];
+	int p = top->pos[ID], value = toplist_key(list, ID);
+	int lo, hi;
+
+	if(change > 0)
+	{
+		// Find the first entry before this one with a smaller value
+		lo = 0, hi = p;
+		while(lo < hi)
+		{
+			int mid = lo + (hi - lo)/2;
+			if(toplist_key(list, top->order[mid]) < value)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		toplist_swap(top, lo, p);
+	}
+	else
+	{
+		// Find the first entry after this one which is not larger
+		lo = p + 1, hi = top->size;
+		while(lo < hi)
+		{
+			int mid = lo + (hi - lo)/2;
+			if(toplist_key(list, top->order[mid]) <= value)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		toplist_swap(top, lo - 1, p);
+	}
+}
+
+// Append an ID to the end of a list, growing it if needed
+static void toplist_append(int list, int ID)
+{
+	toplistStruct *top = &toplist[list];
+	if(ID >= top->capacity)
+	{
+		int capacity = top->capacity > 0 ? 2*top->capacity : 1024;
+		while(capacity <= ID)
+			capacity *= 2;
+		int *order = realloc(top->order, capacity*sizeof(int));
+		int *pos = order != NULL ? realloc(top->pos, capacity*sizeof(int)) : NULL;
+		if(order == NULL || pos == NULL)
+		{
+			logg("FATAL: Memory allocation failed! Exiting");
+			exit(EXIT_FAILURE);
+		}
+		top->order = order;
+		top->pos = pos;
+		top->capacity = capacity;
+	}
+	top->order[top->size] = ID;
+	top->pos[ID] = top->size;
+	top->size++;
+}
+
+// List used by toplist_cmp() while building the lists
+static int sortlist;
+
+// qsort subroutine, sort DESC, ties by ID
+static int toplist_cmp(const void *a, const void *b)
+{
+	int ID1 = *(const int*)a, ID2 = *(const int*)b;
+	int value1 = toplist_key(sortlist, ID1), value2 = toplist_key(sortlist, ID2);
+
+	if(value1 != value2)
+		return value1 > value2 ? -1 : 1;
+	return ID1 < ID2 ? -1 : (ID1 > ID2);
+}
+
+// Build the lists from the current counters. Called once after the history
+// has been imported, from then on they are kept in order as counters change
+void toplist_init(void)
+{
+	for(int list = 0; list < TOPLIST_MAX; list++)
+	{
+		int n = (list == TOPLIST_DOMAINS || list == TOPLIST_ADS) ? counters.domains : counters.clients;
+		toplist[list].size = 0;
+		for(int ID = 0; ID < n; ID++)
+			toplist_append(list, ID);
+
+		if(n == 0)
+			continue;
+
+		sortlist = list;
+		qsort(toplist[list].order, n, sizeof(int), toplist_cmp);
+		for(int i = 0; i < n; i++)
+			toplist[list].pos[toplist[list].order[i]] = i;
+	}
+	toplistready = true;
+}
+
+// Move an entry which was appended with a nonzero value into place
+static void toplist_settle(int list, int ID)
+{
+	int value = toplist_key(list, ID);
+	toplistStruct *top = &toplist[list];
+	while(value > 0 && top->pos[ID] > 0 &&
+	      toplist_key(list, top->order[top->pos[ID] - 1]) < value)
+	{
+		// Jump over the whole run of entries with the next smaller value
+		int p = top->pos[ID], smaller = toplist_key(list, top->order[p - 1]);
+		int lo = 0, hi = p;
+		while(lo < hi)
+		{
+			int mid = lo + (hi - lo)/2;
+			if(toplist_key(list, top->order[mid]) <= smaller)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		toplist_swap(top, lo, p);
+	}
+}
+
+// Add a new domain to the lists, its counters have to be set already
+void toplist_add_domain(int domainID)
+{
+	if(!toplistready)
+		return;
+
+	toplist_append(TOPLIST_DOMAINS, domainID);
+	toplist_settle(TOPLIST_DOMAINS, domainID);
+	toplist_append(TOPLIST_ADS, domainID);
+	toplist_settle(TOPLIST_ADS, domainID);
+}
+
+void toplist_add_client(int clientID)
+{
+	if(!toplistready)
+		return;
+
+	toplist_append(TOPLIST_CLIENTS, clientID);
+	toplist_settle(TOPLIST_CLIENTS, clientID);
+	toplist_append(TOPLIST_BLOCKED_CLIENTS, clientID);
+	toplist_settle(TOPLIST_BLOCKED_CLIENTS, clientID);
+}
+
+// Change the counters of a domain by the given amounts (-1, 0 or 1) and
+// keep the top lists in order
+void domain_count_change(int domainID, int count, int blockedcount)
+{
+	domains[domainID].count += count;
+	domains[domainID].blockedcount += blockedcount;
+
+	if(!toplistready)
+		return;
+
+	if(count - blockedcount != 0)
+		toplist_moved(TOPLIST_DOMAINS, domainID, count - blockedcount);
+	if(blockedcount != 0)
+		toplist_moved(TOPLIST_ADS, domainID, blockedcount);
+}
+
+void client_count_change(int clientID, int count, int blockedcount)
+{
+	clients[clientID].count += count;
+	clients[clientID].blockedcount += blockedcount;
+
+	if(!toplistready)
+		return;
+
+	if(count != 0)
+		toplist_moved(TOPLIST_CLIENTS, clientID, count);
+	if(blockedcount != 0)
+		toplist_moved(TOPLIST_BLOCKED_CLIENTS, clientID, blockedcount);
+}
+
+// Number of entries in a list, optionally only those with a nonzero value
+int toplist_size(int list, bool nonzero)
+{
+	toplistStruct *top = &toplist[list];
+	if(!nonzero)
+		return top->size;
+
+	int lo = 0, hi = top->size;
+	while(lo < hi)
+	{
+		int mid = lo + (hi - lo)/2;
+		if(toplist_key(list, top->order[mid]) <= 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+// ID at the given rank (0 = largest value) and the value it is ranked by
+int toplist_get(int list, int rank, int *value)
+{
+	int ID = toplist[list].order[rank];
+	*value = toplist_key(list, ID);
+	return ID;
+}
@@ -0,0 +1,5 @@
+#define GIT_VERSION "2987d93"
+#define GIT_DATE "2026-10-18 16:08:07 +0000"
+#define GIT_BRANCH "master"
+#define GIT_TAG ""
+#define GIT_HASH "2987d93"